@@ -13,4 +13,6 @@ for dir in $directories; do
 	fi
 done
 
+make -C tools/mkramfs clean
+
 make -C microk-kernel clean
@@ -51,3 +51,11 @@
 
 #define CONFIG_SYMBOL_TABLE_BASE 0xffffffffffff0000
 #define CONFIG_SYMBOL_TABLE_PAGES (2)
+
+/*
+ * Filesystem Settings
+ */
+
+#define CONFIG_FS_RAMFS_COMPRESSION 1
+#undef CONFIG_FS_VFSBENCH
+#undef CONFIG_FS_PAGECACHE_TEST
@@ -83,6 +83,28 @@ namespace AHCI {
         }
 
         bool Port::TransferDMA(bool write, uint64_t sector, uint32_t sectorCount, void* buffer) {
+                DMASegment segment;
+                segment.buffer = buffer;
+                segment.length = sectorCount << 9; // 512 bytes per sector
+
+                return TransferDMAV(write, sector, &segment, 1);
+        }
+
+        bool Port::TransferDMAV(bool write, uint64_t sector, const DMASegment *segments, uint32_t count) {
+                // The whole list goes out as a single command, one PRDT entry per segment
+                if (count == 0 || count > AHCI_MAX_PRDT) return false;
+
+                uint64_t totalBytes = 0;
+                for (uint32_t i = 0; i < count; i++) {
+                        if (segments[i].length == 0 || segments[i].length > AHCI_MAX_PRDT_BYTES) return false;
+                        if (segments[i].length & 1) return false;
+                        totalBytes += segments[i].length;
+                }
+
+                if (totalBytes & 511) return false;
+                uint32_t sectorCount = totalBytes >> 9;
+                if (sectorCount > 0xFFFF) return false;
+
                 // Control if busy
                 uint64_t spin = 0;
                 while ((hbaPort->taskFileData & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin < 1000000){
@@ -99,15 +121,19 @@ namespace AHCI {
                 HBACommandHeader *cmdHeader = (HBACommandHeader*)hbaPort->commandListBase;
                 cmdHeader->commandFISLength = sizeof(FIS_REG_H2D)/sizeof(uint32_t); // Command FIS size
                 cmdHeader->write = write ? 1 : 0; // Is this a write
-                cmdHeader->prdtLength = 1;
+                cmdHeader->prdtLength = count;
 
                 HBACommandTable *commandTable = (HBACommandTable*)(cmdHeader->commandTableBaseAddress);
-                Memset(commandTable, 0, sizeof(HBACommandTable) + (cmdHeader->prdtLength-1)*sizeof(HBAPRDTEntry));
+                Memset(commandTable, 0, sizeof(HBACommandTable) + cmdHeader->prdtLength*sizeof(HBAPRDTEntry));
 
-                commandTable->prdtEntry[0].dataBaseAddress = (uint32_t)(uint64_t)buffer;
-                commandTable->prdtEntry[0].dataBaseAddressUpper = (uint32_t)((uint64_t)buffer >> 32);
-                commandTable->prdtEntry[0].byteCount = (sectorCount<<9)-1; // 512 bytes per sector
-                commandTable->prdtEntry[0].interruptOnCompletion = 1;
+                for (uint32_t i = 0; i < count; i++) {
+                        commandTable->prdtEntry[i].dataBaseAddress = (uint32_t)(uint64_t)segments[i].buffer;
+                        commandTable->prdtEntry[i].dataBaseAddressUpper = (uint32_t)((uint64_t)segments[i].buffer >> 32);
+                        commandTable->prdtEntry[i].byteCount = segments[i].length - 1;
+                }
+
+                // Only the last entry has to tell us it's done
+                commandTable->prdtEntry[count - 1].interruptOnCompletion = 1;
 
                 FIS_REG_H2D *cmdFIS = (FIS_REG_H2D*)(&commandTable->commandFIS);
 
@@ -150,6 +176,14 @@ namespace AHCI {
                 return TransferDMA(false, sector, sectorCount, buffer);
         }
 
+        bool Port::WriteV(uint64_t sector, const DMASegment *segments, uint32_t count) {
+                return TransferDMAV(true, sector, segments, count);
+        }
+
+        bool Port::ReadV(uint64_t sector, const DMASegment *segments, uint32_t count) {
+                return TransferDMAV(false, sector, segments, count);
+        }
+
         AHCIDriver::AHCIDriver(PCI::PCIDeviceHeader *pciBaseAddress) {
                 this->PCIBaseAddress = pciBaseAddress;
                 PrintK("AHCI instance initialized.\r\n");
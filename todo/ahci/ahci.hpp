@@ -12,6 +12,9 @@ namespace AHCI {
 
         #define HBA_PxIS_TFES       (1 << 30)
 
+        #define AHCI_MAX_PRDT         8           // PRDT entries that fit in a command table (see Port::Configure)
+        #define AHCI_MAX_PRDT_BYTES   (4 << 20)   // The most a single PRDT entry can move
+
         enum PortType {
                 None = 0,
                 SATA = 1,
@@ -137,6 +140,12 @@ namespace AHCI {
                 HBAPRDTEntry prdtEntry[];
         };
 
+        // A piece of a scatter/gather transfer, its length has to be even
+        struct DMASegment {
+                void *buffer;
+                uint32_t length;
+        };
+
         class Port {
         public:
                 HBAPort* hbaPort;
@@ -149,8 +158,11 @@ namespace AHCI {
                 void StopCMD();
                 bool Read(uint64_t sector, uint32_t sectorCount, void* buffer);
                 bool Write(uint64_t sector, uint32_t sectorCount, void* buffer);
+                bool ReadV(uint64_t sector, const DMASegment *segments, uint32_t count);
+                bool WriteV(uint64_t sector, const DMASegment *segments, uint32_t count);
         private:
                 bool TransferDMA(bool write, uint64_t sector, uint32_t sectorCount, void* buffer);
+                bool TransferDMAV(bool write, uint64_t sector, const DMASegment *segments, uint32_t count);
         };
 
         class AHCIDriver {
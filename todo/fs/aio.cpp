@@ -0,0 +1,181 @@
+#include <fs/aio.hpp>
+#include <mm/pmm.hpp>
+#include <mm/string.hpp>
+
+static inline bool IsPowerOfTwo(uint32_t value) {
+	return value != 0 && (value & (value - 1)) == 0;
+}
+
+static inline bool IsUserRange(uint64_t address, uint64_t length) {
+	// Never a kernel address, and the end can't wrap around into one
+	if (address == 0) return false;
+	if (length > AIO_USER_END) return false;
+
+	return address <= AIO_USER_END - length;
+}
+
+static bool CopyPath(char *path, uint64_t address, uint64_t length) {
+	// The path is copied first, the caller could change it while we walk it
+	if (length == 0 || length >= AIO_PATH_MAX) return false;
+	if (!IsUserRange(address, length)) return false;
+
+	memcpy(path, (const char*)address, length);
+	path[length] = '\0';
+
+	return true;
+}
+
+bool AIORing::Init(FDTable *fdTable, uint32_t sqEntries, uint32_t cqEntries) {
+	if (fdTable == NULL) return false;
+	if (!IsPowerOfTwo(sqEntries) || sqEntries > AIO_MAX_ENTRIES) return false;
+	if (!IsPowerOfTwo(cqEntries) || cqEntries > AIO_MAX_ENTRIES) return false;
+
+	uint64_t sqOffset = (sizeof(AIORingShared) + 63) & ~63;
+	uint64_t cqOffset = sqOffset + sizeof(AIOSubmission) * sqEntries;
+	uint64_t size = cqOffset + sizeof(AIOCompletion) * cqEntries;
+
+	// One contiguous block, so it can be mapped in the caller's space in one go
+	sharedPages = (size + VFS_PAGE_SIZE - 1) / VFS_PAGE_SIZE;
+	shared = (AIORingShared*)PMM::RequestPages(sharedPages);
+	if (shared == NULL) return false;
+
+	memset(shared, 0, sharedPages * VFS_PAGE_SIZE);
+	shared->sqSize = sqEntries;
+	shared->cqSize = cqEntries;
+	shared->sqOffset = sqOffset;
+	shared->cqOffset = cqOffset;
+
+	// What the caller sees is only a copy, these are the ones that count
+	submissions = (AIOSubmission*)((uint8_t*)shared + sqOffset);
+	completions = (AIOCompletion*)((uint8_t*)shared + cqOffset);
+	sqSize = sqEntries;
+	cqSize = cqEntries;
+	sqHead = cqTail = 0;
+
+	table = fdTable;
+	return true;
+}
+
+void AIORing::Destroy() {
+	if (shared == NULL) return;
+
+	PMM::FreePages(shared, sharedPages);
+	shared = NULL;
+}
+
+void AIORing::Run(const AIOSubmission *submission, AIOCompletion *completion) {
+	completion->userData = submission->userData;
+	completion->result = 0;
+	completion->status = AIO_STATUS_OK;
+	completion->rsv0 = 0;
+
+	if (submission->flags != 0) {
+		completion->status = AIO_STATUS_INVALID;
+		return;
+	}
+
+	switch (submission->opcode) {
+		case AIO_OP_NOP:
+			return;
+		case AIO_OP_OPEN: {
+			char path[AIO_PATH_MAX];
+			if (!CopyPath(path, submission->buffer, submission->length)) break;
+
+			FSNode *dir = NULL;
+			FILE *dirFile = NULL;
+			if (submission->fd != FDTABLE_INVALID) {
+				dirFile = table->Get(submission->fd);
+				if (dirFile == NULL) break;
+				dir = dirFile->node;
+			} else {
+				VFilesystem *rootfs = VFS::GetRootFS();
+				if (rootfs == NULL) {
+					completion->status = AIO_STATUS_ERROR;
+					return;
+				}
+
+				dir = rootfs->node;
+			}
+
+			// The directory can't be closed under us while we hold its file
+			FSNode *node = VFS::GetNodeAt(dir, path);
+			VFS::PutFile(dirFile);
+			if (node == NULL) {
+				completion->status = AIO_STATUS_ERROR;
+				return;
+			}
+
+			// The open file takes its own reference to the node
+			uint64_t fd = VFS::OpenDescriptor(table, node);
+			VFS::PutNode(node);
+
+			if (fd == FDTABLE_INVALID) completion->status = AIO_STATUS_ERROR;
+			else completion->result = fd;
+			return;
+		}
+		case AIO_OP_READ:
+		case AIO_OP_WRITE: {
+			FILE *file = table->Get(submission->fd);
+			if (file == NULL) break;
+			if (!IsUserRange(submission->buffer, submission->length)) {
+				VFS::PutFile(file);
+				break;
+			}
+
+			FSIOVec vector;
+			vector.buffer = (uint8_t*)submission->buffer;
+			vector.length = submission->length;
+
+			if (submission->opcode == AIO_OP_READ) completion->result = VFS::ReadFileV(file, submission->offset, &vector, 1);
+			else completion->result = VFS::WriteFileV(file, submission->offset, &vector, 1);
+			VFS::PutFile(file);
+
+			if (completion->result < submission->length && submission->opcode == AIO_OP_WRITE) completion->status = AIO_STATUS_ERROR;
+			return;
+		}
+		case AIO_OP_CLOSE:
+			if (VFS::CloseDescriptor(table, submission->fd) != 0) completion->status = AIO_STATUS_ERROR;
+			return;
+		default:
+			break;
+	}
+
+	completion->status = AIO_STATUS_INVALID;
+}
+
+uint64_t AIORing::Submit(uint64_t toSubmit) {
+	if (shared == NULL) return 0;
+
+	uint32_t sqMask = sqSize - 1;
+	uint32_t cqMask = cqSize - 1;
+
+	// A tail that is further than a whole ring away is garbage, there's nothing to take
+	uint32_t sqTail = __atomic_load_n(&shared->sq.tail, __ATOMIC_ACQUIRE);
+	if (sqTail - sqHead > sqSize) return 0;
+
+	uint64_t done = 0;
+	while (done < toSubmit && sqHead != sqTail) {
+		// Never take a submission we couldn't post the completion of
+		uint32_t cqHead = __atomic_load_n(&shared->cq.head, __ATOMIC_ACQUIRE);
+		if (cqTail - cqHead > cqMask) {
+			shared->overflows++;
+			break;
+		}
+
+		// Work on a copy, the caller owns the shared entry again as soon as head moves
+		AIOSubmission submission = submissions[sqHead & sqMask];
+		sqHead++;
+		__atomic_store_n(&shared->sq.head, sqHead, __ATOMIC_RELEASE);
+
+		// Same for the completion, it's only posted once it's whole
+		AIOCompletion completion;
+		Run(&submission, &completion);
+		completions[cqTail & cqMask] = completion;
+		cqTail++;
+		__atomic_store_n(&shared->cq.tail, cqTail, __ATOMIC_RELEASE);
+
+		done++;
+	}
+
+	return done;
+}
@@ -0,0 +1,260 @@
+#include <fs/dcache.hpp>
+#include <mm/memory.hpp>
+#include <mm/string.hpp>
+
+static DCacheEntry **buckets;
+static DCacheEntry **children; // The same entries, by parent directory. Only writers follow these
+static uint64_t *generations;  // Bumped when a name in the bucket is invalidated
+static uint64_t generation;    // Bumped by the invalidations that drop more than one name
+static DCacheEntry *lruHead;   // Newest
+static DCacheEntry *lruTail;   // Oldest
+static SpinLock cacheLock;     // Taken to change the cache, never to look it up
+static DCacheStats stats;
+
+namespace DCache {
+static inline uint64_t BucketOf(FSDriver *driver, uint64_t parent, uint64_t hash) {
+	uint64_t key = hash ^ (parent * 0x9E3779B97F4A7C15) ^ ((uint64_t)driver >> 4);
+	return (key ^ (key >> 32)) & (DCACHE_BUCKETS - 1);
+}
+
+static inline uint64_t ParentBucketOf(FSDriver *driver, uint64_t parent) {
+	uint64_t key = (parent * 0x9E3779B97F4A7C15) ^ ((uint64_t)driver >> 4);
+	return (key ^ (key >> 32)) & (DCACHE_BUCKETS - 1);
+}
+
+static void LRUUnlink(DCacheEntry *entry) {
+	if (entry->lruPrev != NULL) entry->lruPrev->lruNext = entry->lruNext;
+	else lruHead = entry->lruNext;
+
+	if (entry->lruNext != NULL) entry->lruNext->lruPrev = entry->lruPrev;
+	else lruTail = entry->lruPrev;
+}
+
+static void LRUPushFront(DCacheEntry *entry) {
+	entry->lruPrev = NULL;
+	entry->lruNext = lruHead;
+	if (lruHead != NULL) lruHead->lruPrev = entry;
+	lruHead = entry;
+	if (lruTail == NULL) lruTail = entry;
+}
+
+static void ReclaimEntry(RCUHead *head) {
+	DCacheEntry *entry = (DCacheEntry*)((uint8_t*)head - offsetof(DCacheEntry, rcu));
+
+	// Whoever looked the node up may still be using it, so just drop our reference
+	VFS::PutNode(entry->node);
+	entry->name.Release();
+	Free(entry);
+}
+
+static void Remove(DCacheEntry *entry) {
+	// Called with the lock taken
+	DCacheEntry **link = &buckets[BucketOf(entry->driver, entry->parent, entry->name.hash)];
+	while (*link != entry) link = &(*link)->hashNext;
+	__atomic_store_n(link, entry->hashNext, __ATOMIC_RELEASE);
+
+	if (entry->childPrev != NULL) entry->childPrev->childNext = entry->childNext;
+	else children[ParentBucketOf(entry->driver, entry->parent)] = entry->childNext;
+	if (entry->childNext != NULL) entry->childNext->childPrev = entry->childPrev;
+
+	LRUUnlink(entry);
+	stats.entries--;
+
+	RCU::Retire(&entry->rcu, ReclaimEntry);
+}
+
+static DCacheEntry *Find(FSNode *parent, const FSNameKey *key) {
+	DCacheEntry *entry = __atomic_load_n(&buckets[BucketOf(parent->driver, parent->inode, key->hash)], __ATOMIC_ACQUIRE);
+
+	while (entry != NULL) {
+		if (entry->parent == parent->inode &&
+		    entry->driver == parent->driver &&
+		    entry->name.Equals(key)) return entry;
+
+		entry = __atomic_load_n(&entry->hashNext, __ATOMIC_ACQUIRE);
+	}
+
+	return NULL;
+}
+
+static void Evict() {
+	// Called with the lock taken. Second chance: entries looked up since
+	// they were last here go back to the front, the first one that wasn't goes
+	while (lruTail != NULL && lruTail->referenced) {
+		DCacheEntry *entry = lruTail;
+		entry->referenced = 0;
+		LRUUnlink(entry);
+		LRUPushFront(entry);
+	}
+
+	if (lruTail != NULL) {
+		Remove(lruTail);
+		stats.evictions++;
+	}
+}
+
+void Init() {
+	buckets = (DCacheEntry**)Malloc(sizeof(DCacheEntry*) * DCACHE_BUCKETS);
+	children = (DCacheEntry**)Malloc(sizeof(DCacheEntry*) * DCACHE_BUCKETS);
+	generations = (uint64_t*)Malloc(sizeof(uint64_t) * DCACHE_BUCKETS);
+	for (int i = 0; i < DCACHE_BUCKETS; i++) {
+		buckets[i] = children[i] = NULL;
+		generations[i] = 0;
+	}
+
+	generation = 0;
+	lruHead = lruTail = NULL;
+	cacheLock.locked = 0;
+	memset(&stats, 0, sizeof(DCacheStats));
+}
+
+bool Lookup(FSNode *parent, const FSNameKey *key, FSNode **result) {
+	if (buckets == NULL) return false;
+
+	uint64_t token = RCU::ReadLock();
+
+	DCacheEntry *entry = Find(parent, key);
+	FSNode *node = entry != NULL ? __atomic_load_n(&entry->node, __ATOMIC_ACQUIRE) : NULL;
+
+	// A node on its way out counts as a miss, the driver will have the final word
+	if (entry == NULL || (node != NULL && VFS::TryRefNode(node) == NULL)) {
+		RCU::ReadUnlock(token);
+		__atomic_add_fetch(&stats.misses, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	if (node == NULL) __atomic_add_fetch(&stats.negativeHits, 1, __ATOMIC_RELAXED);
+	else __atomic_add_fetch(&stats.hits, 1, __ATOMIC_RELAXED);
+
+	if (!entry->referenced) __atomic_store_n(&entry->referenced, 1, __ATOMIC_RELAXED);
+
+	RCU::ReadUnlock(token);
+
+	*result = node;
+	return true;
+}
+
+uint64_t GetGeneration(FSNode *parent, const FSNameKey *key) {
+	if (buckets == NULL) return 0;
+
+	// Both only ever grow, so the sum changes whenever one of them does
+	uint64_t bucket = BucketOf(parent->driver, parent->inode, key->hash);
+	return __atomic_load_n(&generations[bucket], __ATOMIC_ACQUIRE) + __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+}
+
+void Insert(FSNode *parent, const FSNameKey *key, FSNode *node, uint64_t since) {
+	if (buckets == NULL) return;
+
+	cacheLock.Lock();
+
+	if (GetGeneration(parent, key) != since) {
+		cacheLock.Unlock();
+		return;
+	}
+
+	DCacheEntry *entry = Find(parent, key);
+	if (entry != NULL) {
+		FSNode *old = entry->node;
+		__atomic_store_n(&entry->node, VFS::RefNode(node), __ATOMIC_RELEASE);
+		cacheLock.Unlock();
+
+		VFS::PutNode(old);
+		return;
+	}
+
+	if (stats.entries >= DCACHE_MAX_ENTRIES) Evict();
+
+	entry = (DCacheEntry*)Malloc(sizeof(DCacheEntry));
+	entry->driver = parent->driver;
+	entry->parent = parent->inode;
+	entry->referenced = 0;
+	if (!entry->name.Set(key)) {
+		cacheLock.Unlock();
+		Free(entry);
+		return;
+	}
+	entry->node = VFS::RefNode(node);
+
+	// The entry is complete before lookups can see it
+	uint64_t bucket = BucketOf(entry->driver, entry->parent, key->hash);
+	entry->hashNext = buckets[bucket];
+	__atomic_store_n(&buckets[bucket], entry, __ATOMIC_RELEASE);
+
+	DCacheEntry **siblings = &children[ParentBucketOf(entry->driver, entry->parent)];
+	entry->childPrev = NULL;
+	entry->childNext = *siblings;
+	if (*siblings != NULL) (*siblings)->childPrev = entry;
+	*siblings = entry;
+
+	LRUPushFront(entry);
+	stats.entries++;
+
+	cacheLock.Unlock();
+}
+
+void Invalidate(FSNode *parent, const FSNameKey *key) {
+	if (buckets == NULL) return;
+
+	cacheLock.Lock();
+
+	// A lookup that went to the driver before this can't cache what it found
+	__atomic_add_fetch(&generations[BucketOf(parent->driver, parent->inode, key->hash)], 1, __ATOMIC_RELEASE);
+
+	DCacheEntry *entry = Find(parent, key);
+	if (entry != NULL) Remove(entry);
+
+	cacheLock.Unlock();
+}
+
+void InvalidateNode(FSNode *node) {
+	if (buckets == NULL) return;
+
+	cacheLock.Lock();
+
+	// A lookup that went to the driver before this can't cache what it found
+	__atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+
+	// The name the node was found by, under its parent
+	if (node->parent != NULL) {
+		FSNameKey key;
+		key.name = node->name.Get();
+		key.length = node->name.length;
+		key.hash = node->name.hash;
+
+		DCacheEntry *entry = Find(node->parent, &key);
+		if (entry != NULL) Remove(entry);
+	}
+
+	// What was looked up in it, negative entries too
+	if ((node->flags & VFS_NODE_TYPE) == VFS_NODE_DIRECTORY) {
+		DCacheEntry *entry = children[ParentBucketOf(node->driver, node->inode)];
+		while (entry != NULL) {
+			DCacheEntry *next = entry->childNext;
+			if (entry->parent == node->inode && entry->driver == node->driver) Remove(entry);
+			entry = next;
+		}
+	}
+
+	cacheLock.Unlock();
+}
+
+void InvalidateDriver(FSDriver *driver) {
+	if (buckets == NULL) return;
+
+	cacheLock.Lock();
+	__atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+
+	DCacheEntry *entry = lruHead;
+	while (entry != NULL) {
+		DCacheEntry *next = entry->lruNext;
+		if (entry->driver == driver) Remove(entry);
+		entry = next;
+	}
+
+	cacheLock.Unlock();
+}
+
+void GetStats(DCacheStats *result) {
+	memcpy(result, &stats, sizeof(DCacheStats));
+}
+}
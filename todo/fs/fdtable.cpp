@@ -0,0 +1,202 @@
+#include <fs/fdtable.hpp>
+#include <mm/memory.hpp>
+#include <mm/string.hpp>
+
+static FDArray *NewArray(uint64_t size) {
+	FDArray *array = (FDArray*)Malloc(sizeof(FDArray) + sizeof(FILE*) * size);
+	if (array == NULL) return NULL;
+
+	array->size = size;
+	array->retired = NULL;
+	memset(array->files, 0, sizeof(FILE*) * size);
+
+	return array;
+}
+
+static inline uint64_t FullWords(uint64_t size) {
+	return (size / 64 + 63) / 64;
+}
+
+bool FDTable::Init() {
+	lock.locked = 0;
+	count = 0;
+
+	array = NewArray(FDTABLE_INITIAL_SIZE);
+	usedMap = (uint64_t*)Malloc(sizeof(uint64_t) * (FDTABLE_INITIAL_SIZE / 64));
+	fullMap = (uint64_t*)Malloc(sizeof(uint64_t) * FullWords(FDTABLE_INITIAL_SIZE));
+	if (array == NULL || usedMap == NULL || fullMap == NULL) return false;
+
+	memset(usedMap, 0, sizeof(uint64_t) * (FDTABLE_INITIAL_SIZE / 64));
+	memset(fullMap, 0, sizeof(uint64_t) * FullWords(FDTABLE_INITIAL_SIZE));
+
+	return true;
+}
+
+void FDTable::Destroy() {
+	// Nobody can be looking the table up anymore, so the old arrays can go too
+	FDArray *current = array;
+	while (current != NULL) {
+		FDArray *next = current->retired;
+		Free(current);
+		current = next;
+	}
+
+	Free(usedMap);
+	Free(fullMap);
+	array = NULL;
+}
+
+bool FDTable::Grow() {
+	// Called with the lock taken
+	uint64_t oldSize = array->size;
+	uint64_t newSize = oldSize * 2;
+	if (newSize > FDTABLE_MAX_SIZE) return false;
+
+	FDArray *newArray = NewArray(newSize);
+	uint64_t *newUsed = (uint64_t*)Malloc(sizeof(uint64_t) * (newSize / 64));
+	uint64_t *newFull = (uint64_t*)Malloc(sizeof(uint64_t) * FullWords(newSize));
+	if (newArray == NULL || newUsed == NULL || newFull == NULL) {
+		if (newArray != NULL) Free(newArray);
+		if (newUsed != NULL) Free(newUsed);
+		if (newFull != NULL) Free(newFull);
+		return false;
+	}
+
+	memcpy(newArray->files, array->files, sizeof(FILE*) * oldSize);
+
+	memset(newUsed, 0, sizeof(uint64_t) * (newSize / 64));
+	memcpy(newUsed, usedMap, sizeof(uint64_t) * (oldSize / 64));
+	memset(newFull, 0, sizeof(uint64_t) * FullWords(newSize));
+	memcpy(newFull, fullMap, sizeof(uint64_t) * FullWords(oldSize));
+
+	Free(usedMap);
+	Free(fullMap);
+	usedMap = newUsed;
+	fullMap = newFull;
+
+	// Lookups switch over as soon as they see the new array
+	newArray->retired = array;
+	__atomic_store_n(&array, newArray, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+uint64_t FDTable::Alloc() {
+	lock.Lock();
+
+	while (true) {
+		uint64_t usedWords = array->size / 64;
+
+		for (uint64_t i = 0; i < FullWords(array->size); i++) {
+			if (fullMap[i] == ~(uint64_t)0) continue;
+
+			uint64_t word = i * 64 + __builtin_ctzll(~fullMap[i]);
+			if (word >= usedWords) break;
+
+			uint64_t fd = word * 64 + __builtin_ctzll(~usedMap[word]);
+
+			usedMap[word] |= (uint64_t)1 << (fd % 64);
+			if (usedMap[word] == ~(uint64_t)0) fullMap[word / 64] |= (uint64_t)1 << (word % 64);
+			count++;
+
+			lock.Unlock();
+			return fd;
+		}
+
+		if (!Grow()) break;
+	}
+
+	lock.Unlock();
+	return FDTABLE_INVALID;
+}
+
+void FDTable::Release(uint64_t fd) {
+	// Called with the lock taken
+	uint64_t word = fd / 64;
+
+	usedMap[word] &= ~((uint64_t)1 << (fd % 64));
+	fullMap[word / 64] &= ~((uint64_t)1 << (word % 64));
+	count--;
+}
+
+void FDTable::Install(uint64_t fd, FILE *file) {
+	lock.Lock();
+
+	if (fd < array->size && (usedMap[fd / 64] & ((uint64_t)1 << (fd % 64)))) {
+		__atomic_store_n(&array->files[fd], file, __ATOMIC_RELEASE);
+		if (file == NULL) Release(fd);
+	}
+
+	lock.Unlock();
+}
+
+FILE *FDTable::Remove(uint64_t fd) {
+	lock.Lock();
+
+	FILE *file = NULL;
+	if (fd < array->size && array->files[fd] != NULL) {
+		file = array->files[fd];
+		__atomic_store_n(&array->files[fd], (FILE*)NULL, __ATOMIC_RELEASE);
+		Release(fd);
+	}
+
+	lock.Unlock();
+	return file;
+}
+
+FILE *FDTable::Get(uint64_t fd) {
+	// The file can be closed as soon as it's loaded, but its memory stays until the read section ends
+	uint64_t token = RCU::ReadLock();
+
+	FDArray *current = __atomic_load_n(&array, __ATOMIC_ACQUIRE);
+	FILE *file = NULL;
+	if (fd < current->size) file = VFS::TryRefFile(__atomic_load_n(&current->files[fd], __ATOMIC_ACQUIRE));
+
+	RCU::ReadUnlock(token);
+	return file;
+}
+
+namespace VFS {
+uint64_t OpenDescriptor(FDTable *table, FSNode *node) {
+	if (table == NULL) return FDTABLE_INVALID;
+	if (node == NULL) return FDTABLE_INVALID;
+	if (node->driver == NULL) return FDTABLE_INVALID;
+
+	// The descriptor is taken first, so the driver gets to know it
+	uint64_t fd = table->Alloc();
+	if (fd == FDTABLE_INVALID) return FDTABLE_INVALID;
+
+	FILE *file = OpenFile(node, fd);
+
+	// Installing NULL gives the descriptor back
+	table->Install(fd, file);
+	if (file == NULL) return FDTABLE_INVALID;
+
+	return fd;
+}
+
+FILE *GetDescriptor(FDTable *table, uint64_t fd) {
+	if (table == NULL) return NULL;
+
+	return table->Get(fd);
+}
+
+uint64_t CloseDescriptor(FDTable *table, uint64_t fd) {
+	if (table == NULL) return 1;
+
+	FILE *file = table->Remove(fd);
+	if (file == NULL) return 1;
+
+	CloseFile(file);
+	return 0;
+}
+
+void CloseAllDescriptors(FDTable *table) {
+	if (table == NULL) return;
+
+	for (uint64_t fd = 0; fd < table->GetSize() && table->GetCount() > 0; fd++) {
+		FILE *file = table->Remove(fd);
+		if (file != NULL) CloseFile(file);
+	}
+}
+}
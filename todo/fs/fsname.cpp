@@ -0,0 +1,92 @@
+#include <fs/fsname.hpp>
+#include <fs/sync.hpp>
+#include <mm/memory.hpp>
+#include <mm/string.hpp>
+
+static FSNameEntry *pool[FSNAME_POOL_BUCKETS];
+static SpinLock poolLock;
+
+bool FSName::Equals(const FSNameKey *key) const {
+	if (hash != key->hash || length != key->length) return false;
+
+	return memcmp(Get(), key->name, length) == 0;
+}
+
+void FSName::Clear() {
+	hash = 0;
+	length = 0;
+	inlineName[0] = '\0';
+}
+
+bool FSName::Set(const FSNameKey *key) {
+	if (key->length <= FSNAME_INLINE_MAX) {
+		hash = key->hash;
+		length = key->length;
+		memcpy(inlineName, key->name, key->length);
+		inlineName[key->length] = '\0';
+		return true;
+	}
+
+	poolLock.Lock();
+
+	FSNameEntry **bucket = &pool[key->hash & (FSNAME_POOL_BUCKETS - 1)];
+	FSNameEntry *found = *bucket;
+
+	while (found != NULL) {
+		if (found->hash == key->hash &&
+		    found->length == key->length &&
+		    memcmp(found->string, key->name, key->length) == 0) break;
+
+		found = found->next;
+	}
+
+	if (found == NULL) {
+		found = (FSNameEntry*)Malloc(sizeof(FSNameEntry) + key->length + 1);
+		if (found == NULL) {
+			poolLock.Unlock();
+			return false;
+		}
+
+		found->refCount = 0;
+		found->hash = key->hash;
+		found->length = key->length;
+		memcpy(found->string, key->name, key->length);
+		found->string[key->length] = '\0';
+
+		found->next = *bucket;
+		*bucket = found;
+	}
+
+	__atomic_add_fetch(&found->refCount, 1, __ATOMIC_RELAXED);
+	poolLock.Unlock();
+
+	hash = key->hash;
+	length = key->length;
+	entry = found;
+	return true;
+}
+
+void FSName::Copy(const FSName *other) {
+	if (other->length > FSNAME_INLINE_MAX) __atomic_add_fetch(&other->entry->refCount, 1, __ATOMIC_RELAXED);
+
+	// Inline names come along with the bytes, interned ones just with the pointer
+	memcpy(this, other, sizeof(FSName));
+}
+
+void FSName::Release() {
+	if (length > FSNAME_INLINE_MAX) {
+		poolLock.Lock();
+
+		if (__atomic_sub_fetch(&entry->refCount, 1, __ATOMIC_RELAXED) == 0) {
+			FSNameEntry **link = &pool[entry->hash & (FSNAME_POOL_BUCKETS - 1)];
+			while (*link != entry) link = &(*link)->next;
+			*link = entry->next;
+
+			Free(entry);
+		}
+
+		poolLock.Unlock();
+	}
+
+	Clear();
+}
@@ -0,0 +1,143 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <fs/vfs.hpp>
+#include <fs/fdtable.hpp>
+
+#define AIO_OP_NOP		0x0000	// Does nothing, completes right away
+#define AIO_OP_OPEN		0x0001	// Opens the path at buffer (length bytes), relative to fd if it's not absolute
+#define AIO_OP_READ		0x0002	// Reads length bytes at offset of fd into buffer
+#define AIO_OP_WRITE		0x0003	// Writes length bytes from buffer at offset of fd
+#define AIO_OP_CLOSE		0x0004	// Closes fd
+
+#define AIO_STATUS_OK		0x0000	// The operation was done, result is valid
+#define AIO_STATUS_ERROR	0x0001	// The operation failed
+#define AIO_STATUS_INVALID	0x0002	// The submission didn't make sense
+
+#define AIO_MAX_ENTRIES		4096	// The most entries a ring can have
+#define AIO_PATH_MAX		1024	// Longest path AIO_OP_OPEN accepts
+#define AIO_USER_END		0x0000800000000000	// Buffers must lie below this, in the caller's half of the address space
+
+/* AIOSubmission
+ *  A request, as queued by the caller in the submission ring
+ */
+struct AIOSubmission {
+	uint64_t userData;	// Given back untouched in the completion
+	uint32_t opcode;	// What to do (AIO_OP_*)
+	uint32_t flags;		// Reserved, must be 0
+	uint64_t fd;		// The descriptor to operate on (for OPEN, the directory, or FDTABLE_INVALID)
+	uint64_t offset;	// Where in the file
+	uint64_t buffer;	// The caller's buffer
+	uint64_t length;	// Its length
+};
+
+/* AIOCompletion
+ *  The outcome of a request, as posted in the completion ring
+ */
+struct AIOCompletion {
+	uint64_t userData;	// From the submission
+	uint64_t result;	// Bytes transferred, or the new descriptor for OPEN
+	uint32_t status;	// AIO_STATUS_*
+	uint32_t rsv0;
+};
+
+/* AIORingIndexes
+ *  The two ends of a ring. They only ever grow, the slot is index & mask.
+ *  Each one is written by one side only and read by the other.
+ */
+struct AIORingIndexes {
+	uint32_t head;		// Next entry to consume
+	uint32_t rsv0[15];	// Keep head and tail on different cache lines
+	uint32_t tail;		// Next entry to produce
+	uint32_t rsv1[15];
+} __attribute__((aligned(64)));
+
+/* AIORingShared
+ *  The start of the memory shared between the caller and the VFS.
+ *  The submission entries follow the header, then the completion ones.
+ *
+ *	+--------+-----------------------+-----------------------+
+ *	| header | AIOSubmission[sqSize] | AIOCompletion[cqSize] |
+ *	+--------+-----------------------+-----------------------+
+ */
+struct AIORingShared {
+	AIORingIndexes sq;	// The caller produces, the VFS consumes
+	AIORingIndexes cq;	// The VFS produces, the caller consumes
+	uint32_t sqSize;	// Entries in the submission ring, a power of two
+	uint32_t cqSize;	// Entries in the completion ring, a power of two
+	uint64_t sqOffset;	// Where the submissions start, from the start of the header
+	uint64_t cqOffset;	// Where the completions start
+	uint64_t overflows;	// Times the VFS had to stop because the completion ring was full
+};
+
+/* AIORing
+ *  The VFS side of an asynchronous I/O context.
+ *  The caller queues any number of submissions and then asks for them to be
+ *  run with a single Submit, completions are reaped straight from shared memory.
+ *  Submissions are only consumed while there is room for their completion,
+ *  so none is ever lost.
+ *
+ *  It's a batched synchronous interface: Submit runs the requests one after
+ *  the other in the caller's context and they're all complete when it returns.
+ *  What it saves is the crossings, not the waiting.
+ *
+ *  The caller can write anything in the shared memory at any time, so the
+ *  geometry of the rings and the indexes the VFS produces are kept here,
+ *  and only the caller's indexes are read back from it.
+ *
+ *  Like FDTable it has no constructor, Init has to be called first.
+ */
+class AIORing {
+public:
+	bool Init(FDTable *fdTable, uint32_t sqEntries, uint32_t cqEntries);
+	void Destroy();
+
+	uint64_t Submit(uint64_t toSubmit);
+
+	AIORingShared *GetShared() { return shared; }
+	size_t GetSharedSize() { return sharedPages * VFS_PAGE_SIZE; }
+private:
+	void Run(const AIOSubmission *submission, AIOCompletion *completion);
+
+	FDTable *table;		// The descriptors the requests refer to
+	AIORingShared *shared;	// The rings
+	uint64_t sharedPages;	// Pages behind them
+
+	AIOSubmission *submissions;	// Where the submission ring starts
+	AIOCompletion *completions;	// Where the completion ring starts
+	uint32_t sqSize;	// Entries in the submission ring
+	uint32_t cqSize;	// Entries in the completion ring
+	uint32_t sqHead;	// Next submission to consume
+	uint32_t cqTail;	// Next completion to post
+};
+
+/* The caller's side, usable from wherever the shared memory is mapped */
+
+static inline AIOSubmission *AIOGetSubmission(AIORingShared *ring) {
+	uint32_t head = __atomic_load_n(&ring->sq.head, __ATOMIC_ACQUIRE);
+	uint32_t tail = ring->sq.tail;
+	if (tail - head >= ring->sqSize) return NULL;
+
+	AIOSubmission *entries = (AIOSubmission*)((uint8_t*)ring + ring->sqOffset);
+	return &entries[tail & (ring->sqSize - 1)];
+}
+
+static inline void AIOQueueSubmission(AIORingShared *ring) {
+	// The entry from AIOGetSubmission has to be filled in by now
+	__atomic_store_n(&ring->sq.tail, ring->sq.tail + 1, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t AIOReapCompletions(AIORingShared *ring, AIOCompletion *completions, uint32_t max) {
+	uint32_t head = ring->cq.head;
+	uint32_t tail = __atomic_load_n(&ring->cq.tail, __ATOMIC_ACQUIRE);
+	AIOCompletion *entries = (AIOCompletion*)((uint8_t*)ring + ring->cqOffset);
+
+	uint32_t count = 0;
+	while (head != tail && count < max) {
+		completions[count++] = entries[head & (ring->cqSize - 1)];
+		head++;
+	}
+
+	__atomic_store_n(&ring->cq.head, head, __ATOMIC_RELEASE);
+	return count;
+}
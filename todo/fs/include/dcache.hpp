@@ -0,0 +1,65 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <fs/vfs.hpp>
+#include <fs/sync.hpp>
+
+#define DCACHE_BUCKETS		1024	// Has to be a power of two
+#define DCACHE_MAX_ENTRIES	2048	// After this, the least recently used entry is evicted
+
+/* DCacheEntry
+ *  A cached result of a directory lookup, keyed on the parent's
+ *  driver and inode plus the hash of the name.
+ *  Negative entries (node == NULL) remember that a name doesn't exist.
+ *  Positive entries hold a reference to their node.
+ *  Lookups walk the buckets without any lock, so entries are freed through RCU.
+ *  Entries are also chained by parent directory, so a deleted directory
+ *  loses its entries without sweeping the whole cache.
+ */
+struct DCacheEntry {
+	FSDriver *driver;       // The driver of the parent directory
+	uint64_t parent;        // The inode of the parent directory
+	FSName name;            // The name that was looked up
+	FSNode *node;           // The node that was found, NULL if negative
+
+	uint32_t referenced;    // Set by lookups, gives the entry a second chance before eviction
+
+	DCacheEntry *hashNext;  // The next entry in the bucket
+	DCacheEntry *childNext; // The next entry in the bucket of the parent directory
+	DCacheEntry *childPrev; // The previous one
+	DCacheEntry *lruPrev;   // The newer entry
+	DCacheEntry *lruNext;   // The older entry
+	RCUHead rcu;
+};
+
+/* DCacheStats
+ *  Counters to see how the dentry cache is doing
+ */
+struct DCacheStats {
+	uint64_t hits;          // Lookups resolved to a node
+	uint64_t negativeHits;  // Lookups resolved to "doesn't exist"
+	uint64_t misses;        // Lookups that had to go to the driver
+	uint64_t evictions;     // Entries dropped to make space
+	uint64_t entries;       // Entries currently in the cache
+};
+
+namespace DCache {
+	void Init();
+
+	/* Returns true if the lookup was resolved by the cache. In that case *result
+	 * is either the node, with a reference taken for the caller, or NULL for a negative entry.
+	 * Takes no lock */
+	bool Lookup(FSNode *parent, const FSNameKey *key, FSNode **result);
+
+	/* Taken before asking the driver, and given back to Insert: if the name was
+	 * invalidated meanwhile, what the driver said may be stale and isn't cached */
+	uint64_t GetGeneration(FSNode *parent, const FSNameKey *key);
+	void Insert(FSNode *parent, const FSNameKey *key, FSNode *node, uint64_t generation);
+
+	void Invalidate(FSNode *parent, const FSNameKey *key);
+	/* Drops the entry of the node and, for a directory, the ones of the names in it */
+	void InvalidateNode(FSNode *node);
+	void InvalidateDriver(FSDriver *driver);
+
+	void GetStats(DCacheStats *stats);
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <fs/sync.hpp>
+#include <fs/vfs.hpp>
+
+#define FDTABLE_INITIAL_SIZE	64		// Descriptors a new table has room for, a multiple of 64
+#define FDTABLE_MAX_SIZE	(1 << 20)	// A table never grows past this
+#define FDTABLE_INVALID		0xFFFFFFFFFFFFFFFF	// Not a descriptor
+
+/* FDArray
+ *  The slots of a descriptor table. When the table grows it gets a
+ *  new array, the old one is kept around as a lookup might still be reading it.
+ */
+struct FDArray {
+	uint64_t size;          // How many slots there are
+	FDArray *retired;       // The array this one replaced
+	FILE *files[];          // The open files, NULL if the slot is free
+};
+
+/* FDTable
+ *  The descriptor table of a process.
+ *  Looking up a descriptor takes no lock: it's two loads from the current array
+ *  in an RCU read section, and a reference to the file if it's still open.
+ *  Allocating one finds the lowest free descriptor in a two-level bitmap,
+ *  where the upper level tells which words of the lower one are full,
+ *  so even big tables are searched a word at a time.
+ *
+ *  Like ObjectCache it has no constructor, Init has to be called first.
+ */
+class FDTable {
+public:
+	bool Init();
+	void Destroy();
+
+	uint64_t Alloc();
+	void Install(uint64_t fd, FILE *file);
+	FILE *Remove(uint64_t fd);
+	/* Gives the caller a reference to the file, to give back with VFS::PutFile */
+	FILE *Get(uint64_t fd);
+
+	uint64_t GetCount() { return count; }
+	uint64_t GetSize() { return __atomic_load_n(&array, __ATOMIC_ACQUIRE)->size; }
+private:
+	bool Grow();
+	void Release(uint64_t fd);
+
+	SpinLock lock;          // Taken to change the table, never to read it
+	FDArray *array;         // The current slots
+	uint64_t *usedMap;      // A bit for every descriptor, set if it's taken
+	uint64_t *fullMap;      // A bit for every word of usedMap, set if it's full
+	uint64_t count;         // Descriptors taken
+};
+
+namespace VFS {
+	uint64_t OpenDescriptor(FDTable *table, FSNode *node);
+	/* The file is referenced, give it back with PutFile */
+	FILE *GetDescriptor(FDTable *table, uint64_t fd);
+	uint64_t CloseDescriptor(FDTable *table, uint64_t fd);
+	void CloseAllDescriptors(FDTable *table);
+}
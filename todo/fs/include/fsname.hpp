@@ -0,0 +1,51 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#define FSNAME_INLINE_MAX	15	// Longest name kept inside the FSName itself
+#define FSNAME_POOL_BUCKETS	1024	// Has to be a power of two
+
+/* FSNameKey
+ *  A name as it's being looked up: it doesn't have to be NULL-terminated,
+ *  and its hash is computed only once (see VFS::HashName).
+ */
+struct FSNameKey {
+	const char *name;	// The characters of the name
+	size_t length;		// How many of them
+	uint64_t hash;		// The hash of the name
+};
+
+/* FSNameEntry
+ *  A name too long to be inlined, shared by everyone that has the same one
+ */
+struct FSNameEntry {
+	uint64_t refCount;	// How many FSNames point here
+	uint64_t hash;		// The hash of the name
+	uint32_t length;	// The length of the name
+	FSNameEntry *next;	// The next entry in the pool's bucket
+	char string[];		// The name, NULL-terminated
+};
+
+/* FSName
+ *  The name of an object. Short names live inline, longer ones are interned
+ *  in a reference counted pool. The hash and length are always at hand, so
+ *  comparisons only look at the characters when those match.
+ *  A zeroed FSName is a valid empty name.
+ */
+struct FSName {
+	uint64_t hash;		// The hash of the name
+	uint32_t length;	// The length of the name, without the terminator
+	union {
+		char inlineName[FSNAME_INLINE_MAX + 1];	// If length <= FSNAME_INLINE_MAX
+		FSNameEntry *entry;			// Otherwise
+	};
+
+	const char *Get() const { return length <= FSNAME_INLINE_MAX ? inlineName : entry->string; }
+
+	bool Equals(const FSNameKey *key) const;
+
+	void Clear();
+	bool Set(const FSNameKey *key);
+	void Copy(const FSName *other);
+	void Release();
+};
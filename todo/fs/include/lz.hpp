@@ -0,0 +1,26 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/***************
+ * MICROK's LZ *
+ ***************
+ *
+ *  A small LZ77 codec in the LZ4 block format: every sequence is a token byte
+ *  (literal length in the high nibble, match length - 4 in the low one), the literals,
+ *  a 16 bit little-endian offset and the extra length bytes. The last sequence has no match.
+ *  It favours speed over ratio: one hash probe per position and no lookahead,
+ *  and decompressing is a loop of copies.
+ */
+
+#define LZ_MIN_MATCH	4	// Shorter matches aren't worth a sequence
+#define LZ_HASH_BITS	10	// Positions remembered while compressing, on the stack
+#define LZ_MAX_INPUT	65536	// Offsets are 16 bit
+
+namespace LZ {
+	/* Returns the compressed size, 0 if it wouldn't fit in capacity */
+	size_t Compress(const uint8_t *source, size_t size, uint8_t *destination, size_t capacity);
+
+	/* Returns the decompressed size, 0 if the data is corrupted or doesn't fit in capacity */
+	size_t Decompress(const uint8_t *source, size_t size, uint8_t *destination, size_t capacity);
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <fs/vfs.hpp>
+
+#define VFS_MAP_READ		0x0001	// The mapping can be read
+#define VFS_MAP_WRITE		0x0002	// The mapping can be written
+#define VFS_MAP_EXEC		0x0004	// The mapping can be executed
+
+#define VFS_MAP_SHARED		0x0001	// Writes go to the file and are seen by everyone
+#define VFS_MAP_PRIVATE		0x0002	// Writes go to a copy of the page, the file never sees them
+
+#define VFS_MAPPED_PAGE_WRITABLE	0x0001	// The page is mapped writable, it may have been written
+
+struct VFSMapping;
+
+/* VFSPageMapper
+ *  The owner of the paging structures of an address space (es: the root task,
+ *  through the capabilities it holds to the page tables).
+ *  The VFS never touches page tables itself: it only tells the mapper which
+ *  page of file data goes at which address, and with what protection.
+ */
+class VFSPageMapper {
+public:
+	VFSPageMapper() : mappings(NULL) { }
+	virtual ~VFSPageMapper() { }
+
+	/* Maps data (a page the VFS owns) at address, replacing whatever was mapped there */
+	virtual bool    MapPage(uintptr_t address, const uint8_t *data, uint64_t protection) = 0;
+
+	virtual void    UnmapPage(uintptr_t address) = 0;
+
+	VFSMapping *mappings;	// The files mapped in the address space, managed by the VFS
+};
+
+/* VFSMappedPage
+ *  A page of a mapping that has been faulted in
+ */
+struct VFSMappedPage {
+	FilePage page;		// The file data behind it, data is NULL if it was never faulted in
+	uint64_t flags;		// VFS_MAPPED_PAGE_*
+};
+
+/* VFSMapping
+ *  A file mapped in an address space. Nothing is mapped up front:
+ *  every page is brought in by the first fault on it, from the page cache
+ *  or straight from the driver's own memory.
+ *  Pages are first mapped read-only, so the first write faults too:
+ *  that's when a private mapping copies the page and a shared one marks it dirty.
+ *  A shared mapping gets the file's page as writable from the driver right away,
+ *  so that the driver can't share it with other files (es: RAMFS clones) while it's mapped.
+ */
+struct VFSMapping {
+	VFSPageMapper *mapper;	// The address space
+	FILE *file;		// The mapping's own open file, it keeps the node alive
+	uintptr_t start;	// The first address, page aligned
+	uint64_t pages;		// How many pages are mapped
+	uint64_t firstPage;	// The page of the file mapped at start
+	uint64_t protection;	// VFS_MAP_READ, WRITE and EXEC
+	uint64_t flags;		// VFS_MAP_SHARED or VFS_MAP_PRIVATE
+
+	VFSMappedPage *mapped;	// One per page
+
+	VFSMapping *next;	// The next mapping of the address space
+};
+
+namespace VFS {
+	VFSMapping *MapFile(VFSPageMapper *mapper, FSNode *node, uintptr_t address, size_t length, uint64_t offset, uint64_t protection, uint64_t flags);
+	VFSMapping *FindMapping(VFSPageMapper *mapper, uintptr_t address);
+
+	/* Called by the mapper on a page fault. Returns 0 if the page is now mapped,
+	 * 1 if the access isn't allowed (or is past the end of the file) */
+	uint64_t HandleMappingFault(VFSPageMapper *mapper, uintptr_t address, bool write);
+
+	uint64_t SyncMapping(VFSMapping *mapping);
+	void UnmapFile(VFSMapping *mapping);
+	void UnmapAll(VFSPageMapper *mapper);
+}
@@ -0,0 +1,114 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <fs/sync.hpp>
+
+#define OBJCACHE_MAGAZINE_SIZE	16		// Objects a magazine can hold
+#define OBJCACHE_MAGAZINES	SYNC_MAX_CPUS	// Magazines in every cache, one per CPU
+#define OBJCACHE_SPARE_SLABS	1		// Empty slabs kept before giving them back to the PMM
+
+/* ObjectMagazine
+ *  A small stack of free objects that can be handed out without touching the
+ *  shared slab state. Each one sits on its own cache line.
+ */
+struct ObjectMagazine {
+	SpinLock lock;
+	uint64_t count;                          // Objects in the magazine
+	void *objects[OBJCACHE_MAGAZINE_SIZE];   // The objects themselves
+} __attribute__((aligned(64)));
+
+/* ObjectSlab
+ *  Sits at the end of every slab and keeps its free objects. Slabs with
+ *  free objects make up the depot, and a slab with none handed out
+ *  goes back to the PMM.
+ */
+struct ObjectSlab {
+	uint8_t *base;          // The first page of the slab
+	void *freeList;         // Its free objects, linked through their first word
+	uint64_t freeCount;     // How many there are
+	ObjectSlab *prev;       // The previous slab in the depot
+	ObjectSlab *next;       // The next slab in the depot
+};
+
+/* ObjectCacheStats
+ *  How the objects of a cache are spread out
+ */
+struct ObjectCacheStats {
+	const char *name;       // The name of the cache
+	uint64_t objectSize;    // The size of an object, with padding
+	uint64_t slabs;         // Slabs allocated
+	uint64_t objects;       // Objects carved out of the slabs
+	uint64_t inUse;         // Objects handed out
+	uint64_t inMagazines;   // Free objects in the magazines
+	uint64_t inDepot;       // Free objects in the depot
+	uint64_t reclaimed;     // Empty slabs given back to the PMM
+};
+
+/* ObjectCache
+ *  A cache of fixed-size objects, carved out of page-sized slabs.
+ *  Allocations and frees go through a magazine first and only touch the depot
+ *  (the slabs with free objects) when the magazine is empty or full.
+ *
+ *  Every CPU has its own magazine. They're still locked, as a thread can be moved
+ *  to another CPU while it's using one, but the lock is uncontended.
+ *
+ *  The depot hands out objects from the fullest slabs first, so the others can
+ *  empty out and go back to the PMM.
+ *
+ *  It has no constructor, as it can live in global storage before constructors run.
+ *  Init has to be called before the first allocation.
+ */
+class ObjectCache {
+public:
+	void Init(const char *cacheName, size_t size);
+
+	void *Alloc();
+	void Free(void *object);
+
+	void GetStats(ObjectCacheStats *stats);
+
+	static ObjectCache *First() { return cacheList; }
+	ObjectCache *Next() { return nextCache; }
+private:
+	ObjectMagazine *GetMagazine();
+	bool Grow();
+	ObjectSlab *FindSlab(void *object);
+	void *TakeObject();
+	void GiveObject(void *object);
+	void ReleaseSlab(ObjectSlab *slab);
+
+	const char *name;
+	size_t objectSize;
+	uint64_t slabPages;      // Pages in each slab
+	uint64_t slabObjects;    // Objects in each slab
+
+	SpinLock depotLock;
+	ObjectSlab *depot;       // Slabs with free objects, the partially used ones first
+	ObjectSlab *depotTail;   // The emptiest slab
+	ObjectSlab **slabIndex;  // Every slab sorted by address, to find the one of an object
+	uint64_t slabIndexSize;  // Slabs the index has room for
+	uint64_t depotCount;
+	uint64_t emptySlabs;
+	uint64_t slabs;
+	uint64_t objects;
+	uint64_t inUse;
+	uint64_t reclaimed;
+
+	ObjectMagazine magazines[OBJCACHE_MAGAZINES];
+
+	ObjectCache *nextCache;  // All the caches are chained, to be able to report on them
+	static ObjectCache *cacheList;
+};
+
+/* TypedObjectCache
+ *  An ObjectCache that hands out objects of a certain type.
+ *  No constructor is run, the objects are plain memory like with Malloc.
+ */
+template<typename T>
+class TypedObjectCache : public ObjectCache {
+public:
+	void Init(const char *cacheName) { ObjectCache::Init(cacheName, sizeof(T)); }
+
+	T *Alloc() { return (T*)ObjectCache::Alloc(); }
+	void Free(T *object) { ObjectCache::Free(object); }
+};
@@ -0,0 +1,104 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <fs/vfs.hpp>
+
+#define PAGECACHE_MAX_PAGES		256	// How many pages the cache may hold at most
+#define PAGECACHE_BUCKETS		512	// Has to be a power of two
+#define PAGECACHE_DIRTY_BACKGROUND	64	// Above this many dirty pages the flusher doesn't wait for them to expire
+#define PAGECACHE_DIRTY_LIMIT		192	// Above this many writers flush the oldest files themselves
+#define PAGECACHE_DIRTY_EXPIRE		(3000ULL * 1000 * 1000)	// How old dirty data may get, in cycles (see ReadCycles)
+#define PAGECACHE_DIRTY_BUCKETS		128	// Has to be a power of two
+#define PAGECACHE_WRITEBACK_RUN		32	// Most contiguous pages written back in one request
+#define PAGECACHE_PREFETCH_RUN		32	// Most contiguous pages read ahead in one request
+
+#define CACHED_PAGE_VALID		0x0001	// The page holds data
+#define CACHED_PAGE_DIRTY		0x0002	// The page has to be written back
+#define CACHED_PAGE_REFERENCED		0x0004	// Accessed since the clock hand last passed
+#define CACHED_PAGE_PREFETCHED		0x0008	// Read ahead, and not read by anyone yet
+#define CACHED_PAGE_FILLING		0x0010	// The driver is reading it in, the data isn't there yet
+#define CACHED_PAGE_WRITEBACK		0x0020	// The driver is writing it back
+#define CACHED_PAGE_REDIRTIED		0x0040	// Written again while it was being written back
+
+/* CachedPage
+ *  A page of file data, identified by the driver, the inode
+ *  and the index of the page inside the file.
+ */
+struct CachedPage {
+	FSDriver *driver;       // The driver of the file
+	uint64_t inode;         // The inode of the file
+	uint64_t index;         // The offset in the file, in pages
+	FSNode *node;           // The node of the file, referenced while the page is cached
+	uint8_t *data;          // The page itself
+	uint64_t flags;         // The page's flags
+	uint64_t pins;          // References handed out, the page can't be evicted while pinned
+
+	CachedPage *hashNext;   // The next page in the bucket
+	CachedPage *dirtyPrev;  // The previous dirty page of the same file
+	CachedPage *dirtyNext;  // The next dirty page of the same file
+};
+
+/* DirtyInode
+ *  A file with dirty pages. Files are kept in the order they were first
+ *  dirtied in, so the flusher always starts from the oldest data.
+ */
+struct DirtyInode {
+	FSDriver *driver;       // The driver of the file
+	uint64_t inode;         // The inode of the file
+	uint64_t dirtyPages;    // How many of its pages are dirty
+	uint64_t dirtiedAt;     // When the first of them was dirtied
+	CachedPage *dirtyList;  // The dirty pages
+	uint64_t pass;          // The last flush that went through it
+
+	DirtyInode *hashNext;   // The next file in the bucket
+	DirtyInode *older;      // The file dirtied before this one
+	DirtyInode *newer;      // The file dirtied after this one
+};
+
+/* PageCacheStats
+ *  Counters to see how the page cache is doing
+ */
+struct PageCacheStats {
+	uint64_t hits;          // Page accesses served from memory
+	uint64_t misses;        // Page accesses that went to the driver
+	uint64_t readErrors;    // Pages the driver didn't read in full, they aren't cached
+	uint64_t evictions;     // Pages reclaimed by the clock
+	uint64_t writebacks;    // Dirty pages written to the driver
+	uint64_t writeErrors;   // Dirty pages the driver didn't take, they stay dirty
+	uint64_t flushes;       // Batches of dirty pages written to the driver
+	uint64_t pages;         // Pages currently held
+	uint64_t dirtyPages;    // Pages currently waiting for writeback
+	uint64_t dirtyInodes;   // Files currently waiting for writeback
+	uint64_t expired;       // Files flushed because their data got too old
+	uint64_t throttled;     // Files flushed by writers over the dirty limit
+	uint64_t prefetched;    // Pages read ahead
+	uint64_t prefetchHits;  // Pages read ahead that were then read
+};
+
+namespace PageCache {
+	void Init();
+
+	uint64_t Read(FILE *file, uint64_t offset, size_t size, uint8_t *buffer);
+	uint64_t Write(FILE *file, uint64_t offset, size_t size, uint8_t *buffer);
+
+	uint64_t Prefetch(FSNode *node, uint64_t index, uint64_t count);
+
+	CachedPage *Pin(FSNode *node, uint64_t index);
+	void Unpin(CachedPage *page);
+	void SetDirty(CachedPage *page);
+
+	/* Return 0 if everything was written back, what the driver
+	 * doesn't take stays dirty and is tried again later */
+	uint64_t FlushNode(FSNode *node);
+	uint64_t FlushDriver(FSDriver *driver);
+	uint64_t FlushAll();
+
+	/* Called periodically by VFS::Tick with the time from ReadCycles, writes back up to budget pages
+	 * of the files whose dirty data expired or that are over the background threshold. Returns how many */
+	uint64_t FlusherTick(uint64_t now, uint64_t budget);
+
+	void InvalidateNode(FSNode *node);
+	void InvalidateDriver(FSDriver *driver);
+
+	void GetStats(PageCacheStats *stats);
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <fs/vfs.hpp>
+
+/**************************
+ * MICROK's PAGECACHETEST *
+ **************************
+ *
+ *  Runs the page cache against a disk that is just pages of memory, for as long as no
+ *  driver of a real device sets FS_DRIVER_PAGECACHE. The driver has a single file, disk,
+ *  under its root, and counts the requests it gets so the test can tell whether they were
+ *  served from the cache, read ahead or written back in runs. It can also be told to fail
+ *  the next requests, like a device would on an I/O error.
+ *  The checks, in order:
+ *   - read:       the whole disk read a page at a time, readahead has to batch the requests
+ *   - cached:     the same again, nothing may reach the driver
+ *   - writeback:  writes stay in the cache until SyncFile, then go out in vectored runs
+ *   - flusher:    dirty data older than PAGECACHE_DIRTY_EXPIRE is written back by the flusher
+ *   - read error: a failed read is reported and leaves nothing cached
+ *   - write error: a failed write-back leaves the data dirty, the next sync writes it
+ *  Every check that fails is printed, the driver goes away when the test is over.
+ */
+
+#define PAGECACHE_TEST_PAGES	64	// Pages of the disk, more than VFS_READAHEAD_MAX
+#define PAGECACHE_TEST_ROOT	0	// The inode of the root directory
+#define PAGECACHE_TEST_DISK	1	// The inode of the disk file
+
+class PageCacheTestDriver : public FSDriver {
+public:
+	PageCacheTestDriver(FSNode *mountpoint) {
+		FSInit(mountpoint);
+	}
+
+	void            FSInit(FSNode *mountpoint) override;
+	void		FSDelete() override;
+	uint64_t        FSReadFile(FILE *file, uint64_t offset, size_t size, uint8_t **buffer) override;
+	uint64_t        FSWriteFile(FILE *file, uint64_t offset, size_t size, uint8_t *buffer) override;
+	uint64_t        FSReadFileV(FILE *file, uint64_t offset, const FSIOVec *vectors, size_t count) override;
+	uint64_t        FSWriteFileV(FILE *file, uint64_t offset, const FSIOVec *vectors, size_t count) override;
+	FILE           *FSOpenFile(FSNode *node, uint64_t descriptor) override;
+	void            FSCloseFile(FILE *file) override;
+	uint64_t	FSDeleteFile(FSNode *node) override;
+	FSNode         *FSReadDir(FSNode *node, uint64_t index) override;
+	FSNode         *FSMakeDir(FSNode *node, const char *name, uint64_t uid, uint64_t gid, uint64_t mask) override;
+	FSNode         *FSMakeFile(FSNode *node, const char *name, uint64_t uid, uint64_t gid, uint64_t mask) override;
+	FSNode         *FSFindDir(FSNode *node, const FSNameKey *key) override;
+	uint64_t        FSIterateDir(FSNode *node, uint64_t *cursor, VFSDirEntry *buffer, size_t bufferSize) override;
+	uint64_t        FSGetDirElements(FSNode *node) override;
+	uint64_t        FSDeleteDir(FSNode *node) override;
+
+	FSNode *diskNode;         // The only file, the driver keeps a reference to it
+	uint8_t *disk[PAGECACHE_TEST_PAGES];
+
+	uint64_t reads;           // Read requests the driver got
+	uint64_t writes;          // Write requests the driver got
+	uint64_t failReads;       // How many of the next read requests fail
+	uint64_t failWrites;      // How many of the next write requests fail
+private:
+	uint64_t Transfer(uint64_t offset, const FSIOVec *vectors, size_t count, bool write);
+};
+
+namespace PageCacheTest {
+	/* Runs every check on a driver of its own, returns true if they all passed.
+	 * With CONFIG_FS_PAGECACHE_TEST, VFS::Init calls it */
+	bool Run();
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include <fs/vfs.hpp>
+
+/*******************
+ * MICROK's PROCFS *
+ *******************
+ *
+ *  A flat directory of files that don't exist until someone opens them.
+ *  Every file has a generator, a function that writes the file's text out of live
+ *  kernel counters. It's only called on open, and the text it writes is kept with the
+ *  FILE until it's closed, so a reader sees one consistent snapshot whatever its offsets.
+ *  Publishing a counter costs a registration, nothing more until the file is read.
+ *
+ *  Inode 0 is the directory, the file registered Nth gets inode N + 1.
+ */
+
+#define PROCFS_MAX_ENTRIES	64	// Files the directory can have
+#define PROCFS_ROOT_INODE	0
+
+/* ProcFSWriter
+ *  Where a generator writes its text. Writing past the end of the buffer is fine:
+ *  length keeps counting, and the driver calls the generator again with enough space.
+ */
+struct ProcFSWriter {
+	char *buffer;		// Where the text goes
+	size_t size;		// How big the buffer is
+	size_t length;		// How long the text is, even if it didn't fit
+
+	void Put(const char *string);
+	void PutNumber(uint64_t value);
+	void PutHex(uint64_t value);		// With the 0x in front
+	void PutField(const char *name, uint64_t value);	// One "name: value" line
+};
+
+typedef void (*ProcFSGenerator)(ProcFSWriter *writer, void *context);
+
+/* ProcFSEntry
+ *  A file in the directory
+ */
+struct ProcFSEntry {
+	FSNode *node;			// The file's node, the driver keeps a reference to it
+	ProcFSGenerator generator;	// Writes its contents
+	void *context;			// Given to the generator
+};
+
+class ProcFSDriver : public FSDriver {
+public:
+	ProcFSDriver(FSNode *mountpoint) {
+		FSInit(mountpoint);
+	}
+
+	void            FSInit(FSNode *mountpoint) override;
+	void		FSDelete() override;
+	uint64_t        FSReadFile(FILE *file, uint64_t offset, size_t size, uint8_t **buffer) override;
+	uint64_t        FSWriteFile(FILE *file, uint64_t offset, size_t size, uint8_t *buffer) override;
+	FILE           *FSOpenFile(FSNode *node, uint64_t descriptor) override;
+	void            FSCloseFile(FILE *file) override;
+	uint64_t	FSDeleteFile(FSNode *node) override;
+	FSNode         *FSReadDir(FSNode *node, uint64_t index) override;
+	FSNode         *FSMakeDir(FSNode *node, const char *name, uint64_t uid, uint64_t gid, uint64_t mask) override;
+	FSNode         *FSMakeFile(FSNode *node, const char *name, uint64_t uid, uint64_t gid, uint64_t mask) override;
+	FSNode         *FSFindDir(FSNode *node, const FSNameKey *key) override;
+	uint64_t        FSIterateDir(FSNode *node, uint64_t *cursor, VFSDirEntry *buffer, size_t bufferSize) override;
+	uint64_t        FSGetDirElements(FSNode *node) override;
+	uint64_t        FSDeleteDir(FSNode *node) override;
+
+	bool            Register(const char *name, ProcFSGenerator generator, void *context);
+private:
+	ProcFSEntry    *GetEntry(uint64_t inode);
+
+	SpinLock registerLock;    // Serializes Register, lookups go by entryCount alone
+	ProcFSEntry entries[PROCFS_MAX_ENTRIES];
+	uint64_t entryCount;      // Entries registered so far, an entry is ready before it's counted
+};
+
+namespace ProcFS {
+	/* Publishes a file in /proc, generator is only called when it's opened */
+	bool Register(const char *name, ProcFSGenerator generator, void *context);
+}
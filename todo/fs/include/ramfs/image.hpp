@@ -0,0 +1,81 @@
+#pragma once
+#include <stdint.h>
+
+/************************
+ * MICROK's RAMFS IMAGE *
+ ************************
+ *
+ *  A directory tree serialized at build time (see tools/mkramfs), that the kernel
+ *  mounts straight from the memory the bootloader loaded it in: nothing is copied,
+ *  nothing is allocated per file, mounting it only looks at the header.
+ *  This file is shared with the tool, so it can't depend on anything else in the kernel.
+ *
+ *
+ * LAYOUT
+ *
+ *  +--------+---------------------+--------------------+-------+-----------+-----------+
+ *  | header | RAMFSImageObject[]  | RAMFSImageEntry[]  | names | file data | file data | ...
+ *  +--------+---------------------+--------------------+-------+-----------+-----------+
+ *  ^ page aligned                                              ^ every file starts on a page
+ *
+ *  Everything is little endian, and every reference is an offset from the start of the image,
+ *  so it works wherever it's loaded. The data of a file is padded with zeroes to a whole
+ *  number of pages, and the image to a whole number of pages too.
+ *
+ *
+ * OBJECTS
+ *
+ *  Objects are numbered from 0, which is the root directory, and the number is the inode.
+ *  The entries of a directory are contiguous and sorted by hash, then by name, so a lookup
+ *  is a binary search. The hash is FNV-1a on 64 bits, the same as VFS::HashName.
+ */
+
+#define RAMFS_IMAGE_MAGIC	0x0053464D41524B4D	// "MKRAMFS\0", read as a little endian number
+#define RAMFS_IMAGE_VERSION	1
+#define RAMFS_IMAGE_PAGE_SIZE	4096
+
+#define RAMFS_IMAGE_FILE	0x0001	// The same values as VFS_NODE_FILE and VFS_NODE_DIRECTORY
+#define RAMFS_IMAGE_DIRECTORY	0x0002
+
+/* RAMFSImageHeader
+ *  At the very start of the image
+ */
+struct RAMFSImageHeader {
+	uint64_t magic;           // RAMFS_IMAGE_MAGIC
+	uint32_t version;         // RAMFS_IMAGE_VERSION
+	uint32_t headerSize;      // sizeof(RAMFSImageHeader), for later versions to grow it
+	uint64_t imageSize;       // Of the whole image, a multiple of the page size
+	uint64_t objectCount;     // Objects in the table
+	uint64_t objectsOffset;   // Where the RAMFSImageObject table starts
+	uint64_t entryCount;      // Directory entries, of all the directories together
+	uint64_t entriesOffset;   // Where the RAMFSImageEntry table starts
+	uint64_t namesSize;       // Bytes in the name table
+	uint64_t namesOffset;     // Where the name table starts
+	uint64_t dataOffset;      // Where the first file's data starts
+	uint64_t rsv0[6];
+};
+
+/* RAMFSImageObject
+ *  A file or a directory
+ */
+struct RAMFSImageObject {
+	uint32_t flags;           // RAMFS_IMAGE_FILE or RAMFS_IMAGE_DIRECTORY
+	uint32_t mask;            // Permission mask
+	uint32_t uid;             // User ID
+	uint32_t gid;             // Group ID
+	uint64_t parent;          // The directory that contains it, the root has itself
+	uint64_t size;            // Bytes for a file, entries for a directory
+	uint64_t offset;          // For a file, where its data starts; for a directory, the index of its first entry
+	uint64_t rsv0;
+};
+
+/* RAMFSImageEntry
+ *  A name in a directory
+ */
+struct RAMFSImageEntry {
+	uint64_t hash;            // Of the name
+	uint64_t object;          // What it points to
+	uint64_t nameOffset;      // Where the name is in the name table, it's NULL-terminated
+	uint32_t nameLength;      // Without the terminator
+	uint32_t rsv0;
+};
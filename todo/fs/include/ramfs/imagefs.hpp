@@ -0,0 +1,58 @@
+#pragma once
+#include <fs/vfs.hpp>
+#include <fs/ramfs/image.hpp>
+
+/*************************
+ * MICROK's RAMFS IMAGES *
+ *************************
+ *
+ *  Mounts a RAMFS image (see fs/ramfs/image.hpp) where it already is in memory, read-only.
+ *  Mounting checks the header and nothing more, so it takes the same time whatever the
+ *  number of files. Lookups search the image's sorted entries, reads copy from the image,
+ *  and FSGetPage hands out the image's own pages, so mapping a file copies nothing either.
+ *
+ *  Nodes are only made the first time an object is looked up, then kept
+ *  in a hash table (chained through the node's impl) so there is one per object.
+ *  Everything the image points to is checked against its size when it's used,
+ *  a broken image gives errors and not reads out of it.
+ */
+
+#define RAMFS_IMAGE_NODE_BUCKETS	256	// Has to be a power of two
+
+class RAMFSImageDriver : public FSDriver {
+public:
+	RAMFSImageDriver(FSNode *mountpoint, const void *argImage) : image((const uint8_t*)argImage) {
+		FSInit(mountpoint);
+	}
+
+	void            FSInit(FSNode *mountpoint) override;
+	void		FSDelete() override;
+	uint64_t        FSReadFile(FILE *file, uint64_t offset, size_t size, uint8_t **buffer) override;
+	uint64_t        FSWriteFile(FILE *file, uint64_t offset, size_t size, uint8_t *buffer) override;
+	uint64_t        FSReadFileV(FILE *file, uint64_t offset, const FSIOVec *vectors, size_t count) override;
+	FILE           *FSOpenFile(FSNode *node, uint64_t descriptor) override;
+	void            FSCloseFile(FILE *file) override;
+	uint64_t	FSDeleteFile(FSNode *node) override;
+	FSNode         *FSReadDir(FSNode *node, uint64_t index) override;
+	FSNode         *FSMakeDir(FSNode *node, const char *name, uint64_t uid, uint64_t gid, uint64_t mask) override;
+	FSNode         *FSMakeFile(FSNode *node, const char *name, uint64_t uid, uint64_t gid, uint64_t mask) override;
+	FSNode         *FSFindDir(FSNode *node, const FSNameKey *key) override;
+	uint64_t        FSIterateDir(FSNode *node, uint64_t *cursor, VFSDirEntry *buffer, size_t bufferSize) override;
+	uint64_t        FSGetDirElements(FSNode *node) override;
+	uint64_t        FSDeleteDir(FSNode *node) override;
+	const uint8_t  *FSGetPage(FILE *file, uint64_t index, size_t *length) override;
+
+	/* Whether an image of size bytes at image can be mounted */
+	static bool     Check(const void *image, size_t size);
+private:
+	const RAMFSImageObject *GetObject(uint64_t inode);
+	const RAMFSImageEntry  *GetEntry(const RAMFSImageObject *directory, uint64_t index);
+	const char             *GetName(const RAMFSImageEntry *entry);
+	FSNode                 *GetNode(FSNode *parent, const RAMFSImageEntry *entry);
+
+	const uint8_t *image;                     // Where the image is, it stays there as long as it's mounted
+	const RAMFSImageHeader *header;
+
+	SpinLock nodeLock;                        // Taken to look in or add to the table
+	FSNode *nodes[RAMFS_IMAGE_NODE_BUCKETS];  // The nodes made so far, by inode
+};
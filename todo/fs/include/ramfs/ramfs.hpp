@@ -1,5 +1,6 @@
 #pragma once
 #include <fs/vfs.hpp>
+#include <fs/sync.hpp>
 
 /******************
  * MICROK's RAMFS *
@@ -30,37 +31,230 @@
  *               V
  *              NULL
  *
+ *  A directory's entries are chained newest first. Each gets the next of its directory's
+ *  sequence numbers when it's added, so listing a directory can go on from where it
+ *  stopped (see RAMFS_DIR_CURSOR) even if the entry it stopped at was deleted meanwhile.
+ *
  *
  * INODE TABLE
  *
- * /-+------------------------------\
- * | 0    | 1   | 2   | | maxInodes |
- * +----------------- | |-----------+
- * | ROOT | DEV | SYS | | NULL      |
- * \-+------------------------------/
- *
- *  The inode table is used to access an object at a specific inode. The indoes are assigned sequentially,
- *  the first object gets 0, the second 1, etc. This makes it fast to get to an element ( O(1), as it's basically a vector. ),
- *  Eliminating the need to trasversing the whole filesystem structure which (being a liked list), is quite slow.
- *  If a file is removed, the inode is immediatly reused, as the algorithm searches for the first element in the inode table
- *  that is free. So, the most recent file should have the greatest inode unless a file has been deleted.
+ *  inodeTable           chunk 0                       chunk 1
+ * /---------\    /------+-----+-----+---------\    /---------------\
+ * | chunk 0 | -> | ROOT | DEV | SYS | ...     |    | ...           |
+ * | chunk 1 | -  \------+-----+-----+---------/    \---------------/
+ * | NULL    |  \----------------------------------------^
+ * | ...     |
+ * \---------/
+ *
+ *  The inode table is used to access an object at a specific inode in O(1), eliminating the need to
+ *  trasverse the whole filesystem structure. It is split in chunks of RAMFS_INODE_CHUNK_SLOTS slots,
+ *  allocated only when the inodes they hold are handed out, so a small mount only pays for a few slots.
+ *  Inodes are assigned sequentially, but when an object is removed its slot goes at the head of a
+ *  free list (the slot itself stores the next free inode, tagged with RAMFS_INODE_FREE), and it is
+ *  the first one to be reused.
+ *  Like objects in an ObjectCache, every CPU keeps a few free inodes of its own, and only goes
+ *  to the free list (or to the never used ones) to get or give back RAMFS_INODE_BATCH at a time.
+ *
+ *
+ * DIRECTORY INDEX
+ *
+ *  Every directory also keeps its entries in a hash index (chained through hashNext) and
+ *  the number of entries it holds, so finding a name or counting the entries doesn't need
+ *  to walk the chain. The index doubles when it has more entries than buckets.
+ *
+ *
+ * FILE DATA
+ *
+ *  File contents are kept in pages, reached through a radix tree of page-sized tables
+ *  of 512 pointers each. A one level tree covers 2MiB, every other level multiplies that by 512.
+ *  Writes only allocate the pages they touch, and pages that were never written read as zeroes.
+ *
+ *
+ * SHARING
+ *
+ *  A page can be pointed to by more than one file. Its slot in the page tree is then tagged
+ *  with RAMFS_PAGE_SHARED and the page has an entry in the share table, shared by all the
+ *  RAMFS mounts, that counts the slots pointing to it and the FSGetPage callers still using it.
+ *   - Cloning a file shares all of its pages, only the page tree is copied.
+ *   - Writing to a page somebody else points to gives the file its own copy first.
+ *   - Deduplication looks the file's pages up by content, and points the slots at
+ *     an identical page if there's one already.
+ *  A page handed out by FSGetWritablePage (es: to a shared mapping) stays the file's own until it's
+ *  given back: clones get a copy of it and deduplication skips it.
+ *  A page is freed when no slot and no caller are left, through RCU as readers could be copying from it.
+ *
+ *
+ * COMPRESSION
+ *
+ *  RAMFS::CompressorTick sweeps the page trees of all the mounts like a clock: a page that was read
+ *  or written since the last sweep loses its RAMFS_PAGE_REFERENCED bit, one that wasn't is compressed
+ *  with LZ and its slot points to the compressed copy, tagged RAMFS_PAGE_COMPRESSED. The first access
+ *  decompresses it back into a page. Compressed copies come from object caches of RAMFS_LZ_CLASS_SIZE
+ *  steps, pages that don't shrink below the largest class are tagged RAMFS_PAGE_INCOMPRESSIBLE
+ *  until they're written again. Shared pages are left alone. VFS::Tick runs the sweep, VFS_TICK_PAGES
+ *  pages at a time, and a mount being compressed holds back its FSDelete rather than the other mounts.
+ *  A compressed copy that doesn't decompress to a whole page fails the access.
+ *
+ *
+ * DELETION
+ *
+ *  Only empty directories can be deleted. A deleted object is taken out of its directory's chain
+ *  and index and its inode is freed right away, so lookups, opens and open files stop finding it.
+ *  Its shared pages are given back to the share table, everything else it has (pages, page tree,
+ *  compressed copies, the object itself) is freed through RCU, as lock-free readers could still be on it.
+ *  Pages handed out by FSGetPage stay until FSPutPage, like for any page that stops being used.
+ *  Unmounting deletes every object of the mount the same way.
+ *
+ *
+ * LOCKING
+ *
+ *  Lookups, directory listings and reads take no lock. Everything that changes an object
+ *  takes that object's lock: a directory's to add or remove an entry, a file's to write it.
+ *  Deleting takes the directory's lock first and then the object's.
+ *  Inodes come from the CPU's own cache, the allocator's lock is only taken to refill or drain it.
+ *  Sharing pages between files goes through the share table, which has a lock of its own.
+ *   - Entries and pages are published fully initialized, with release stores.
+ *   - Growing a page tree or rehashing a directory index rewrites pointers readers may be
+ *     following, so it's done under the object's sequence count and readers try again.
+ *   - A replaced directory index is freed through RCU, as lookups may still be walking it.
  */
 
+#define RAMFS_INODE_CHUNK_SLOTS	512			// Slots allocated at once in the inode table
+#define RAMFS_INODE_FREE	0x1			// Tags a slot that is on the free list
+#define RAMFS_INODE_CACHE_SIZE	8			// Free inodes a CPU can keep
+#define RAMFS_INODE_BATCH	(RAMFS_INODE_CACHE_SIZE / 2)	// Moved at once between a CPU and the free list
+#define RAMFS_NO_INODE		0xFFFFFFFFFFFFFFFF	// No inode could be handed out
+#define RAMFS_MAX_INODES	0xFFFFFFFE		// Inodes have to fit in the low half of a directory cursor
+
+// Where FSIterateDir goes on from: the entry's inode plus one, and the low half of its sequence number
+#define RAMFS_DIR_CURSOR(sequence, inode)	((((sequence) & 0xFFFFFFFF) << 32) | ((inode) + 1))
+
+#define RAMFS_DIR_INDEX_MIN 8  // Buckets of a directory's index when the first entry is added
+
+#define RAMFS_PAGE_TREE_SHIFT		9
+#define RAMFS_PAGE_TREE_ENTRIES		(1 << RAMFS_PAGE_TREE_SHIFT)	// Pointers in a table of the tree
+#define RAMFS_PAGE_TREE_MAX_LEVELS	6				// Enough to cover 64 bit offsets
+
+#define RAMFS_PAGE_SHARED		0x1	// Tags a page tree slot whose page is in the share table
+#define RAMFS_PAGE_COMPRESSED		0x2	// The slot points to a RAMFSCompressedPage
+#define RAMFS_PAGE_REFERENCED		0x4	// The page was accessed since the compressor last looked at it
+#define RAMFS_PAGE_INCOMPRESSIBLE	0x8	// The compressor tried already, and the page didn't shrink enough
+#define RAMFS_PAGE_TAGS			0xF
+#define RAMFS_SHARE_BUCKETS		1024	// Buckets of each share table index, a power of two
+
+#define RAMFS_SLOT_PAGE(slot)	((uint8_t*)((uint64_t)(slot) & ~(uint64_t)RAMFS_PAGE_TAGS))
+
+#define RAMFS_LZ_CLASS_SIZE	256	// Compressed pages are kept in multiples of this
+#define RAMFS_LZ_CLASSES	12	// Pages that don't fit in the largest one stay uncompressed
+
+struct RAMFSObject;
+
+/* RAMFSDirIndex
+ *  The hash index of a directory. Size and buckets are read together, so a lookup
+ *  always sees a consistent pair even while the directory grows it.
+ */
+struct RAMFSDirIndex {
+	RCUHead rcu;              // A replaced index is freed once no lookup can be on it
+	uint64_t size;            // The buckets, always a power of two
+	RAMFSObject *buckets[];
+};
+
+/* RAMFSSharedPage
+ *  The entry of a page in the share table. All its fields are protected by the table's lock.
+ */
+struct RAMFSSharedPage {
+	RCUHead rcu;                  // The page is freed once no reader can be copying from it
+	uint8_t *page;                // The data
+	uint64_t refs;                // Page tree slots pointing to it
+	uint64_t pins;                // Times it was handed out by FSGetPage and not given back yet
+	uint64_t contentHash;         // Of the data, valid if it's indexed
+	bool indexed;                 // In the content index, the data can't change until it's out of it
+	bool writable;                // Handed out by FSGetWritablePage, it can change under us until all pins are gone
+	bool wasShared;               // More than one slot pointed to it once, so pins may come from other files
+	RAMFSSharedPage *pageNext;    // The next entry in the same bucket, by address
+	RAMFSSharedPage *contentNext; // The next entry in the same bucket, by content
+};
+
+/* RAMFSCompressedPage
+ *  The compressed copy of a page that wasn't used for a while
+ */
+struct RAMFSCompressedPage {
+	uint16_t size;            // Bytes of compressed data
+	uint8_t sizeClass;        // The object cache it comes from
+	uint8_t rsv0;
+	uint8_t data[];
+};
+
+/* RAMFSRetired
+ *  A page or a compressed copy that lock-free readers could still be looking at
+ */
+struct RAMFSRetired {
+	RCUHead rcu;
+	void *memory;             // What has to be freed
+	uint64_t sizeClass;       // Its object cache, RAMFS_LZ_CLASSES for a whole page
+};
+
+/* RAMFSStats
+ *  Counters of the share table, of the compressor and of the memory, for all the mounts
+ */
+struct RAMFSStats {
+	uint64_t objects;           // Files and directories, deleted ones included until they're freed
+	uint64_t residentPages;     // Pages of data and of page trees, compressed ones aside
+
+	uint64_t sharedPages;       // Pages in the share table
+	uint64_t savedPages;        // Pages that would exist without sharing
+	uint64_t clones;            // Files cloned
+	uint64_t copies;            // Pages copied because a file wrote to a shared one
+	uint64_t deduped;           // Pages found identical to another one and given up
+
+	uint64_t compressedPages;   // Pages that are compressed right now
+	uint64_t compressedBytes;   // The memory they take, with the rounding to the size class
+	uint64_t compressions;      // Pages compressed so far
+	uint64_t decompressions;    // Pages decompressed so far
+	uint64_t decompressCycles;  // Time spent decompressing them
+	uint64_t decompressErrors;  // Compressed pages found corrupted, the accesses to them failed
+	uint64_t incompressible;    // Pages the compressor had to give up on
+};
+
 struct RAMFSObject {
 	uint8_t magic;            // Magic number
-	char name[128];           // The object's name
 	uint64_t length;          // The total length of the object (0 for directories)
 	bool isFile;              // Is it a file.
 	RAMFSObject *firstObject; // If it's a directory.
-	uint8_t *fileData;        // If it's a file.
-	FSNode *node;             // The object's node
+	void **pageTree;          // If it's a file, the root of its page tree
+	uint64_t pageTreeLevels;  // How tall the page tree is (0 if no page is there yet)
+	FSNode *node;             // The object's node, the driver keeps a reference to it
+
+	RAMFSObject *hashNext;    // The next object in the same bucket of the parent's index
+	RAMFSDirIndex *dirIndex;  // If it's a directory, the index of its entries
+	uint64_t dirElements;     // The number of entries in the directory
+
+	SpinLock lock;            // Taken to change the object, readers don't need it
+	SeqCount seq;             // Changes when the page tree or the index are rebuilt
 
+	RAMFSObject *parent;      // The directory that contains it
 	RAMFSObject *nextObject;  // The next object in the chain
+	RAMFSObject *prevObject;  // The previous one, only followed by writers
+	uint64_t sequence;        // When it was added to its directory, later entries have higher ones
+	uint64_t nextSequence;    // If it's a directory, the sequence number of the last entry added
+
+	bool deleted;             // Out of its directory, nothing can change it anymore
+	RCUHead rcu;              // Lock-free readers may still be on it once it's deleted
 };
 
+/* RAMFSInodeCache
+ *  A few free inodes a CPU can hand out and take back without touching
+ *  the allocator. Their slots are tagged free, but aren't on the free list.
+ */
+struct RAMFSInodeCache {
+	SpinLock lock;
+	uint64_t count;                             // Inodes in the cache
+	uint64_t inodes[RAMFS_INODE_CACHE_SIZE];    // The inodes themselves
+} __attribute__((aligned(64)));
+
 class RAMFSDriver : public FSDriver {
 public:
-	RAMFSDriver(FSNode *mountpoint, const uint64_t argMaxInodes) : maxInodes(argMaxInodes) {
+	RAMFSDriver(FSNode *mountpoint, const uint64_t argMaxInodes) : maxInodes(argMaxInodes < RAMFS_MAX_INODES ? argMaxInodes : RAMFS_MAX_INODES) {
 		FSInit(mountpoint);
 	}
 
@@ -68,20 +262,66 @@ public:
 	void		FSDelete() override;
 	uint64_t        FSReadFile(FILE *file, uint64_t offset, size_t size, uint8_t **buffer) override;
 	uint64_t        FSWriteFile(FILE *file, uint64_t offset, size_t size, uint8_t *buffer) override;
+	uint64_t        FSReadFileV(FILE *file, uint64_t offset, const FSIOVec *vectors, size_t count) override;
+	uint64_t        FSWriteFileV(FILE *file, uint64_t offset, const FSIOVec *vectors, size_t count) override;
 	FILE           *FSOpenFile(FSNode *node, uint64_t descriptor) override;
 	void            FSCloseFile(FILE *file) override;
 	uint64_t	FSDeleteFile(FSNode *node) override;
 	FSNode         *FSReadDir(FSNode *node, uint64_t index) override;
 	FSNode         *FSMakeDir(FSNode *node, const char *name, uint64_t uid, uint64_t gid, uint64_t mask) override;
 	FSNode         *FSMakeFile(FSNode *node, const char *name, uint64_t uid, uint64_t gid, uint64_t mask) override;
-	FSNode         *FSFindDir(FSNode *node, const char *name) override;
+	FSNode         *FSFindDir(FSNode *node, const FSNameKey *key) override;
+	uint64_t        FSIterateDir(FSNode *node, uint64_t *cursor, VFSDirEntry *buffer, size_t bufferSize) override;
 	uint64_t        FSGetDirElements(FSNode *node) override;
 	uint64_t        FSDeleteDir(FSNode *node) override;
+	const uint8_t  *FSGetPage(FILE *file, uint64_t index, size_t *length) override;
+	uint8_t        *FSGetWritablePage(FILE *file, uint64_t index) override;
+	void            FSPutPage(FILE *file, uint64_t index, const uint8_t *data) override;
+	FSNode         *FSCloneFile(FSNode *node, FSNode *directory, const char *name) override;
+	uint64_t        FSDedupFile(FSNode *node) override;
+
+	bool            CompressPages(uint64_t *budget, uint64_t *compressed);
+
+	RAMFSDriver *nextDriver;   // All the instances are chained, for the compressor
+	uint64_t compressorRefs;   // Set while the compressor is in here, under the list's lock
 private:
-	uint64_t currentInode;     // The first free inode
-	const uint64_t maxInodes;  // The maximum number of inodes (has to be defined at the start)
+	FSNode         *CreateObject(FSNode *directoryNode, const char *name, bool isFile, uint64_t uid, uint64_t gid, uint64_t mask);
+	uint64_t        DeleteObject(FSNode *node, bool isFile);
+	void            DestroyObject(RAMFSObject *object);
+	RAMFSObject    *IndexFind(RAMFSObject *directory, const FSNameKey *key);
+	void            IndexInsert(RAMFSObject *directory, RAMFSObject *object);
+	void          **GetFileSlot(RAMFSObject *object, uint64_t index, bool create);
+	uint8_t        *GetFilePage(RAMFSObject *object, uint64_t index, bool create);
+	uint8_t        *FindFilePage(RAMFSObject *object, uint64_t index);
+	uint8_t        *Uncompress(RAMFSObject *object, uint64_t index);
+
+	RAMFSObject    *GetObject(uint64_t inode);
+	RAMFSObject    *GetNodeObject(FSNode *node);
+	RAMFSObject    *LockNode(FSNode *node, bool isFile);
+	uint64_t        AllocInode(RAMFSObject *object);
+	void            FreeInode(uint64_t inode);
+	void            RefillInodes(RAMFSInodeCache *cache);
+	void            DrainInodes(RAMFSInodeCache *cache, uint64_t count);
+
+	RAMFSInodeCache inodeCaches[SYNC_MAX_CPUS];
+	SpinLock inodeLock;        // Protects the free list, the never used inodes and the chunks of the table
+	uint64_t currentInode;     // The first inode that was never handed out
+	uint64_t freeInode;        // The head of the free inode list
+	const uint64_t maxInodes;  // The maximum number of inodes
 
 	RAMFSObject *rootFile;     // The root file, that has the root node
 
-	RAMFSObject **inodeTable;  // The inode table
+	RAMFSObject ***inodeTable; // The inode table, a chunk of slots for every RAMFS_INODE_CHUNK_SLOTS inodes
+	uint64_t inodeChunkCount;  // The number of chunks the table can have
+
+	uint64_t compressInode;    // Where the compressor stopped last time
+	uint64_t compressIndex;
 };
+
+namespace RAMFS {
+	void GetStats(RAMFSStats *result);
+
+	/* Looks at up to budget pages of all the mounts, compressing the ones that weren't used
+	 * since the last sweep. Returns how many it compressed. Does nothing without CONFIG_FS_RAMFS_COMPRESSION */
+	uint64_t CompressorTick(uint64_t budget);
+}
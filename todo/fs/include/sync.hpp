@@ -0,0 +1,131 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+static inline void CPURelax() {
+#if defined(__x86_64__)
+	asm volatile("pause" ::: "memory");
+#elif defined(__aarch64__)
+	asm volatile("yield" ::: "memory");
+#endif
+}
+
+static inline uint64_t ReadCycles() {
+#if defined(__x86_64__)
+	uint32_t low, high;
+	asm volatile("rdtsc" : "=a"(low), "=d"(high));
+	return ((uint64_t)high << 32) | low;
+#elif defined(__aarch64__)
+	uint64_t value;
+	asm volatile("isb; mrs %0, cntvct_el0" : "=r"(value));
+	return value;
+#else
+	return 0;
+#endif
+}
+
+#define SYNC_MAX_CPUS	64	// CPUs with per-CPU state of their own, has to be a power of two. Others share it
+
+/* The index of the CPU we're running on. We can be moved right after asking, so it only
+ * picks which per-CPU slot to use: the slots are still locked or atomic, and sharing one is
+ * slower but safe. On x86_64 it's the IA32_TSC_AUX the kernel sets to the CPU's index
+ * while bringing it up (as Linux does), on aarch64 the affinity levels of MPIDR_EL1 */
+static inline uint64_t CurrentCPU() {
+#if defined(__x86_64__)
+	uint32_t low, high, aux;
+	asm volatile("rdtscp" : "=a"(low), "=d"(high), "=c"(aux));
+	return aux;
+#elif defined(__aarch64__)
+	uint64_t mpidr;
+	asm volatile("mrs %0, mpidr_el1" : "=r"(mpidr));
+	return (mpidr & 0xFF) | ((mpidr >> 8) & 0xFF00);
+#else
+	return 0;
+#endif
+}
+
+/* SpinLock
+ *  A test-and-test-and-set lock for the short critical sections of the VFS.
+ *  It's zero-initialized to unlocked, so it can live in any struct.
+ */
+struct SpinLock {
+	volatile uint32_t locked;
+
+	void Lock() {
+		while (__atomic_exchange_n(&locked, 1, __ATOMIC_ACQUIRE)) {
+			while (__atomic_load_n(&locked, __ATOMIC_RELAXED)) CPURelax();
+		}
+	}
+
+	bool TryLock() {
+		return __atomic_exchange_n(&locked, 1, __ATOMIC_ACQUIRE) == 0;
+	}
+
+	void Unlock() {
+		__atomic_store_n(&locked, 0, __ATOMIC_RELEASE);
+	}
+};
+
+/* SeqCount
+ *  Lets readers look at data without stopping writers: the count is odd while
+ *  a write is in progress, and a reader that saw it change tries again.
+ *  Writers have to be serialized by something else (es: a lock of the object).
+ */
+struct SeqCount {
+	volatile uint32_t sequence;
+
+	uint32_t ReadBegin() const {
+		uint32_t start;
+		while ((start = __atomic_load_n(&sequence, __ATOMIC_ACQUIRE)) & 1) CPURelax();
+
+		return start;
+	}
+
+	bool ReadRetry(uint32_t start) const {
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		return __atomic_load_n(&sequence, __ATOMIC_RELAXED) != start;
+	}
+
+	void WriteBegin() {
+		__atomic_store_n(&sequence, sequence + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+
+	void WriteEnd() {
+		__atomic_store_n(&sequence, sequence + 1, __ATOMIC_RELEASE);
+	}
+};
+
+/* RCUHead
+ *  Embedded in objects that lock-free readers can still be looking at after
+ *  they've been unlinked. The object is handed to RCU::Retire, and reclaim is
+ *  called once every reader that could have seen it is gone.
+ */
+struct RCUHead {
+	RCUHead *next;
+	void (*reclaim)(RCUHead *head);
+	uint64_t epoch;		// When it was retired
+};
+
+/* A simple epoch-based RCU. Readers count themselves in the current epoch, on a
+ * counter of their CPU so that read sections don't share a cache line between CPUs.
+ * The epoch only moves on when the readers of the previous one are gone,
+ * and objects retired in epoch E are reclaimed from epoch E + 2 on.
+ * Nothing ever waits for a grace period, so Retire is safe inside a read section
+ * (es: when dropping the last reference to a node during a lookup). */
+namespace RCU {
+	uint64_t ReadLock();
+	void ReadUnlock(uint64_t token);
+
+	void Retire(RCUHead *head, void (*reclaim)(RCUHead *head));
+
+	/* Reclaims what can be reclaimed, callers that retire little should call it now and then */
+	void Poll();
+
+	/* Waits for every reader inside a read section now to leave. Never call it in a read section */
+	void Synchronize();
+
+	/* Waits until everything retired so far is reclaimed, not for what others retire meanwhile.
+	 * Never call it in a read section, nor from a reclaim callback */
+	void Barrier();
+}
@@ -0,0 +1,93 @@
+#pragma once
+#include <fs/vfs.hpp>
+
+/******************
+ * MICROK's SYSFS *
+ ******************
+ *
+ * DIRECTORY STRUCTURE
+ *
+ *  /sys
+ *   \- pci
+ *       \- 00:1f.2        One directory per PCI function, named bus:device.function
+ *           |- info       Every attribute below, one per line, for tools that want it all at once
+ *           |- vendor
+ *           |- device
+ *           |- class
+ *           |- subclass
+ *           |- progif
+ *           |- revision
+ *           |- irq_line
+ *           |- irq_pin
+ *           \- bar0-bar5  Only for functions with a type 0 header
+ *
+ *  Nothing is stored: directories are listed straight from the objects PCI::EnumeratePCI
+ *  built, and attributes are read from the configuration space when the file is opened.
+ *
+ *
+ * INODES
+ *
+ *  An inode says where in the tree the object is, so it can be found without any table:
+ *
+ *   63      56 55              24 23    16 15     8 7      0
+ *  +----------+------------------+--------+--------+--------+
+ *  |   type   |     reserved     |  bus   | dev/fn |  attr  |
+ *  +----------+------------------+--------+--------+--------+
+ *
+ *  Nodes are only made the first time an object is looked up, then kept
+ *  in a hash table (chained through the node's impl) so there is one per object.
+ */
+
+#define SYSFS_NODE_ROOT		0x00	// /sys
+#define SYSFS_NODE_PCI		0x01	// /sys/pci
+#define SYSFS_NODE_FUNCTION	0x02	// /sys/pci/BB:DD.F
+#define SYSFS_NODE_ATTRIBUTE	0x03	// /sys/pci/BB:DD.F/attribute
+
+#define SYSFS_INODE(type, bus, slot, attr)	(((uint64_t)(type) << 56) | ((uint64_t)(bus) << 16) | ((uint64_t)(slot) << 8) | (uint64_t)(attr))
+#define SYSFS_INODE_TYPE(inode)			((inode) >> 56)
+#define SYSFS_INODE_BUS(inode)			(((inode) >> 16) & 0xFF)
+#define SYSFS_INODE_SLOT(inode)			(((inode) >> 8) & 0xFF)	// device << 3 | function
+#define SYSFS_INODE_ATTRIBUTE(inode)		((inode) & 0xFF)
+
+#define SYSFS_ATTR_INFO		0
+#define SYSFS_ATTR_VENDOR	1
+#define SYSFS_ATTR_DEVICE	2
+#define SYSFS_ATTR_CLASS	3
+#define SYSFS_ATTR_SUBCLASS	4
+#define SYSFS_ATTR_PROGIF	5
+#define SYSFS_ATTR_REVISION	6
+#define SYSFS_ATTR_IRQ_LINE	7
+#define SYSFS_ATTR_IRQ_PIN	8
+#define SYSFS_ATTR_BAR0		9	// Up to SYSFS_ATTR_BAR0 + 5
+#define SYSFS_ATTR_COUNT	15
+
+#define SYSFS_NODE_BUCKETS	256	// Has to be a power of two
+
+class SysFSDriver : public FSDriver {
+public:
+	SysFSDriver(FSNode *mountpoint) {
+		FSInit(mountpoint);
+	}
+
+	void            FSInit(FSNode *mountpoint) override;
+	void		FSDelete() override;
+	uint64_t        FSReadFile(FILE *file, uint64_t offset, size_t size, uint8_t **buffer) override;
+	uint64_t        FSWriteFile(FILE *file, uint64_t offset, size_t size, uint8_t *buffer) override;
+	FILE           *FSOpenFile(FSNode *node, uint64_t descriptor) override;
+	void            FSCloseFile(FILE *file) override;
+	uint64_t	FSDeleteFile(FSNode *node) override;
+	FSNode         *FSReadDir(FSNode *node, uint64_t index) override;
+	FSNode         *FSMakeDir(FSNode *node, const char *name, uint64_t uid, uint64_t gid, uint64_t mask) override;
+	FSNode         *FSMakeFile(FSNode *node, const char *name, uint64_t uid, uint64_t gid, uint64_t mask) override;
+	FSNode         *FSFindDir(FSNode *node, const FSNameKey *key) override;
+	uint64_t        FSIterateDir(FSNode *node, uint64_t *cursor, VFSDirEntry *buffer, size_t bufferSize) override;
+	uint64_t        FSGetDirElements(FSNode *node) override;
+	uint64_t        FSDeleteDir(FSNode *node) override;
+private:
+	FSNode         *GetNode(FSNode *parent, uint64_t inode);
+	bool            NextChild(FSNode *node, uint64_t *cursor, uint64_t *inode);
+	uint64_t        GetName(uint64_t inode, char *name);
+
+	SpinLock nodeLock;                  // Taken to look in or add to the table
+	FSNode *nodes[SYSFS_NODE_BUCKETS];  // The nodes made so far, by inode
+};
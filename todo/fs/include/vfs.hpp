@@ -2,6 +2,8 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <init/kinfo.hpp>
+#include <fs/fsname.hpp>
+#include <fs/sync.hpp>
 
 #define VFS_NODE_FILE		0x0001
 #define VFS_NODE_DIRECTORY	0x0002
@@ -11,8 +13,45 @@
 #define VFS_NODE_PIPE		0x000A
 #define VFS_NODE_SYMLINK	0x000C
 #define VFS_NODE_MOUNTPOINT	0x000E
+#define VFS_NODE_TYPE		0x000F	// The bits above are the node's type, the ones below are flags
+
+#define VFS_NODE_MOUNTED	0x0010	// A filesystem is mounted on the node
+
+#define VFS_MOUNT_BUCKETS	64	// Has to be a power of two
+
+#define VFS_PAGE_SHIFT		12
+#define VFS_PAGE_SIZE		(1 << VFS_PAGE_SHIFT)
+
+#define VFS_DIR_CURSOR_START	0			// Where a directory iteration begins
+#define VFS_DIR_CURSOR_END	0xFFFFFFFFFFFFFFFF	// Where it has nowhere left to go
+#define VFS_LIST_BUFFER		1024			// Bytes of entries VFS::ListDir asks for at a time
+
+#define FS_DRIVER_PAGECACHE	0x0001	// The VFS should cache the file data of this driver
+#define FS_DRIVER_SNAPSHOT	0x0002	// Every open file has its own copy of the data, FILE::bufferSize long
+
+#define VFS_READAHEAD_MIN	4	// Pages prefetched when a file starts being read sequentially
+#define VFS_READAHEAD_MAX	32	// The window doesn't grow past this
+
+#define VFS_TICK_INTERVAL	(100 * 1000 * 1000)	// Cycles (see ReadCycles) between two runs of VFS::Tick
+#define VFS_TICK_PAGES		8			// Pages each job of VFS::Tick gets through in a run
+
+#define VFS_OP_READ		0x0001	// A batched read, see VFS::SubmitBatch
+#define VFS_OP_WRITE		0x0002	// A batched write
 
 struct FSNode;
+struct VFilesystem;
+
+/* FileReadahead
+ *  How a file is being read, to guess what it will need next.
+ *  Only files of drivers that use the page cache are prefetched.
+ */
+struct FileReadahead {
+	uint64_t nextOffset;	// Where a sequential read would start
+	uint64_t window;	// Pages prefetched ahead of the reader, 0 if it's reading randomly
+	uint64_t end;		// The page after the last one prefetched
+	uint64_t prefetched;	// Pages prefetched for this file
+	uint64_t hits;		// Prefetched pages that were then read
+};
 
 /* FILE
  *  The standard file I/O struct
@@ -24,14 +63,81 @@ struct FILE {
 	uint64_t descriptor;	// The descriptor of the file
 	uint64_t bufferSize;	// The size read/write buffer
 	uint64_t bufferPos;	// Where we last wrote to/read from
+	uint64_t impl;		// Free parameter for filesystem drivers
+	uint64_t refCount;	// References to the file, giving back the last one closes it
+
+	FileReadahead readahead;	// Managed by the VFS
+	RCUHead rcu;		// A descriptor lookup may still be looking at it after it's closed
+};
+
+/* FilePage
+ *  A reference to one page of a file's contents, handed out without copying.
+ *  The data is shared with the filesystem, so it may only be written
+ *  after VFS::MakeFilePagePrivate has given the caller its own copy.
+ */
+struct FilePage {
+	FILE *file;		// The file the page belongs to
+	uint64_t index;		// The offset of the page in the file, in pages
+	const uint8_t *data;	// The contents of the page
+	size_t length;		// How many bytes of the page are part of the file
+	uint8_t *privateData;	// The caller's own copy, if it asked to write
+	void *handle;		// What the page has to be given back to
+};
+
+/* FSIOVec
+ *  One piece of a scatter/gather transfer
+ */
+struct FSIOVec {
+	uint8_t *buffer;	// Where the data comes from or goes to
+	size_t length;		// How many bytes
+};
+
+/* VFSBatchOp
+ *  A single operation of a batch. Operations in a batch are independent
+ *  of each other, result is filled in as each one completes.
+ */
+struct VFSBatchOp {
+	FILE *file;		// The file to operate on
+	uint64_t opcode;	// VFS_OP_READ or VFS_OP_WRITE
+	uint64_t offset;	// Where in the file
+	const FSIOVec *vectors;	// The buffers, in order
+	size_t count;		// How many buffers
+	uint64_t result;	// Bytes transferred
 };
 
+/* VFSDirEntry
+ *  A compact directory entry, as filled in by FSIterateDir.
+ *  Entries are packed one after another in the caller's buffer,
+ *  each one recordLength bytes long (always a multiple of 8).
+ */
+struct VFSDirEntry {
+	uint64_t inode;		// The inode of the object
+	uint32_t flags;		// The node's flags (es: file, directory, symlink...)
+	uint16_t recordLength;	// Where the next entry starts, from the start of this one
+	uint16_t nameLength;	// The name's length, without the terminator
+	char name[];		// The name, NULL-terminated
+};
+
+/* FSNodeHolds
+ *  References to the nodes of a driver taken and given back by its users
+ *  on one CPU. Both only grow, and every CPU has its own cache line.
+ */
+struct FSNodeHolds {
+	uint64_t taken;
+	uint64_t given;
+} __attribute__((aligned(64)));
+
 /* FSDriver
  *  This is the basic class for any filesystem driver
  *
  */
 class FSDriver {
 public:
+	FSDriver() : rootNode(NULL), driverFlags(0), mount(NULL) {
+		for (int i = 0; i < SYNC_MAX_CPUS; i++) holds[i].taken = holds[i].given = 0;
+	}
+	virtual ~FSDriver() { }
+
 	virtual void            FSInit(FSNode *mountpoint) = 0;
 
 	virtual void            FSDelete() = 0;
@@ -52,24 +158,71 @@ public:
 
 	virtual FSNode         *FSReadDir(FSNode *node, uint64_t index) = 0;
 
-	virtual FSNode         *FSFindDir(FSNode *node, const char *name) = 0;
+	virtual FSNode         *FSFindDir(FSNode *node, const FSNameKey *key) = 0;
+
+	/* Fills buffer with as many entries as it can, starting from *cursor, and returns
+	 * the number of bytes used. *cursor is opaque to the caller and is moved to
+	 * VFS_DIR_CURSOR_END once the whole directory has been returned */
+	virtual uint64_t        FSIterateDir(FSNode *node, uint64_t *cursor, VFSDirEntry *buffer, size_t bufferSize) = 0;
 
 	virtual uint64_t        FSGetDirElements(FSNode *node) = 0;
 
 	virtual uint64_t        FSDeleteDir(FSNode *node) = 0;
 
+	/* Drivers that keep file data in memory can hand out their pages directly.
+	 * The page stays valid until FSPutPage is called on it, even if the file is written
+	 * in the meantime and stops using it */
+	virtual const uint8_t  *FSGetPage(FILE *file, uint64_t index, size_t *length) { return NULL; }
+
+	virtual void            FSPutPage(FILE *file, uint64_t index, const uint8_t *data) { }
+
+	/* Like FSGetPage, but the page may be written in place (es: by a shared mapping).
+	 * Holes get a page of their own. It's given back with FSPutPage too */
+	virtual uint8_t        *FSGetWritablePage(FILE *file, uint64_t index) { return NULL; }
+
+	/* Makes a copy of a file in directory, both on this driver. Drivers that can share
+	 * the data between the two (es: copy on write) do it in O(pages) without copying it */
+	virtual FSNode         *FSCloneFile(FSNode *node, FSNode *directory, const char *name) { return NULL; }
+
+	/* Lets the file share the pages it has in common with other files, returns how many it gave up */
+	virtual uint64_t        FSDedupFile(FSNode *node) { return 0; }
+
+	/* Scatter/gather transfers, returning the bytes transferred.
+	 * The defaults go through FSReadFile/FSWriteFile once per vector,
+	 * drivers that can do better (es: a single DMA request) override them */
+	virtual uint64_t        FSReadFileV(FILE *file, uint64_t offset, const FSIOVec *vectors, size_t count);
+
+	virtual uint64_t        FSWriteFileV(FILE *file, uint64_t offset, const FSIOVec *vectors, size_t count);
+
+	/* Runs the operations of a batch that all belong to this driver, returning
+	 * how many were completed. The default runs them one by one */
+	virtual uint64_t        FSSubmitBatch(VFSBatchOp *ops, size_t count);
+
 	FSNode *rootNode;
+	uint64_t driverFlags;	// Tells the VFS how to treat the driver
+	VFilesystem *mount;	// Where the driver is mounted, NULL if it isn't
+
+	/* References to the driver's nodes held outside of it (not the ones the driver
+	 * keeps for itself, or the ones nodes keep to their parents), see VFS::RefNode */
+	FSNodeHolds holds[SYNC_MAX_CPUS];
 private:
 };
 
 /* FSNode
  *  This permits an implementation-independent communcation between
- *  all the components of the VFS
+ *  all the components of the VFS.
+ *  There is one node per object, shared by everyone that looks it up:
+ *  whoever gets a node from the VFS owns a reference and gives it
+ *  back with VFS::PutNode. Freeing is deferred with RCU, so lock-free
+ *  lookups can take a reference with VFS::TryRefNode.
  */
 struct FSNode {
 	FSDriver *driver;       // The filesystem driver
+	uint64_t refCount;	// References to the node, it's freed when none are left
+	FSNode *parent;		// The directory that contains the node, NULL for the root of a filesystem.
+				// The node holds a reference to it, so it's there as long as the node is
 
-	char name[128];		// The name of the current object
+	FSName name;		// The name of the current object
 	uint64_t mask;		// Permission mask
 	uint64_t uid;		// User ID
 	uint64_t gid;		// Group ID
@@ -77,38 +230,103 @@ struct FSNode {
 	uint64_t inode;		// Implementation-driven inode for filesystem drivers
 	uint64_t size;		// The node's size
 	uint64_t impl;		// Free parameter for filesystem drivers
+
+	RCUHead rcu;		// Lookups may still be looking at a node after its last reference is gone
 };
 
+/* VFilesystem
+ *  A mounted filesystem. Mounts are found through a hash table keyed
+ *  on the driver and inode of the directory they are mounted on,
+ *  which path lookups read without taking any lock.
+ */
 struct VFilesystem {
-	FSNode *node;
-	FSNode *mountdir;
+	FSNode *node;		// The root of the filesystem
+	FSDriver *driver;	// Its driver
+	FSNode *mountdir;	// The directory it's mounted on, NULL for the rootfs
 
 	uint64_t flags;
+	bool unmounting;	// UmountFS is working on it
+
+	VFilesystem *hashNext;	// The next mount in the same bucket of the table
+	VFilesystem *next;	// The next mounted filesystem
+
+	RCUHead rcu;		// Lookups may still be looking at it after it's unmounted
 };
 
 namespace VFS {
-	void ListDir(FSNode *dir);
+	/* Calls callback on every entry of dir, a batch at a time, and returns how many there were.
+	 * The entry is only valid during the call */
+	uint64_t ListDir(FSNode *dir, void (*callback)(const VFSDirEntry *entry, void *context), void *context);
+
+	uint64_t HashName(const char *name, size_t length);
+	void MakeNameKey(FSNameKey *key, const char *name, size_t length);
+
+	FSNode *AllocNode();
+	void FreeNode(FSNode *node);
+	/* References taken and given back by whoever uses a node. A driver doesn't use them for the
+	 * reference it gets from AllocNode, which it gives back with ReleaseNode, nor for the parent */
+	FSNode *RefNode(FSNode *node);
+	FSNode *TryRefNode(FSNode *node);
+	void PutNode(FSNode *node);
+	void ReleaseNode(FSNode *node);
+	void SetParent(FSNode *node, FSNode *parent);
+	FILE *AllocFile();
+	void FreeFile(FILE *file);
+	/* References to an open file. OpenFile gives the first one, CloseFile gives it back */
+	FILE *RefFile(FILE *file);
+	FILE *TryRefFile(FILE *file);
+	void PutFile(FILE *file);
 
 
 	void Init(KInfo *info);
 
-	FSNode *GetNode(VFilesystem *fs, char *path);
+	// Every function returning an FSNode gives the caller a reference to it
+	FSNode *GetNode(VFilesystem *fs, const char *path);
+	FSNode *GetNodeAt(FSNode *dir, const char *path);
 
 	VFilesystem *GetRootFS();
 	VFilesystem *GetInitrdFS();
+	/* Mounts a RAMFS image (see fs/ramfs/image.hpp) on /initrd in place of the empty RAMFS,
+	 * without copying it: the kernel calls it with the bootloader module whose cmdline is "ramfs" */
+	VFilesystem *MountInitrdImage(const void *image, size_t size);
 
 	VFilesystem *MountFS(FSNode *mountroot, FSDriver *fsdriver, uint64_t flags);
+	/* Call it in an RCU read section, the result is only valid inside it */
+	VFilesystem *FindMount(FSNode *mountdir);
 	uint64_t RemountFS(VFilesystem *fs, uint64_t flags);
+	/* Fails if the filesystem is busy: something holds one of its nodes (es: an open file,
+	 * or the mountpoint of another filesystem), or its dirty data can't be written back */
 	uint64_t UmountFS(VFilesystem *fs);
 	FSNode *MakeFile(FSNode *node, const char *name, uint64_t uid, uint64_t gid, uint64_t mask);
 	FILE *OpenFile(FSNode *node);
+	FILE *OpenFile(FSNode *node, uint64_t descriptor);
 	uint64_t GetFileSize(FILE *file);
 	uint64_t ReadFile(FILE *file, uint64_t offset, size_t size, uint8_t **buffer);
 	uint64_t WriteFile(FILE *file, uint64_t offset, size_t size, uint8_t *buffer);
+	uint64_t ReadFileV(FILE *file, uint64_t offset, const FSIOVec *vectors, size_t count);
+	uint64_t WriteFileV(FILE *file, uint64_t offset, const FSIOVec *vectors, size_t count);
+	uint64_t SubmitBatch(VFSBatchOp *ops, size_t count);
+	bool GetFilePage(FILE *file, uint64_t offset, FilePage *page);
+	uint8_t *MakeFilePagePrivate(FilePage *page);
+	uint8_t *MakeFilePageWritable(FilePage *page);
+	void PutFilePage(FilePage *page);
 	void CloseFile(FILE *file);
+	uint64_t SyncFile(FILE *file);
+	void Sync();
+	/* The VFS's periodic work, es: writing back old dirty data, compressing cold RAMFS pages.
+	 * This is the hook for a kernel thread or timer, whichever comes first should call it. Until then the VFS
+	 * calls it itself as files are read, written and closed, so a run does at most VFS_TICK_PAGES pages
+	 * of each job on the caller's time. It runs at most once every VFS_TICK_INTERVAL, calls in between return right away */
+	void Tick();
 	uint64_t DeleteFile(FSNode *node);
+	FSNode *CloneFile(FSNode *node, FSNode *directory, const char *name);
+	/* CloneFile's copy across drivers calls it. Whoever fills a file in bulk
+	 * (es: unpacking an archive) can call it once the file is written */
+	uint64_t DedupFile(FSNode *node);
 	FSNode *MakeDir(FSNode *node, const char *name, uint64_t uid, uint64_t gid, uint64_t mask);
 	FSNode *ReadDir(FSNode *node, uint64_t index);
+	uint64_t IterateDir(FSNode *node, uint64_t *cursor, VFSDirEntry *buffer, size_t bufferSize);
+	VFSDirEntry *PutDirEntry(VFSDirEntry *buffer, size_t bufferSize, uint64_t *used, uint64_t inode, uint32_t flags, const char *name, size_t length);
 	FSNode *FindDir(FSNode *node, const char *name);
 	uint64_t GetDirElements(FSNode *node);
 	uint64_t DeleteDir(FSNode *node);
@@ -0,0 +1,67 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <fs/vfs.hpp>
+
+/*********************
+ * MICROK's VFSBENCH *
+ *********************
+ *
+ *  Measures how the VFS scales with the number of cores.
+ *  Every CPU calls StartCPU once the SMP bring-up has it running. For k going from 1
+ *  to the number of CPUs the first k of them run five phases while the others wait at the barrier:
+ *   - open:   path lookup, open and close of files shared by everyone
+ *   - read:   small reads of a file shared by everyone
+ *   - create: new files, each CPU in its own directory
+ *   - delete: the files of the create phase go away
+ *   - churn:  a file is made, gets a page of data and is deleted, over and over
+ *  A phase lasts as long as its slowest CPU. The results are in /proc/vfsbench,
+ *  one line per k with the operations per million cycles of every phase.
+ *  Open and read take no shared lock and should grow about linearly with k.
+ *  Create, delete and churn still go through the lock of the dentry cache,
+ *  and the RAMFS inode allocator when a CPU's own inodes run out.
+ *  Every line ends with the objects and the pages RAMFS holds after the run,
+ *  once what it deleted has been reclaimed.
+ */
+
+#define VFSBENCH_MAX_CPUS	64	// CPUs past this don't take part
+#define VFSBENCH_FILES		16	// Shared files the open phase goes through
+#define VFSBENCH_OPENS		2048	// Operations per CPU in the open phase
+#define VFSBENCH_READS		8192	// Operations per CPU in the read phase
+#define VFSBENCH_CREATES	256	// Operations per CPU in the create (and delete) phase
+#define VFSBENCH_CHURNS		256	// Operations per CPU in the churn phase
+#define VFSBENCH_READ_SIZE	64	// Bytes per read
+
+#define VFSBENCH_PHASE_OPEN	0
+#define VFSBENCH_PHASE_READ	1
+#define VFSBENCH_PHASE_CREATE	2
+#define VFSBENCH_PHASE_DELETE	3
+#define VFSBENCH_PHASE_CHURN	4
+#define VFSBENCH_PHASES		5
+
+/* VFSBenchResult
+ *  One phase of one run
+ */
+struct VFSBenchResult {
+	uint64_t operations;	// Done by all the CPUs together
+	uint64_t cycles;	// Taken by the slowest one
+};
+
+/* VFSBenchMemory
+ *  What RAMFS holds at the end of a run
+ */
+struct VFSBenchMemory {
+	uint64_t objects;	// Files and directories
+	uint64_t pages;		// Data and page trees
+};
+
+namespace VFSBench {
+	/* Makes the files under /vfsbench and publishes /proc/vfsbench, before any Worker */
+	bool Init(uint64_t cpus);
+	/* Called once on every CPU, returns when the last run is over */
+	void Worker(uint64_t cpu);
+	/* The entry point for the SMP bring-up, called once on each of the cpus CPUs after the VFS is up:
+	 * the first one to get here runs Init, the others wait for it, then all of them run their Worker.
+	 * Without CONFIG_MP_SMP, VFS::Init calls it for the boot CPU alone */
+	void StartCPU(uint64_t cpu, uint64_t cpus);
+}
@@ -0,0 +1,146 @@
+#include <fs/lz.hpp>
+#include <mm/string.hpp>
+
+#define LZ_LAST_LITERALS	5	// The last bytes are always literals
+#define LZ_MATCH_LIMIT		12	// No match starts this close to the end
+
+static inline uint32_t Read32(const uint8_t *data) {
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+static inline uint32_t Hash(uint32_t sequence) {
+	return (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *PutLength(uint8_t *output, size_t length) {
+	// Lengths past the nibble go on in bytes of 255, the last one is smaller
+	while (length >= 255) {
+		*output++ = 255;
+		length -= 255;
+	}
+
+	*output++ = length;
+	return output;
+}
+
+static uint8_t *PutSequence(uint8_t *output, uint8_t *end, const uint8_t *literals, size_t literalLength, size_t offset, size_t matchLength) {
+	// Worst case: token, literal length, literals, offset, match length
+	size_t needed = 1 + literalLength / 255 + 1 + literalLength + 2 + matchLength / 255 + 1;
+	if (output + needed > end) return NULL;
+
+	uint8_t *token = output++;
+	size_t matchCode = matchLength != 0 ? matchLength - LZ_MIN_MATCH : 0;
+
+	*token = (literalLength < 15 ? literalLength : 15) << 4;
+	if (literalLength >= 15) output = PutLength(output, literalLength - 15);
+
+	memcpy(output, literals, literalLength);
+	output += literalLength;
+
+	// The last sequence stops at the literals
+	if (matchLength == 0) return output;
+
+	*output++ = offset & 0xFF;
+	*output++ = offset >> 8;
+
+	*token |= matchCode < 15 ? matchCode : 15;
+	if (matchCode >= 15) output = PutLength(output, matchCode - 15);
+
+	return output;
+}
+
+namespace LZ {
+size_t Compress(const uint8_t *source, size_t size, uint8_t *destination, size_t capacity) {
+	if (size > LZ_MAX_INPUT) return 0;
+
+	uint16_t table[1 << LZ_HASH_BITS];
+	memset(table, 0, sizeof(table));
+
+	uint8_t *output = destination;
+	uint8_t *end = destination + capacity;
+	size_t anchor = 0;
+	size_t position = 0;
+
+	while (size > LZ_MATCH_LIMIT && position < size - LZ_MATCH_LIMIT) {
+		uint32_t sequence = Read32(source + position);
+		uint32_t bucket = Hash(sequence);
+		size_t candidate = table[bucket];
+		table[bucket] = position;
+
+		if (candidate >= position || Read32(source + candidate) != sequence) {
+			position++;
+			continue;
+		}
+
+		size_t length = LZ_MIN_MATCH;
+		while (position + length < size - LZ_LAST_LITERALS && source[candidate + length] == source[position + length]) length++;
+
+		output = PutSequence(output, end, source + anchor, position - anchor, position - candidate, length);
+		if (output == NULL) return 0;
+
+		position += length;
+		anchor = position;
+	}
+
+	output = PutSequence(output, end, source + anchor, size - anchor, 0, 0);
+	if (output == NULL) return 0;
+
+	return output - destination;
+}
+
+size_t Decompress(const uint8_t *source, size_t size, uint8_t *destination, size_t capacity) {
+	size_t input = 0;
+	size_t output = 0;
+
+	while (input < size) {
+		uint8_t token = source[input++];
+
+		size_t literalLength = token >> 4;
+		if (literalLength == 15) {
+			uint8_t extra;
+			do {
+				if (input >= size) return 0;
+				extra = source[input++];
+				literalLength += extra;
+			} while (extra == 255);
+		}
+
+		if (input + literalLength > size || output + literalLength > capacity) return 0;
+
+		memcpy(destination + output, source + input, literalLength);
+		input += literalLength;
+		output += literalLength;
+
+		// The last sequence has no match
+		if (input == size) break;
+		if (input + 2 > size) return 0;
+
+		size_t offset = source[input] | (source[input + 1] << 8);
+		input += 2;
+		if (offset == 0 || offset > output) return 0;
+
+		size_t matchLength = (token & 15) + LZ_MIN_MATCH;
+		if ((token & 15) == 15) {
+			uint8_t extra;
+			do {
+				if (input >= size) return 0;
+				extra = source[input++];
+				matchLength += extra;
+			} while (extra == 255);
+		}
+
+		if (output + matchLength > capacity) return 0;
+
+		// Byte by byte, the match can overlap what it's producing
+		for (size_t i = 0; i < matchLength; i++) {
+			destination[output + i] = destination[output - offset + i];
+		}
+
+		output += matchLength;
+	}
+
+	return output;
+}
+}
@@ -0,0 +1,160 @@
+#include <fs/mmap.hpp>
+#include <fs/pagecache.hpp>
+#include <mm/memory.hpp>
+#include <mm/string.hpp>
+
+namespace VFS {
+VFSMapping *MapFile(VFSPageMapper *mapper, FSNode *node, uintptr_t address, size_t length, uint64_t offset, uint64_t protection, uint64_t flags) {
+	if (mapper == NULL) return NULL;
+	if (node == NULL) return NULL;
+	if (node->driver == NULL) return NULL;
+	if ((node->flags & VFS_NODE_TYPE) != VFS_NODE_FILE) return NULL;
+	if (length == 0) return NULL;
+	if (address & (VFS_PAGE_SIZE - 1)) return NULL;
+	if (offset & (VFS_PAGE_SIZE - 1)) return NULL;
+	if (flags != VFS_MAP_SHARED && flags != VFS_MAP_PRIVATE) return NULL;
+
+	uint64_t pages = (length + VFS_PAGE_SIZE - 1) >> VFS_PAGE_SHIFT;
+
+	// Mappings in the same address space can't overlap
+	for (VFSMapping *other = mapper->mappings; other != NULL; other = other->next) {
+		if (address < other->start + (other->pages << VFS_PAGE_SHIFT) &&
+		    other->start < address + (pages << VFS_PAGE_SHIFT)) return NULL;
+	}
+
+	VFSMapping *mapping = (VFSMapping*)Malloc(sizeof(VFSMapping));
+	if (mapping == NULL) return NULL;
+
+	mapping->mapped = (VFSMappedPage*)Malloc(sizeof(VFSMappedPage) * pages);
+	if (mapping->mapped == NULL) {
+		Free(mapping);
+		return NULL;
+	}
+
+	memset(mapping->mapped, 0, sizeof(VFSMappedPage) * pages);
+
+	mapping->file = OpenFile(node);
+	if (mapping->file == NULL) {
+		Free(mapping->mapped);
+		Free(mapping);
+		return NULL;
+	}
+
+	mapping->mapper = mapper;
+	mapping->start = address;
+	mapping->pages = pages;
+	mapping->firstPage = offset >> VFS_PAGE_SHIFT;
+	mapping->protection = protection;
+	mapping->flags = flags;
+
+	mapping->next = mapper->mappings;
+	mapper->mappings = mapping;
+
+	return mapping;
+}
+
+VFSMapping *FindMapping(VFSPageMapper *mapper, uintptr_t address) {
+	if (mapper == NULL) return NULL;
+
+	for (VFSMapping *mapping = mapper->mappings; mapping != NULL; mapping = mapping->next) {
+		if (address >= mapping->start && address - mapping->start < (mapping->pages << VFS_PAGE_SHIFT)) return mapping;
+	}
+
+	return NULL;
+}
+
+uint64_t HandleMappingFault(VFSPageMapper *mapper, uintptr_t address, bool write) {
+	VFSMapping *mapping = FindMapping(mapper, address);
+	if (mapping == NULL) return 1;
+	if (write && !(mapping->protection & VFS_MAP_WRITE)) return 1;
+	if (!write && !(mapping->protection & (VFS_MAP_READ | VFS_MAP_EXEC))) return 1;
+
+	uint64_t page = (address - mapping->start) >> VFS_PAGE_SHIFT;
+	uintptr_t pageAddress = mapping->start + (page << VFS_PAGE_SHIFT);
+	VFSMappedPage *mapped = &mapping->mapped[page];
+
+	if (mapped->page.data == NULL) {
+		// Past the end of the file there is nothing to map
+		uint64_t offset = (mapping->firstPage + page) << VFS_PAGE_SHIFT;
+		if (!GetFilePage(mapping->file, offset, &mapped->page)) return 1;
+
+		// A driver that shares its pages between files gives a file that's written its own copy.
+		// A shared mapping has to stay on the file's page, so it takes it as writable even to read:
+		// the driver doesn't share it with anyone else until the mapping lets go of it
+		FSDriver *driver = mapping->file->node->driver;
+		if ((mapping->flags & VFS_MAP_SHARED) && !(driver->driverFlags & FS_DRIVER_PAGECACHE) &&
+		    mapped->page.handle != NULL && MakeFilePageWritable(&mapped->page) == NULL) {
+			PutFilePage(&mapped->page);
+			return 1;
+		}
+	}
+
+	// Until it's written, the page is the file's own
+	if (!write) return mapper->MapPage(pageAddress, mapped->page.data, mapping->protection & ~VFS_MAP_WRITE) ? 0 : 1;
+
+	const uint8_t *data;
+	if (mapping->flags & VFS_MAP_PRIVATE) data = MakeFilePagePrivate(&mapped->page);
+	else data = MakeFilePageWritable(&mapped->page);
+
+	if (data == NULL) return 1;
+
+	if (!mapper->MapPage(pageAddress, data, mapping->protection)) return 1;
+	mapped->flags |= VFS_MAPPED_PAGE_WRITABLE;
+
+	return 0;
+}
+
+uint64_t SyncMapping(VFSMapping *mapping) {
+	if (mapping == NULL) return 1;
+	if (!(mapping->flags & VFS_MAP_SHARED)) return 0;
+
+	for (uint64_t i = 0; i < mapping->pages; i++) {
+		VFSMappedPage *mapped = &mapping->mapped[i];
+		if (!(mapped->flags & VFS_MAPPED_PAGE_WRITABLE)) continue;
+
+		// Drivers that couldn't share the page gave us a copy, it goes back the normal way
+		if (mapped->page.privateData != NULL) {
+			uint64_t offset = mapped->page.index << VFS_PAGE_SHIFT;
+			WriteFile(mapping->file, offset, mapped->page.length, mapped->page.privateData);
+		} else if (mapping->file->node->driver->driverFlags & FS_DRIVER_PAGECACHE) {
+			// It could have been written again after the flusher last cleaned it
+			PageCache::SetDirty((CachedPage*)mapped->page.handle);
+		}
+
+		// Read-only again, so we get to know about the next write
+		mapping->mapper->MapPage(mapping->start + (i << VFS_PAGE_SHIFT), mapped->page.data, mapping->protection & ~VFS_MAP_WRITE);
+		mapped->flags &= ~VFS_MAPPED_PAGE_WRITABLE;
+	}
+
+	return SyncFile(mapping->file);
+}
+
+void UnmapFile(VFSMapping *mapping) {
+	if (mapping == NULL) return;
+
+	SyncMapping(mapping);
+
+	for (uint64_t i = 0; i < mapping->pages; i++) {
+		VFSMappedPage *mapped = &mapping->mapped[i];
+		if (mapped->page.data == NULL) continue;
+
+		mapping->mapper->UnmapPage(mapping->start + (i << VFS_PAGE_SHIFT));
+		PutFilePage(&mapped->page);
+	}
+
+	VFSMapping **link = &mapping->mapper->mappings;
+	while (*link != NULL && *link != mapping) link = &(*link)->next;
+	if (*link != NULL) *link = mapping->next;
+
+	CloseFile(mapping->file);
+
+	Free(mapping->mapped);
+	Free(mapping);
+}
+
+void UnmapAll(VFSPageMapper *mapper) {
+	if (mapper == NULL) return;
+
+	while (mapper->mappings != NULL) UnmapFile(mapper->mappings);
+}
+}
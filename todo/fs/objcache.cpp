@@ -0,0 +1,250 @@
+#include <fs/objcache.hpp>
+#include <fs/vfs.hpp>
+#include <mm/pmm.hpp>
+#include <mm/memory.hpp>
+#include <mm/string.hpp>
+
+ObjectCache *ObjectCache::cacheList;
+
+void ObjectCache::Init(const char *cacheName, size_t size) {
+	name = cacheName;
+
+	// Keep every object aligned and able to hold the free list link
+	if (size < sizeof(void*)) size = sizeof(void*);
+	objectSize = (size + 15) & ~15;
+
+	// Make sure a slab holds a reasonable number of objects, next to its ObjectSlab
+	slabPages = (objectSize * 8 + sizeof(ObjectSlab) + VFS_PAGE_SIZE - 1) / VFS_PAGE_SIZE;
+	slabObjects = (slabPages * VFS_PAGE_SIZE - sizeof(ObjectSlab)) / objectSize;
+
+	depotLock.locked = 0;
+	depot = depotTail = NULL;
+	slabIndex = NULL;
+	slabIndexSize = 0;
+	depotCount = emptySlabs = slabs = objects = inUse = reclaimed = 0;
+
+	for (int i = 0; i < OBJCACHE_MAGAZINES; i++) {
+		magazines[i].lock.locked = 0;
+		magazines[i].count = 0;
+	}
+
+	nextCache = cacheList;
+	cacheList = this;
+}
+
+ObjectMagazine *ObjectCache::GetMagazine() {
+	return &magazines[CurrentCPU() & (OBJCACHE_MAGAZINES - 1)];
+}
+
+static void DepotRemove(ObjectSlab **head, ObjectSlab **tail, ObjectSlab *slab) {
+	if (slab->prev != NULL) slab->prev->next = slab->next;
+	else *head = slab->next;
+	if (slab->next != NULL) slab->next->prev = slab->prev;
+	else *tail = slab->prev;
+}
+
+static void DepotPushFront(ObjectSlab **head, ObjectSlab **tail, ObjectSlab *slab) {
+	slab->prev = NULL;
+	slab->next = *head;
+	if (*head != NULL) (*head)->prev = slab;
+	else *tail = slab;
+	*head = slab;
+}
+
+static void DepotPushBack(ObjectSlab **head, ObjectSlab **tail, ObjectSlab *slab) {
+	slab->next = NULL;
+	slab->prev = *tail;
+	if (*tail != NULL) (*tail)->next = slab;
+	else *head = slab;
+	*tail = slab;
+}
+
+bool ObjectCache::Grow() {
+	// Called with the depot locked
+	if (slabs == slabIndexSize) {
+		uint64_t size = slabIndexSize == 0 ? 16 : slabIndexSize * 2;
+		ObjectSlab **index = (ObjectSlab**)Malloc(sizeof(ObjectSlab*) * size);
+		if (index == NULL) return false;
+
+		if (slabIndex != NULL) {
+			memcpy(index, slabIndex, sizeof(ObjectSlab*) * slabs);
+			::Free(slabIndex);
+		}
+
+		slabIndex = index;
+		slabIndexSize = size;
+	}
+
+	uint8_t *base = slabPages == 1 ? (uint8_t*)PMM::RequestPage() : (uint8_t*)PMM::RequestPages(slabPages);
+	if (base == NULL) return false;
+
+	ObjectSlab *slab = (ObjectSlab*)(base + slabPages * VFS_PAGE_SIZE - sizeof(ObjectSlab));
+	slab->base = base;
+	slab->freeList = NULL;
+	slab->freeCount = slabObjects;
+
+	for (uint64_t i = slabObjects; i > 0; i--) {
+		void **object = (void**)(base + (i - 1) * objectSize);
+		*object = slab->freeList;
+		slab->freeList = object;
+	}
+
+	// Kept sorted, slabs come and go far less often than objects
+	uint64_t position = slabs;
+	while (position > 0 && slabIndex[position - 1]->base > base) {
+		slabIndex[position] = slabIndex[position - 1];
+		position--;
+	}
+
+	slabIndex[position] = slab;
+
+	DepotPushBack(&depot, &depotTail, slab);
+	depotCount += slabObjects;
+	objects += slabObjects;
+	emptySlabs++;
+	slabs++;
+
+	return true;
+}
+
+ObjectSlab *ObjectCache::FindSlab(void *object) {
+	// The last slab that starts at or before the object
+	uint64_t low = 0;
+	uint64_t high = slabs;
+
+	while (high - low > 1) {
+		uint64_t middle = (low + high) / 2;
+		if (slabIndex[middle]->base <= (uint8_t*)object) low = middle;
+		else high = middle;
+	}
+
+	return slabIndex[low];
+}
+
+void *ObjectCache::TakeObject() {
+	// Called with the depot locked
+	if (depot == NULL && !Grow()) return NULL;
+
+	ObjectSlab *slab = depot;
+	if (slab->freeCount == slabObjects) emptySlabs--;
+
+	void **object = (void**)slab->freeList;
+	slab->freeList = *object;
+	slab->freeCount--;
+	depotCount--;
+
+	if (slab->freeCount == 0) DepotRemove(&depot, &depotTail, slab);
+
+	return object;
+}
+
+void ObjectCache::GiveObject(void *object) {
+	// Called with the depot locked
+	ObjectSlab *slab = FindSlab(object);
+
+	*(void**)object = slab->freeList;
+	slab->freeList = object;
+	slab->freeCount++;
+	depotCount++;
+
+	// Back in the depot, where it's one of the first picks until it's empty
+	if (slab->freeCount == 1) DepotPushFront(&depot, &depotTail, slab);
+	if (slab->freeCount < slabObjects) return;
+
+	// Empty, it goes at the back, and back to the PMM if we have enough of those already
+	DepotRemove(&depot, &depotTail, slab);
+	DepotPushBack(&depot, &depotTail, slab);
+	emptySlabs++;
+
+	if (emptySlabs > OBJCACHE_SPARE_SLABS) ReleaseSlab(slab);
+}
+
+void ObjectCache::ReleaseSlab(ObjectSlab *slab) {
+	// Called with the depot locked, on an empty slab
+	DepotRemove(&depot, &depotTail, slab);
+
+	uint64_t position = 0;
+	while (slabIndex[position] != slab) position++;
+	memmove(&slabIndex[position], &slabIndex[position + 1], sizeof(ObjectSlab*) * (slabs - position - 1));
+
+	depotCount -= slabObjects;
+	objects -= slabObjects;
+	emptySlabs--;
+	slabs--;
+	reclaimed++;
+
+	if (slabPages == 1) PMM::FreePage(slab->base);
+	else PMM::FreePages(slab->base, slabPages);
+}
+
+void *ObjectCache::Alloc() {
+	ObjectMagazine *magazine = GetMagazine();
+	magazine->lock.Lock();
+
+	if (magazine->count == 0) {
+		// Refill half of the magazine, so the next frees have room too
+		depotLock.Lock();
+
+		while (magazine->count < OBJCACHE_MAGAZINE_SIZE / 2) {
+			void *object = TakeObject();
+			if (object == NULL) break;
+
+			magazine->objects[magazine->count++] = object;
+		}
+
+		depotLock.Unlock();
+
+		if (magazine->count == 0) {
+			magazine->lock.Unlock();
+			return NULL;
+		}
+	}
+
+	void *object = magazine->objects[--magazine->count];
+	magazine->lock.Unlock();
+
+	__atomic_add_fetch(&inUse, 1, __ATOMIC_RELAXED);
+	return object;
+}
+
+void ObjectCache::Free(void *object) {
+	if (object == NULL) return;
+
+	ObjectMagazine *magazine = GetMagazine();
+	magazine->lock.Lock();
+
+	if (magazine->count == OBJCACHE_MAGAZINE_SIZE) {
+		// Give half of the magazine back to the depot
+		depotLock.Lock();
+
+		while (magazine->count > OBJCACHE_MAGAZINE_SIZE / 2) {
+			GiveObject(magazine->objects[--magazine->count]);
+		}
+
+		depotLock.Unlock();
+	}
+
+	magazine->objects[magazine->count++] = object;
+	magazine->lock.Unlock();
+
+	__atomic_sub_fetch(&inUse, 1, __ATOMIC_RELAXED);
+}
+
+void ObjectCache::GetStats(ObjectCacheStats *stats) {
+	stats->name = name;
+	stats->objectSize = objectSize;
+	stats->inMagazines = 0;
+
+	for (int i = 0; i < OBJCACHE_MAGAZINES; i++) {
+		stats->inMagazines += __atomic_load_n(&magazines[i].count, __ATOMIC_RELAXED);
+	}
+
+	depotLock.Lock();
+	stats->slabs = slabs;
+	stats->objects = objects;
+	stats->inDepot = depotCount;
+	stats->reclaimed = reclaimed;
+	depotLock.Unlock();
+
+	stats->inUse = __atomic_load_n(&inUse, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,727 @@
+#include <fs/pagecache.hpp>
+#include <mm/memory.hpp>
+#include <mm/pmm.hpp>
+#include <mm/string.hpp>
+
+static CachedPage *frames;      // A descriptor for every page the cache can hold
+static uint64_t framesUsed;     // How many descriptors have a page behind them
+static uint64_t clockHand;      // The next descriptor the clock looks at
+static CachedPage **buckets;
+static PageCacheStats stats;
+
+static CachedPage *flushList[PAGECACHE_MAX_PAGES];
+static uint64_t flushPass;      // Counts the flushes, so that each goes through a file once
+
+static DirtyInode *dirtyInodes;                          // One per dirty page at most
+static DirtyInode *freeDirtyInodes;
+static DirtyInode *dirtyBuckets[PAGECACHE_DIRTY_BUCKETS];
+static DirtyInode *oldestDirty;
+static DirtyInode *newestDirty;
+
+// One lock for the whole cache, taken by every entry point below. It's dropped while the driver
+// reads or writes pages, those are pinned and flagged meanwhile. Writing back takes flushLock
+// first, one writeback at a time as they share flushList
+static SpinLock cacheLock;
+static SpinLock flushLock;
+
+namespace PageCache {
+static inline uint64_t BucketOf(FSDriver *driver, uint64_t inode, uint64_t index) {
+	uint64_t key = (inode * 0x9E3779B97F4A7C15) ^ (index * 0xC2B2AE3D27D4EB4F) ^ ((uint64_t)driver >> 4);
+	return (key ^ (key >> 29)) & (PAGECACHE_BUCKETS - 1);
+}
+
+static CachedPage *Find(FSDriver *driver, uint64_t inode, uint64_t index) {
+	CachedPage *page = buckets[BucketOf(driver, inode, index)];
+
+	while (page != NULL) {
+		if (page->index == index && page->inode == inode && page->driver == driver) return page;
+		page = page->hashNext;
+	}
+
+	return NULL;
+}
+
+static void Hash(CachedPage *page) {
+	uint64_t bucket = BucketOf(page->driver, page->inode, page->index);
+	page->hashNext = buckets[bucket];
+	buckets[bucket] = page;
+}
+
+static DirtyInode **FindDirty(FSDriver *driver, uint64_t inode) {
+	uint64_t key = (inode * 0x9E3779B97F4A7C15) ^ ((uint64_t)driver >> 4);
+	DirtyInode **link = &dirtyBuckets[(key ^ (key >> 32)) & (PAGECACHE_DIRTY_BUCKETS - 1)];
+
+	while (*link != NULL && ((*link)->inode != inode || (*link)->driver != driver)) link = &(*link)->hashNext;
+
+	return link;
+}
+
+static void MarkDirty(CachedPage *page) {
+	if (page->flags & CACHED_PAGE_DIRTY) {
+		// What is being written back isn't what the page holds anymore
+		if (page->flags & CACHED_PAGE_WRITEBACK) page->flags |= CACHED_PAGE_REDIRTIED;
+		return;
+	}
+
+	DirtyInode **link = FindDirty(page->driver, page->inode);
+	DirtyInode *dirty = *link;
+
+	if (dirty == NULL) {
+		dirty = freeDirtyInodes;
+		freeDirtyInodes = dirty->hashNext;
+
+		dirty->driver = page->driver;
+		dirty->inode = page->inode;
+		dirty->dirtyPages = 0;
+		dirty->dirtiedAt = ReadCycles();
+		dirty->dirtyList = NULL;
+		dirty->pass = flushPass;
+		dirty->hashNext = NULL;
+		*link = dirty;
+
+		// The newest file goes at the end of the age list
+		dirty->older = newestDirty;
+		dirty->newer = NULL;
+		if (newestDirty != NULL) newestDirty->newer = dirty;
+		else oldestDirty = dirty;
+		newestDirty = dirty;
+
+		stats.dirtyInodes++;
+	}
+
+	page->dirtyPrev = NULL;
+	page->dirtyNext = dirty->dirtyList;
+	if (dirty->dirtyList != NULL) dirty->dirtyList->dirtyPrev = page;
+	dirty->dirtyList = page;
+	dirty->dirtyPages++;
+
+	page->flags |= CACHED_PAGE_DIRTY;
+	stats.dirtyPages++;
+}
+
+static void ClearDirty(CachedPage *page) {
+	if (!(page->flags & CACHED_PAGE_DIRTY)) return;
+
+	DirtyInode **link = FindDirty(page->driver, page->inode);
+	DirtyInode *dirty = *link;
+
+	if (page->dirtyPrev != NULL) page->dirtyPrev->dirtyNext = page->dirtyNext;
+	else dirty->dirtyList = page->dirtyNext;
+	if (page->dirtyNext != NULL) page->dirtyNext->dirtyPrev = page->dirtyPrev;
+
+	page->flags &= ~CACHED_PAGE_DIRTY;
+	stats.dirtyPages--;
+
+	if (--dirty->dirtyPages > 0) return;
+
+	// The file is clean again
+	*link = dirty->hashNext;
+
+	if (dirty->older != NULL) dirty->older->newer = dirty->newer;
+	else oldestDirty = dirty->newer;
+	if (dirty->newer != NULL) dirty->newer->older = dirty->older;
+	else newestDirty = dirty->older;
+
+	dirty->hashNext = freeDirtyInodes;
+	freeDirtyInodes = dirty;
+	stats.dirtyInodes--;
+}
+
+static void Unhash(CachedPage *page) {
+	CachedPage **link = &buckets[BucketOf(page->driver, page->inode, page->index)];
+	while (*link != page) link = &(*link)->hashNext;
+	*link = page->hashNext;
+
+	ClearDirty(page);
+	page->flags = 0;
+
+	VFS::PutNode(page->node);
+	page->node = NULL;
+}
+
+static bool WriteRun(CachedPage **run, uint64_t count) {
+	// The pages are contiguous pieces of the same file, so they go out as one vectored write.
+	// They're pinned by FlushInode, the node is held here as they can be thrown away meanwhile
+	FSNode *node = VFS::RefNode(run[0]->node);
+	uint64_t position = run[0]->index << VFS_PAGE_SHIFT;
+	FSIOVec vectors[PAGECACHE_WRITEBACK_RUN];
+	uint64_t ends[PAGECACHE_WRITEBACK_RUN];
+	uint64_t vectorCount = 0;
+
+	for (uint64_t i = 0; i < count; i++) {
+		// The file might have been shrunk in the meantime, there's nothing left to write
+		uint64_t pagePosition = position + (i << VFS_PAGE_SHIFT);
+		if (pagePosition >= node->size) {
+			ClearDirty(run[i]);
+			continue;
+		}
+
+		size_t length = node->size - pagePosition;
+		if (length > VFS_PAGE_SIZE) length = VFS_PAGE_SIZE;
+
+		vectors[vectorCount].buffer = run[i]->data;
+		vectors[vectorCount].length = length;
+		ends[vectorCount] = (i << VFS_PAGE_SHIFT) + length;
+		vectorCount++;
+	}
+
+	if (vectorCount == 0) {
+		VFS::PutNode(node);
+		return true;
+	}
+
+	cacheLock.Unlock();
+
+	// The pages past the end are all at the end of the run, the others line up with their vectors
+	FILE file = {};
+	file.node = node;
+	uint64_t written = node->driver->FSWriteFileV(&file, position, vectors, vectorCount);
+
+	cacheLock.Lock();
+
+	// Only what the driver took is clean, the rest stays dirty for the next try.
+	// So do pages written again meanwhile, and those thrown away have nothing left to clean
+	bool result = true;
+	for (uint64_t i = 0; i < vectorCount; i++) {
+		if (written < ends[i]) {
+			stats.writeErrors += vectorCount - i;
+			result = false;
+			break;
+		}
+
+		if ((run[i]->flags & (CACHED_PAGE_VALID | CACHED_PAGE_REDIRTIED)) == CACHED_PAGE_VALID) ClearDirty(run[i]);
+		stats.writebacks++;
+	}
+
+	VFS::PutNode(node);
+	return result;
+}
+
+static bool FlushInode(DirtyInode *dirty, uint64_t limit) {
+	// Called with flushLock and cacheLock taken, the second is dropped while the driver writes:
+	// dirty can be gone after this, and so can any other file. At most limit pages are written
+	uint64_t count = 0;
+	bool written = true;
+
+	for (CachedPage *page = dirty->dirtyList; page != NULL && count < limit; page = page->dirtyNext) {
+		// Keep the batch sorted by offset, so the driver sees sequential writes
+		uint64_t j = count++;
+		while (j > 0 && flushList[j - 1]->index > page->index) {
+			flushList[j] = flushList[j - 1];
+			j--;
+		}
+
+		flushList[j] = page;
+	}
+
+	for (uint64_t i = 0; i < count; i++) {
+		flushList[i]->pins++;
+		flushList[i]->flags = (flushList[i]->flags | CACHED_PAGE_WRITEBACK) & ~CACHED_PAGE_REDIRTIED;
+	}
+
+	for (uint64_t i = 0; i < count; ) {
+		uint64_t run = 1;
+		while (i + run < count && run < PAGECACHE_WRITEBACK_RUN &&
+		       flushList[i + run]->index == flushList[i]->index + run) run++;
+
+		if (!WriteRun(&flushList[i], run)) written = false;
+		i += run;
+	}
+
+	for (uint64_t i = 0; i < count; i++) {
+		flushList[i]->pins--;
+		flushList[i]->flags &= ~(CACHED_PAGE_WRITEBACK | CACHED_PAGE_REDIRTIED);
+	}
+
+	stats.flushes++;
+	return written;
+}
+
+static DirtyInode *NextToFlush(FSDriver *driver) {
+	// The age list changes while a flush has cacheLock dropped, so every file
+	// is looked for from the oldest. The ones this flush went through already are skipped
+	for (DirtyInode *dirty = oldestDirty; dirty != NULL; dirty = dirty->newer) {
+		if (dirty->pass != flushPass && (driver == NULL || dirty->driver == driver)) return dirty;
+	}
+
+	return NULL;
+}
+
+static bool FlushMatching(FSDriver *driver, uint64_t inode, bool wholeDriver) {
+	// Called with flushLock and cacheLock taken
+	if (!wholeDriver) {
+		DirtyInode *dirty = *FindDirty(driver, inode);
+		return dirty == NULL || FlushInode(dirty, PAGECACHE_MAX_PAGES);
+	}
+
+	// A single pass: files that fail stay where they are, and aren't tried again until the next flush
+	bool written = true;
+	flushPass++;
+
+	DirtyInode *dirty;
+	while ((dirty = NextToFlush(driver)) != NULL) {
+		dirty->pass = flushPass;
+		if (!FlushInode(dirty, PAGECACHE_MAX_PAGES)) written = false;
+	}
+
+	return written;
+}
+
+static void LockFlush() {
+	// Called with cacheLock taken, flushLock has to come first
+	cacheLock.Unlock();
+	flushLock.Lock();
+	cacheLock.Lock();
+}
+
+static CachedPage *AllocPage() {
+	for (uint64_t i = 0; i < framesUsed; i++) {
+		if (!(frames[i].flags & CACHED_PAGE_VALID) && frames[i].pins == 0) return &frames[i];
+	}
+
+	if (framesUsed < PAGECACHE_MAX_PAGES) {
+		uint8_t *data = (uint8_t*)PMM::RequestPage();
+
+		if (data != NULL) {
+			CachedPage *page = &frames[framesUsed++];
+			page->data = data;
+			page->flags = 0;
+			page->pins = 0;
+			stats.pages++;
+			return page;
+		}
+	}
+
+	if (framesUsed == 0) return NULL;
+
+	// CLOCK: give referenced pages a second chance, take the first one that isn't.
+	// Two full turns without a victim means everything is pinned or dirty
+	for (uint64_t turn = 0; turn < framesUsed * 2; turn++) {
+		CachedPage *page = &frames[clockHand];
+		clockHand = (clockHand + 1) % framesUsed;
+
+		if (page->pins != 0) continue;
+
+		if (page->flags & CACHED_PAGE_REFERENCED) {
+			page->flags &= ~CACHED_PAGE_REFERENCED;
+			continue;
+		}
+
+		// Writing it back needs flushLock, which can't be taken here. GetPage does it if nothing else is left
+		if (page->flags & CACHED_PAGE_DIRTY) continue;
+
+		Unhash(page);
+		stats.evictions++;
+		return page;
+	}
+
+	return NULL;
+}
+
+static inline uint64_t ExpectedLength(FSNode *node, uint64_t index) {
+	// How much of the page is inside the file, what a fill has to read
+	uint64_t position = index << VFS_PAGE_SHIFT;
+	if (position >= node->size) return 0;
+
+	return node->size - position < VFS_PAGE_SIZE ? node->size - position : VFS_PAGE_SIZE;
+}
+
+static CachedPage *GetPage(FSNode *node, uint64_t index, bool fill) {
+	// Called with cacheLock taken, it's dropped while the driver fills the page
+	CachedPage *page;
+	bool flushed = false;
+
+	while (true) {
+		page = Find(node->driver, node->inode, index);
+
+		if (page != NULL) {
+			// Somebody else is reading it in, the data comes with the flag going away
+			if (page->flags & CACHED_PAGE_FILLING) {
+				cacheLock.Unlock();
+				CPURelax();
+				cacheLock.Lock();
+				continue;
+			}
+
+			page->flags |= CACHED_PAGE_REFERENCED;
+			stats.hits++;
+			return page;
+		}
+
+		page = AllocPage();
+		if (page != NULL) break;
+
+		// Everything left is dirty or pinned. Writing the oldest file back can free some pages, once
+		if (flushed || oldestDirty == NULL) return NULL;
+		flushed = true;
+
+		LockFlush();
+		if (oldestDirty != NULL) FlushInode(oldestDirty, PAGECACHE_MAX_PAGES);
+		flushLock.Unlock();
+	}
+
+	stats.misses++;
+
+	page->driver = node->driver;
+	page->inode = node->inode;
+	page->index = index;
+	page->node = VFS::RefNode(node);
+	page->flags = CACHED_PAGE_VALID | CACHED_PAGE_REFERENCED;
+	Hash(page);
+
+	if (!fill) {
+		memset(page->data, 0, VFS_PAGE_SIZE);
+		return page;
+	}
+
+	// The others wait for the data, and the page can't be taken back while it comes in
+	page->flags |= CACHED_PAGE_FILLING;
+	page->pins++;
+	uint64_t expected = ExpectedLength(node, index);
+
+	cacheLock.Unlock();
+
+	FILE file = {};
+	file.node = node;
+
+	// FSReadFile writes at buffer + offset
+	uint64_t position = index << VFS_PAGE_SHIFT;
+	uint8_t *buffer = page->data - position;
+	size_t length = node->driver->FSReadFile(&file, position, VFS_PAGE_SIZE, &buffer);
+	if (length > VFS_PAGE_SIZE) length = 0;
+	memset(page->data + length, 0, VFS_PAGE_SIZE - length);
+
+	cacheLock.Lock();
+	page->pins--;
+
+	// Thrown away while it was coming in (es: the file was deleted), what was read may be stale
+	if (!(page->flags & CACHED_PAGE_FILLING)) return NULL;
+	page->flags &= ~CACHED_PAGE_FILLING;
+
+	// Short of what the file has there: a read error, not zeroes. Cached as valid,
+	// the zeroes would be served from now on and even written back over the data
+	if (length < expected) {
+		Unhash(page);
+		stats.readErrors++;
+		return NULL;
+	}
+
+	return page;
+}
+
+void Init() {
+	cacheLock.locked = 0;
+	flushLock.locked = 0;
+	flushPass = 0;
+
+	frames = (CachedPage*)Malloc(sizeof(CachedPage) * PAGECACHE_MAX_PAGES);
+	memset(frames, 0, sizeof(CachedPage) * PAGECACHE_MAX_PAGES);
+
+	buckets = (CachedPage**)Malloc(sizeof(CachedPage*) * PAGECACHE_BUCKETS);
+	for (int i = 0; i < PAGECACHE_BUCKETS; i++) {
+		buckets[i] = NULL;
+	}
+
+	// There can't be more dirty files than pages
+	dirtyInodes = (DirtyInode*)Malloc(sizeof(DirtyInode) * PAGECACHE_MAX_PAGES);
+	freeDirtyInodes = NULL;
+	for (int i = 0; i < PAGECACHE_MAX_PAGES; i++) {
+		dirtyInodes[i].hashNext = freeDirtyInodes;
+		freeDirtyInodes = &dirtyInodes[i];
+	}
+
+	for (int i = 0; i < PAGECACHE_DIRTY_BUCKETS; i++) {
+		dirtyBuckets[i] = NULL;
+	}
+
+	oldestDirty = newestDirty = NULL;
+
+	framesUsed = clockHand = 0;
+	memset(&stats, 0, sizeof(PageCacheStats));
+}
+
+uint64_t Read(FILE *file, uint64_t offset, size_t size, uint8_t *buffer) {
+	FSNode *node = file->node;
+
+	cacheLock.Lock();
+
+	if (offset >= node->size) size = 0;
+	else if (offset + size > node->size) size = node->size - offset;
+
+	size_t done = 0;
+	while (done < size) {
+		uint64_t position = offset + done;
+		uint64_t pageOffset = position & (VFS_PAGE_SIZE - 1);
+		size_t chunk = VFS_PAGE_SIZE - pageOffset;
+		if (chunk > size - done) chunk = size - done;
+
+		CachedPage *page = GetPage(node, position >> VFS_PAGE_SHIFT, true);
+		if (page == NULL) break;
+
+		if (page->flags & CACHED_PAGE_PREFETCHED) {
+			page->flags &= ~CACHED_PAGE_PREFETCHED;
+			stats.prefetchHits++;
+			file->readahead.hits++;
+		}
+
+		memcpy(buffer + done, page->data + pageOffset, chunk);
+		done += chunk;
+	}
+
+	cacheLock.Unlock();
+	return done;
+}
+
+uint64_t Write(FILE *file, uint64_t offset, size_t size, uint8_t *buffer) {
+	FSNode *node = file->node;
+
+	cacheLock.Lock();
+
+	size_t done = 0;
+	while (done < size) {
+		uint64_t position = offset + done;
+		uint64_t pageOffset = position & (VFS_PAGE_SIZE - 1);
+		size_t chunk = VFS_PAGE_SIZE - pageOffset;
+		if (chunk > size - done) chunk = size - done;
+
+		// No need to read what we are about to overwrite entirely
+		bool fill = chunk != VFS_PAGE_SIZE && position - pageOffset < node->size;
+
+		CachedPage *page = GetPage(node, position >> VFS_PAGE_SHIFT, fill);
+		if (page == NULL) break;
+
+		memcpy(page->data + pageOffset, buffer + done, chunk);
+		MarkDirty(page);
+
+		done += chunk;
+		if (offset + done > node->size) node->size = offset + done;
+	}
+
+	// The data stays in memory for the flusher, unless there's too much of it already
+	if (stats.dirtyPages >= PAGECACHE_DIRTY_LIMIT) {
+		LockFlush();
+		flushPass++;
+
+		DirtyInode *dirty;
+		while (stats.dirtyPages >= PAGECACHE_DIRTY_LIMIT && (dirty = NextToFlush(NULL)) != NULL) {
+			dirty->pass = flushPass;
+			FlushInode(dirty, PAGECACHE_MAX_PAGES);
+			stats.throttled++;
+		}
+
+		flushLock.Unlock();
+	}
+
+	file->bufferPos = offset + done;
+
+	cacheLock.Unlock();
+	return offset + done;
+}
+
+uint64_t Prefetch(FSNode *node, uint64_t index, uint64_t count) {
+	cacheLock.Lock();
+
+	uint64_t filePages = (node->size + VFS_PAGE_SIZE - 1) >> VFS_PAGE_SHIFT;
+	if (index >= filePages) count = 0;
+	else if (count > filePages - index) count = filePages - index;
+
+	uint64_t done = 0;
+	uint64_t i = 0;
+
+	while (i < count) {
+		if (Find(node->driver, node->inode, index + i) != NULL) {
+			i++;
+			continue;
+		}
+
+		// Every run of missing pages is read with a single vectored request
+		CachedPage *run[PAGECACHE_PREFETCH_RUN];
+		FSIOVec vectors[PAGECACHE_PREFETCH_RUN];
+		uint64_t runStart = index + i;
+		uint64_t runLength = 0;
+		bool outOfPages = false;
+
+		while (i < count && runLength < PAGECACHE_PREFETCH_RUN && Find(node->driver, node->inode, index + i) == NULL) {
+			CachedPage *page = AllocPage();
+			if (page == NULL) {
+				outOfPages = true;
+				break;
+			}
+
+			// Referenced, so the clock doesn't take them before the reader gets there.
+			// Pinned until they are filled, so the next AllocPage doesn't take them back
+			page->driver = node->driver;
+			page->inode = node->inode;
+			page->index = index + i;
+			page->node = VFS::RefNode(node);
+			page->flags = CACHED_PAGE_VALID | CACHED_PAGE_REFERENCED | CACHED_PAGE_PREFETCHED | CACHED_PAGE_FILLING;
+			page->pins++;
+			Hash(page);
+
+			run[runLength] = page;
+			vectors[runLength].buffer = page->data;
+			vectors[runLength].length = VFS_PAGE_SIZE;
+			runLength++;
+			i++;
+		}
+
+		if (runLength > 0) {
+			uint64_t lengths[PAGECACHE_PREFETCH_RUN];
+			uint64_t expected[PAGECACHE_PREFETCH_RUN];
+			for (uint64_t j = 0; j < runLength; j++) expected[j] = ExpectedLength(node, runStart + j);
+
+			cacheLock.Unlock();
+
+			FILE file = {};
+			file.node = node;
+			uint64_t read = node->driver->FSReadFileV(&file, runStart << VFS_PAGE_SHIFT, vectors, runLength);
+			if (read > runLength << VFS_PAGE_SHIFT) read = 0;
+
+			for (uint64_t j = 0; j < runLength; j++) {
+				uint64_t pageStart = j << VFS_PAGE_SHIFT;
+				lengths[j] = read > pageStart ? read - pageStart : 0;
+				if (lengths[j] > VFS_PAGE_SIZE) lengths[j] = VFS_PAGE_SIZE;
+				memset(run[j]->data + lengths[j], 0, VFS_PAGE_SIZE - lengths[j]);
+			}
+
+			cacheLock.Lock();
+
+			for (uint64_t j = 0; j < runLength; j++) {
+				run[j]->pins--;
+
+				// Thrown away while it was coming in
+				if (!(run[j]->flags & CACHED_PAGE_FILLING)) continue;
+				run[j]->flags &= ~CACHED_PAGE_FILLING;
+
+				// What the driver didn't read isn't cached, the reader asks for it again
+				if (lengths[j] < expected[j]) {
+					Unhash(run[j]);
+					stats.readErrors++;
+					continue;
+				}
+
+				stats.prefetched++;
+				done++;
+			}
+		}
+
+		if (outOfPages) break;
+	}
+
+	cacheLock.Unlock();
+	return done;
+}
+
+CachedPage *Pin(FSNode *node, uint64_t index) {
+	cacheLock.Lock();
+
+	CachedPage *page = GetPage(node, index, true);
+	if (page != NULL) page->pins++;
+
+	cacheLock.Unlock();
+	return page;
+}
+
+void Unpin(CachedPage *page) {
+	cacheLock.Lock();
+	if (page->pins > 0) page->pins--;
+	cacheLock.Unlock();
+}
+
+void SetDirty(CachedPage *page) {
+	// For pages written behind the cache's back, es: through a shared mapping
+	cacheLock.Lock();
+	MarkDirty(page);
+	cacheLock.Unlock();
+}
+
+uint64_t FlushNode(FSNode *node) {
+	flushLock.Lock();
+	cacheLock.Lock();
+	bool written = FlushMatching(node->driver, node->inode, false);
+	cacheLock.Unlock();
+	flushLock.Unlock();
+
+	return written ? 0 : 1;
+}
+
+uint64_t FlushDriver(FSDriver *driver) {
+	flushLock.Lock();
+	cacheLock.Lock();
+	bool written = FlushMatching(driver, 0, true);
+	cacheLock.Unlock();
+	flushLock.Unlock();
+
+	return written ? 0 : 1;
+}
+
+uint64_t FlushAll() {
+	flushLock.Lock();
+	cacheLock.Lock();
+	bool written = FlushMatching(NULL, 0, true);
+	cacheLock.Unlock();
+	flushLock.Unlock();
+
+	return written ? 0 : 1;
+}
+
+uint64_t FlusherTick(uint64_t now, uint64_t budget) {
+	// Somebody is writing back already, this tick has nothing to add
+	if (!flushLock.TryLock()) return 0;
+	cacheLock.Lock();
+
+	// Oldest first: expired data, then whatever it takes to get under the background threshold.
+	// Files the driver refuses stay dirty and are skipped until the next tick, and so is
+	// what's left of a file once the budget runs out: it's still the oldest next time
+	flushPass++;
+
+	uint64_t pages = 0;
+	DirtyInode *dirty;
+	while (pages < budget && (dirty = NextToFlush(NULL)) != NULL) {
+		// Other CPUs' cycle counters can be a little behind, their data isn't old
+		if (now > dirty->dirtiedAt && now - dirty->dirtiedAt >= PAGECACHE_DIRTY_EXPIRE) stats.expired++;
+		else if (stats.dirtyPages <= PAGECACHE_DIRTY_BACKGROUND) break;
+
+		uint64_t limit = budget - pages;
+		if (limit > dirty->dirtyPages) limit = dirty->dirtyPages;
+		pages += limit;
+
+		dirty->pass = flushPass;
+		FlushInode(dirty, limit);
+	}
+
+	cacheLock.Unlock();
+	flushLock.Unlock();
+	return pages;
+}
+
+void InvalidateNode(FSNode *node) {
+	cacheLock.Lock();
+
+	for (uint64_t i = 0; i < framesUsed; i++) {
+		CachedPage *page = &frames[i];
+		if (!(page->flags & CACHED_PAGE_VALID)) continue;
+		if (page->driver == node->driver && page->inode == node->inode) Unhash(page);
+	}
+
+	cacheLock.Unlock();
+}
+
+void InvalidateDriver(FSDriver *driver) {
+	cacheLock.Lock();
+
+	for (uint64_t i = 0; i < framesUsed; i++) {
+		CachedPage *page = &frames[i];
+		if (!(page->flags & CACHED_PAGE_VALID)) continue;
+		if (page->driver == driver) Unhash(page);
+	}
+
+	cacheLock.Unlock();
+}
+
+void GetStats(PageCacheStats *result) {
+	cacheLock.Lock();
+	memcpy(result, &stats, sizeof(PageCacheStats));
+	cacheLock.Unlock();
+}
+}
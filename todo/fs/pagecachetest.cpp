@@ -0,0 +1,281 @@
+#include <fs/pagecachetest.hpp>
+#include <fs/pagecache.hpp>
+#include <sys/printk.hpp>
+#include <mm/pmm.hpp>
+#include <mm/string.hpp>
+
+static inline uint8_t Pattern(uint64_t offset, uint8_t seed) {
+	return (uint8_t)(offset * 7 + seed);
+}
+
+void PageCacheTestDriver::FSInit(FSNode *mountpoint) {
+	// The disk is slow as far as the VFS knows
+	driverFlags = FS_DRIVER_PAGECACHE;
+	reads = writes = failReads = failWrites = 0;
+
+	for (uint64_t i = 0; i < PAGECACHE_TEST_PAGES; i++) {
+		disk[i] = (uint8_t*)PMM::RequestPage();
+		if (disk[i] == NULL) continue;
+
+		for (uint64_t j = 0; j < VFS_PAGE_SIZE; j++) disk[i][j] = Pattern((i << VFS_PAGE_SHIFT) + j, 0);
+	}
+
+	FSNameKey key;
+
+	rootNode = VFS::AllocNode();
+	if (mountpoint != NULL) rootNode->name.Copy(&mountpoint->name);
+	else {
+		VFS::MakeNameKey(&key, "pagecachetest", 13);
+		rootNode->name.Set(&key);
+	}
+	rootNode->driver = this;
+	rootNode->mask = rootNode->uid = rootNode->gid = rootNode->size = rootNode->impl = 0;
+	rootNode->flags = VFS_NODE_DIRECTORY;
+	rootNode->inode = PAGECACHE_TEST_ROOT;
+
+	diskNode = VFS::AllocNode();
+	VFS::MakeNameKey(&key, "disk", 4);
+	diskNode->name.Set(&key);
+	diskNode->driver = this;
+	VFS::SetParent(diskNode, rootNode);
+	diskNode->mask = 0644;
+	diskNode->uid = diskNode->gid = diskNode->impl = 0;
+	diskNode->size = PAGECACHE_TEST_PAGES * VFS_PAGE_SIZE;
+	diskNode->flags = VFS_NODE_FILE;
+	diskNode->inode = PAGECACHE_TEST_DISK;
+}
+
+void PageCacheTestDriver::FSDelete() {
+	// Nothing of the disk may stay in the cache, another driver could get this address
+	PageCache::InvalidateDriver(this);
+
+	for (uint64_t i = 0; i < PAGECACHE_TEST_PAGES; i++) {
+		if (disk[i] != NULL) PMM::FreePage(disk[i]);
+		disk[i] = NULL;
+	}
+
+	if (diskNode != NULL) VFS::ReleaseNode(diskNode);
+	diskNode = NULL;
+
+	if (rootNode != NULL) VFS::ReleaseNode(rootNode);
+	rootNode = NULL;
+}
+
+uint64_t PageCacheTestDriver::Transfer(uint64_t offset, const FSIOVec *vectors, size_t count, bool write) {
+	// One request, however many vectors it has, like a DMA transfer would be
+	uint64_t *fail = write ? &failWrites : &failReads;
+	__atomic_add_fetch(write ? &writes : &reads, 1, __ATOMIC_RELAXED);
+
+	if (__atomic_load_n(fail, __ATOMIC_RELAXED) > 0) {
+		__atomic_sub_fetch(fail, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	uint64_t done = 0;
+	for (size_t i = 0; i < count; i++) {
+		for (size_t j = 0; j < vectors[i].length; ) {
+			uint64_t position = offset + done;
+			uint64_t page = position >> VFS_PAGE_SHIFT;
+			if (page >= PAGECACHE_TEST_PAGES || disk[page] == NULL) return done;
+
+			uint64_t pageOffset = position & (VFS_PAGE_SIZE - 1);
+			size_t chunk = VFS_PAGE_SIZE - pageOffset;
+			if (chunk > vectors[i].length - j) chunk = vectors[i].length - j;
+
+			if (write) memcpy(disk[page] + pageOffset, vectors[i].buffer + j, chunk);
+			else memcpy(vectors[i].buffer + j, disk[page] + pageOffset, chunk);
+
+			j += chunk;
+			done += chunk;
+		}
+	}
+
+	return done;
+}
+
+uint64_t PageCacheTestDriver::FSReadFile(FILE *file, uint64_t offset, size_t size, uint8_t **buffer) {
+	FSIOVec vector;
+	vector.buffer = *buffer + offset;
+	vector.length = size;
+
+	return FSReadFileV(file, offset, &vector, 1);
+}
+
+uint64_t PageCacheTestDriver::FSWriteFile(FILE *file, uint64_t offset, size_t size, uint8_t *buffer) {
+	FSIOVec vector;
+	vector.buffer = buffer;
+	vector.length = size;
+
+	return offset + FSWriteFileV(file, offset, &vector, 1);
+}
+
+uint64_t PageCacheTestDriver::FSReadFileV(FILE *file, uint64_t offset, const FSIOVec *vectors, size_t count) {
+	if (file->node != diskNode) return 0;
+	return Transfer(offset, vectors, count, false);
+}
+
+uint64_t PageCacheTestDriver::FSWriteFileV(FILE *file, uint64_t offset, const FSIOVec *vectors, size_t count) {
+	if (file->node != diskNode) return 0;
+	return Transfer(offset, vectors, count, true);
+}
+
+FILE *PageCacheTestDriver::FSOpenFile(FSNode *node, uint64_t descriptor) {
+	if (node != diskNode) return NULL;
+
+	FILE *file = VFS::AllocFile();
+	if (file == NULL) return NULL;
+
+	file->node = node;
+	file->buffer = NULL;
+	file->descriptor = descriptor;
+	file->bufferSize = file->bufferPos = 0;
+	file->impl = 0;
+
+	return file;
+}
+
+void PageCacheTestDriver::FSCloseFile(FILE *file) {
+	VFS::FreeFile(file);
+}
+
+uint64_t PageCacheTestDriver::FSDeleteFile(FSNode *node) {
+	return 1;
+}
+
+FSNode *PageCacheTestDriver::FSMakeFile(FSNode *node, const char *name, uint64_t uid, uint64_t gid, uint64_t mask) {
+	return NULL;
+}
+
+FSNode *PageCacheTestDriver::FSMakeDir(FSNode *node, const char *name, uint64_t uid, uint64_t gid, uint64_t mask) {
+	return NULL;
+}
+
+uint64_t PageCacheTestDriver::FSDeleteDir(FSNode *node) {
+	return 1;
+}
+
+FSNode *PageCacheTestDriver::FSReadDir(FSNode *node, uint64_t index) {
+	if (node->inode != PAGECACHE_TEST_ROOT || index != 0) return NULL;
+
+	// Remember to give this back with VFS::PutNode!
+	return VFS::RefNode(diskNode);
+}
+
+FSNode *PageCacheTestDriver::FSFindDir(FSNode *node, const FSNameKey *key) {
+	if (node->inode != PAGECACHE_TEST_ROOT || !diskNode->name.Equals(key)) return NULL;
+
+	return VFS::RefNode(diskNode);
+}
+
+uint64_t PageCacheTestDriver::FSIterateDir(FSNode *node, uint64_t *cursor, VFSDirEntry *buffer, size_t bufferSize) {
+	uint64_t used = 0;
+
+	if (node->inode == PAGECACHE_TEST_ROOT && *cursor == VFS_DIR_CURSOR_START &&
+	    VFS::PutDirEntry(buffer, bufferSize, &used, diskNode->inode, diskNode->flags, diskNode->name.Get(), diskNode->name.length) == NULL) return 0;
+
+	*cursor = VFS_DIR_CURSOR_END;
+	return used;
+}
+
+uint64_t PageCacheTestDriver::FSGetDirElements(FSNode *node) {
+	return node->inode == PAGECACHE_TEST_ROOT ? 1 : 0;
+}
+
+static bool Check(const char *name, bool passed) {
+	if (!passed) PRINTK::PrintK("Page cache test: %s failed.\r\n", name);
+	return passed;
+}
+
+static bool DiskHolds(PageCacheTestDriver *driver, uint64_t firstPage, uint64_t pages, uint8_t seed) {
+	for (uint64_t i = firstPage; i < firstPage + pages; i++) {
+		for (uint64_t j = 0; j < VFS_PAGE_SIZE; j++) {
+			if (driver->disk[i][j] != Pattern((i << VFS_PAGE_SHIFT) + j, seed)) return false;
+		}
+	}
+
+	return true;
+}
+
+static bool ReadPages(FILE *file, uint8_t *page, uint64_t firstPage, uint64_t pages, uint8_t seed) {
+	// A page at a time and in order, like a reader that knows nothing of readahead
+	for (uint64_t i = firstPage; i < firstPage + pages; i++) {
+		uint64_t offset = i << VFS_PAGE_SHIFT;
+		uint8_t *buffer = page - offset;
+		if (VFS::ReadFile(file, offset, VFS_PAGE_SIZE, &buffer) != VFS_PAGE_SIZE) return false;
+
+		for (uint64_t j = 0; j < VFS_PAGE_SIZE; j++) {
+			if (page[j] != Pattern(offset + j, seed)) return false;
+		}
+	}
+
+	return true;
+}
+
+static bool WritePages(FILE *file, uint8_t *page, uint64_t firstPage, uint64_t pages, uint8_t seed) {
+	for (uint64_t i = firstPage; i < firstPage + pages; i++) {
+		uint64_t offset = i << VFS_PAGE_SHIFT;
+		for (uint64_t j = 0; j < VFS_PAGE_SIZE; j++) page[j] = Pattern(offset + j, seed);
+
+		if (VFS::WriteFile(file, offset, VFS_PAGE_SIZE, page) != offset + VFS_PAGE_SIZE) return false;
+	}
+
+	return true;
+}
+
+namespace PageCacheTest {
+bool Run() {
+	PageCacheTestDriver *driver = new PageCacheTestDriver(NULL);
+	uint8_t *page = (uint8_t*)PMM::RequestPage();
+	FILE *file = driver->diskNode != NULL ? VFS::OpenFile(driver->diskNode) : NULL;
+
+	bool ready = page != NULL && file != NULL;
+	for (uint64_t i = 0; i < PAGECACHE_TEST_PAGES && ready; i++) ready = driver->disk[i] != NULL;
+
+	bool passed = Check("setup", ready);
+	PageCacheStats before, after;
+
+	if (ready) {
+		PageCache::GetStats(&before);
+		bool read = ReadPages(file, page, 0, PAGECACHE_TEST_PAGES, 0);
+		PageCache::GetStats(&after);
+		passed &= Check("read", read && driver->reads < PAGECACHE_TEST_PAGES / 2 && after.prefetched > before.prefetched);
+
+		// Readahead already has the whole disk
+		driver->reads = 0;
+		passed &= Check("cached", ReadPages(file, page, 0, PAGECACHE_TEST_PAGES, 0) && driver->reads == 0);
+
+		bool written = WritePages(file, page, 0, 16, 1);
+		bool deferred = driver->writes == 0 && DiskHolds(driver, 0, 16, 0);
+		bool synced = VFS::SyncFile(file) == 0 && DiskHolds(driver, 0, 16, 1);
+		passed &= Check("writeback", written && deferred && synced && driver->writes == 1);
+
+		// As if it had been written PAGECACHE_DIRTY_EXPIRE ago
+		written = WritePages(file, page, 20, 2, 2);
+		PageCache::FlusherTick(ReadCycles() + PAGECACHE_DIRTY_EXPIRE, PAGECACHE_MAX_PAGES);
+		passed &= Check("flusher", written && DiskHolds(driver, 20, 2, 2));
+
+		PageCache::InvalidateNode(driver->diskNode);
+		PageCache::GetStats(&before);
+		driver->failReads = PAGECACHE_TEST_PAGES;
+		uint8_t *buffer = page - (40 << VFS_PAGE_SHIFT);
+		bool failed = VFS::ReadFile(file, 40 << VFS_PAGE_SHIFT, VFS_PAGE_SIZE, &buffer) == 0;
+		PageCache::GetStats(&after);
+		driver->failReads = 0;
+		passed &= Check("read error", failed && after.readErrors > before.readErrors && ReadPages(file, page, 40, 1, 0));
+
+		written = WritePages(file, page, 30, 1, 3);
+		driver->failWrites = 1;
+		failed = VFS::SyncFile(file) != 0 && DiskHolds(driver, 30, 1, 0);
+		passed &= Check("write error", written && failed && VFS::SyncFile(file) == 0 && DiskHolds(driver, 30, 1, 3));
+	}
+
+	if (file != NULL) VFS::CloseFile(file);
+	if (page != NULL) PMM::FreePage(page);
+
+	driver->FSDelete();
+	delete driver;
+
+	if (passed) PRINTK::PrintK("The page cache test passed.\r\n");
+	return passed;
+}
+}
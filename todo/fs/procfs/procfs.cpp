@@ -0,0 +1,237 @@
+#include <fs/procfs/procfs.hpp>
+#include <fs/dcache.hpp>
+#include <mm/string.hpp>
+#include <mm/pmm.hpp>
+
+void ProcFSWriter::Put(const char *string) {
+	for (; *string != '\0'; string++) {
+		if (length < size) buffer[length] = *string;
+		length++;
+	}
+}
+
+void ProcFSWriter::PutNumber(uint64_t value) {
+	char digits[21];
+	int count = 0;
+
+	do {
+		digits[count++] = '0' + value % 10;
+		value /= 10;
+	} while (value != 0);
+
+	while (count > 0) {
+		if (length < size) buffer[length] = digits[--count];
+		else count--;
+		length++;
+	}
+}
+
+void ProcFSWriter::PutHex(uint64_t value) {
+	Put("0x");
+
+	int shift = 60;
+	while (shift > 0 && ((value >> shift) & 0xF) == 0) shift -= 4;
+
+	for (; shift >= 0; shift -= 4) {
+		if (length < size) buffer[length] = "0123456789abcdef"[(value >> shift) & 0xF];
+		length++;
+	}
+}
+
+void ProcFSWriter::PutField(const char *name, uint64_t value) {
+	Put(name);
+	Put(": ");
+	PutNumber(value);
+	Put("\n");
+}
+
+void ProcFSDriver::FSInit(FSNode *mountpoint) {
+	// Files are generated when they're opened, each open file has its own size
+	driverFlags = FS_DRIVER_SNAPSHOT;
+	registerLock.locked = 0;
+	entryCount = 0;
+
+	rootNode = VFS::AllocNode();
+	if (mountpoint != NULL) rootNode->name.Copy(&mountpoint->name);
+	else {
+		FSNameKey key;
+		VFS::MakeNameKey(&key, "procfs", 6);
+		rootNode->name.Set(&key);
+	}
+	rootNode->mask = rootNode->uid = rootNode->gid = rootNode->size = rootNode->impl = 0;
+	rootNode->flags = VFS_NODE_DIRECTORY;
+	rootNode->inode = PROCFS_ROOT_INODE;
+}
+
+void ProcFSDriver::FSDelete() {
+	for (uint64_t i = 0; i < entryCount; i++) {
+		VFS::ReleaseNode(entries[i].node);
+	}
+
+	entryCount = 0;
+
+	if(rootNode != NULL) VFS::ReleaseNode(rootNode);
+	rootNode = NULL;
+}
+
+ProcFSEntry *ProcFSDriver::GetEntry(uint64_t inode) {
+	if(inode == PROCFS_ROOT_INODE || inode > __atomic_load_n(&entryCount, __ATOMIC_ACQUIRE)) return NULL;
+
+	return &entries[inode - 1];
+}
+
+bool ProcFSDriver::Register(const char *name, ProcFSGenerator generator, void *context) {
+	if(name == NULL || generator == NULL) return false;
+
+	FSNameKey key;
+	VFS::MakeNameKey(&key, name, strlen(name));
+
+	registerLock.Lock();
+
+	bool taken = entryCount >= PROCFS_MAX_ENTRIES;
+	for (uint64_t i = 0; i < entryCount && !taken; i++) {
+		if(entries[i].node->name.Equals(&key)) taken = true;
+	}
+
+	FSNode *node = taken ? NULL : VFS::AllocNode();
+	if(node == NULL || !node->name.Set(&key)) {
+		if(node != NULL) VFS::ReleaseNode(node);
+		registerLock.Unlock();
+		return false;
+	}
+
+	node->driver = this;
+	VFS::SetParent(node, rootNode);
+	node->mask = 0444;
+	node->uid = node->gid = node->size = node->impl = 0;
+	node->flags = VFS_NODE_FILE;
+	node->inode = entryCount + 1;
+
+	entries[entryCount].node = node;
+	entries[entryCount].generator = generator;
+	entries[entryCount].context = context;
+	__atomic_store_n(&entryCount, entryCount + 1, __ATOMIC_RELEASE);
+
+	registerLock.Unlock();
+
+	// Someone could have looked for it before it existed
+	DCache::Invalidate(rootNode, &key);
+
+	return true;
+}
+
+FILE *ProcFSDriver::FSOpenFile(FSNode *node, uint64_t descriptor) {
+	ProcFSEntry *entry = GetEntry(node->inode);
+	if(entry == NULL) return NULL;
+
+	ProcFSWriter writer;
+	uint64_t pages = 1;
+
+	// Try with a page first, most files are short. If it didn't fit we know how much it takes
+	while (true) {
+		writer.buffer = (char*)PMM::RequestPages(pages);
+		if(writer.buffer == NULL) return NULL;
+
+		writer.size = pages * VFS_PAGE_SIZE;
+		writer.length = 0;
+		entry->generator(&writer, entry->context);
+		if(writer.length <= writer.size) break;
+
+		PMM::FreePages(writer.buffer, pages);
+		pages = (writer.length + VFS_PAGE_SIZE - 1) / VFS_PAGE_SIZE;
+	}
+
+	FILE *file = VFS::AllocFile();
+	if(file == NULL) {
+		PMM::FreePages(writer.buffer, pages);
+		return NULL;
+	}
+
+	file->node = node;
+	file->buffer = (uint64_t*)writer.buffer;
+	file->descriptor = descriptor;
+	file->bufferSize = writer.length;
+	file->bufferPos = 0;
+	file->impl = pages;
+
+	return file;
+}
+
+void ProcFSDriver::FSCloseFile(FILE *file) {
+	// The snapshot could have come out shorter than the pages it was written in
+	if(file->buffer != NULL) PMM::FreePages(file->buffer, file->impl);
+	VFS::FreeFile(file);
+}
+
+uint64_t ProcFSDriver::FSReadFile(FILE *file, uint64_t offset, size_t size, uint8_t **buffer) {
+	if(file->buffer == NULL) return 0;
+	if(offset >= file->bufferSize) return 0;
+
+	if(size > file->bufferSize - offset) size = file->bufferSize - offset;
+	memcpy(*buffer + offset, (uint8_t*)file->buffer + offset, size);
+
+	file->bufferPos = offset + size;
+	return size;
+}
+
+uint64_t ProcFSDriver::FSWriteFile(FILE *file, uint64_t offset, size_t size, uint8_t *buffer) {
+	// Everything here is generated
+	return 0;
+}
+
+uint64_t ProcFSDriver::FSDeleteFile(FSNode *node) {
+	return 1;
+}
+
+FSNode *ProcFSDriver::FSMakeFile(FSNode *node, const char *name, uint64_t uid, uint64_t gid, uint64_t mask) {
+	return NULL;
+}
+
+FSNode *ProcFSDriver::FSMakeDir(FSNode *node, const char *name, uint64_t uid, uint64_t gid, uint64_t mask) {
+	return NULL;
+}
+
+uint64_t ProcFSDriver::FSDeleteDir(FSNode *node) {
+	return 1;
+}
+
+FSNode *ProcFSDriver::FSReadDir(FSNode *node, uint64_t index) {
+	if(node->inode != PROCFS_ROOT_INODE) return NULL;
+	if(index >= entryCount) return NULL;
+
+	// Remember to give this back with VFS::PutNode!
+	return VFS::RefNode(entries[index].node);
+}
+
+FSNode *ProcFSDriver::FSFindDir(FSNode *node, const FSNameKey *key) {
+	if(node->inode != PROCFS_ROOT_INODE) return NULL;
+
+	for (uint64_t i = 0; i < entryCount; i++) {
+		if(entries[i].node->name.Equals(key)) return VFS::RefNode(entries[i].node);
+	}
+
+	return NULL;
+}
+
+uint64_t ProcFSDriver::FSIterateDir(FSNode *node, uint64_t *cursor, VFSDirEntry *buffer, size_t bufferSize) {
+	if(node->inode != PROCFS_ROOT_INODE) return 0;
+
+	// The cursor is just the index of the next entry
+	uint64_t index = *cursor;
+	uint64_t used = 0;
+
+	for (; index < entryCount; index++) {
+		FSNode *entry = entries[index].node;
+		if (VFS::PutDirEntry(buffer, bufferSize, &used, entry->inode, entry->flags, entry->name.Get(), entry->name.length) == NULL) break;
+	}
+
+	*cursor = index >= entryCount ? VFS_DIR_CURSOR_END : index;
+
+	return used;
+}
+
+uint64_t ProcFSDriver::FSGetDirElements(FSNode *node) {
+	if(node->inode != PROCFS_ROOT_INODE) return 0;
+
+	return entryCount;
+}
@@ -0,0 +1,321 @@
+#include <fs/ramfs/imagefs.hpp>
+#include <mm/string.hpp>
+
+static inline bool InImage(uint64_t offset, uint64_t count, uint64_t elementSize, uint64_t imageSize) {
+	// count elements of elementSize bytes from offset, without overflowing on the way
+	if(offset > imageSize) return false;
+	return count <= (imageSize - offset) / elementSize;
+}
+
+static bool CheckObject(const RAMFSImageHeader *header, const RAMFSImageObject *object) {
+	switch (object->flags) {
+		case RAMFS_IMAGE_FILE:
+			// Its pages are read whole, padding included
+			if(object->offset % RAMFS_IMAGE_PAGE_SIZE != 0) return false;
+			return InImage(object->offset, object->size / RAMFS_IMAGE_PAGE_SIZE + (object->size % RAMFS_IMAGE_PAGE_SIZE != 0), RAMFS_IMAGE_PAGE_SIZE, header->imageSize);
+		case RAMFS_IMAGE_DIRECTORY:
+			return InImage(object->offset, object->size, 1, header->entryCount);
+		default:
+			return false;
+	}
+}
+
+bool RAMFSImageDriver::Check(const void *image, size_t size) {
+	if(image == NULL || size < sizeof(RAMFSImageHeader)) return false;
+
+	// The file data is handed out a page at a time, so the pages have to be where the image says
+	if(((uint64_t)image & (RAMFS_IMAGE_PAGE_SIZE - 1)) != 0) return false;
+
+	const RAMFSImageHeader *header = (const RAMFSImageHeader*)image;
+	if(header->magic != RAMFS_IMAGE_MAGIC || header->version != RAMFS_IMAGE_VERSION) return false;
+	if(header->headerSize < sizeof(RAMFSImageHeader)) return false;
+	if(header->imageSize > size || header->imageSize % RAMFS_IMAGE_PAGE_SIZE != 0) return false;
+	if(header->headerSize > header->imageSize) return false;
+
+	if(header->objectsOffset % 8 != 0 || header->entriesOffset % 8 != 0) return false;
+	if(!InImage(header->objectsOffset, header->objectCount, sizeof(RAMFSImageObject), header->imageSize)) return false;
+	if(!InImage(header->entriesOffset, header->entryCount, sizeof(RAMFSImageEntry), header->imageSize)) return false;
+	if(!InImage(header->namesOffset, header->namesSize, 1, header->imageSize)) return false;
+
+	// There has to be a root, and it has to be a directory
+	if(header->objectCount == 0) return false;
+	const RAMFSImageObject *root = (const RAMFSImageObject*)((const uint8_t*)image + header->objectsOffset);
+	return root->flags == RAMFS_IMAGE_DIRECTORY && CheckObject(header, root);
+}
+
+void RAMFSImageDriver::FSInit(FSNode *mountpoint) {
+	// The caller has checked the image
+	header = (const RAMFSImageHeader*)image;
+
+	nodeLock.locked = 0;
+	for (int i = 0; i < RAMFS_IMAGE_NODE_BUCKETS; i++) {
+		nodes[i] = NULL;
+	}
+
+	const RAMFSImageObject *root = GetObject(0);
+
+	rootNode = VFS::AllocNode();
+	if (mountpoint != NULL) rootNode->name.Copy(&mountpoint->name);
+	else {
+		FSNameKey key;
+		VFS::MakeNameKey(&key, "ramfs", 5);
+		rootNode->name.Set(&key);
+	}
+	rootNode->mask = root->mask;
+	rootNode->uid = root->uid;
+	rootNode->gid = root->gid;
+	rootNode->size = rootNode->impl = 0;
+	rootNode->flags = VFS_NODE_DIRECTORY;
+	rootNode->inode = 0;
+}
+
+void RAMFSImageDriver::FSDelete() {
+	for (int i = 0; i < RAMFS_IMAGE_NODE_BUCKETS; i++) {
+		FSNode *node = nodes[i];
+		while (node != NULL) {
+			FSNode *next = (FSNode*)node->impl;
+			VFS::ReleaseNode(node);
+			node = next;
+		}
+
+		nodes[i] = NULL;
+	}
+
+	if(rootNode != NULL) VFS::ReleaseNode(rootNode);
+	rootNode = NULL;
+
+	// The image itself belongs to whoever loaded it
+	image = NULL;
+	header = NULL;
+}
+
+const RAMFSImageObject *RAMFSImageDriver::GetObject(uint64_t inode) {
+	if(inode >= header->objectCount) return NULL;
+
+	const RAMFSImageObject *object = (const RAMFSImageObject*)(image + header->objectsOffset) + inode;
+
+	return CheckObject(header, object) ? object : NULL;
+}
+
+const RAMFSImageEntry *RAMFSImageDriver::GetEntry(const RAMFSImageObject *directory, uint64_t index) {
+	if(index >= directory->size) return NULL;
+
+	return (const RAMFSImageEntry*)(image + header->entriesOffset) + directory->offset + index;
+}
+
+const char *RAMFSImageDriver::GetName(const RAMFSImageEntry *entry) {
+	// The terminator has to be in the table too
+	if(entry->nameOffset >= header->namesSize || entry->nameLength >= header->namesSize - entry->nameOffset) return NULL;
+
+	return (const char*)(image + header->namesOffset + entry->nameOffset);
+}
+
+FSNode *RAMFSImageDriver::GetNode(FSNode *parent, const RAMFSImageEntry *entry) {
+	uint64_t inode = entry->object;
+	FSNode **bucket = &nodes[(inode ^ (inode >> 8)) & (RAMFS_IMAGE_NODE_BUCKETS - 1)];
+
+	nodeLock.Lock();
+
+	for (FSNode *node = *bucket; node != NULL; node = (FSNode*)node->impl) {
+		if(node->inode == inode) {
+			FSNode *result = VFS::RefNode(node);
+			nodeLock.Unlock();
+			return result;
+		}
+	}
+
+	const RAMFSImageObject *object = GetObject(inode);
+	const char *name = GetName(entry);
+	if(object == NULL || name == NULL) {
+		nodeLock.Unlock();
+		return NULL;
+	}
+
+	FSNameKey key;
+	key.name = name;
+	key.length = entry->nameLength;
+	key.hash = entry->hash;
+
+	FSNode *node = VFS::AllocNode();
+	if(node == NULL || !node->name.Set(&key)) {
+		if(node != NULL) VFS::ReleaseNode(node);
+		nodeLock.Unlock();
+		return NULL;
+	}
+
+	node->driver = this;
+	VFS::SetParent(node, parent);
+	node->mask = object->mask;
+	node->uid = object->uid;
+	node->gid = object->gid;
+	node->inode = inode;
+
+	if(object->flags == RAMFS_IMAGE_FILE) {
+		node->flags = VFS_NODE_FILE;
+		node->size = object->size;
+	} else {
+		node->flags = VFS_NODE_DIRECTORY;
+		node->size = 0;
+	}
+
+	// The table keeps the first reference
+	node->impl = (uint64_t)*bucket;
+	*bucket = node;
+
+	FSNode *result = VFS::RefNode(node);
+	nodeLock.Unlock();
+	return result;
+}
+
+FILE *RAMFSImageDriver::FSOpenFile(FSNode *node, uint64_t descriptor) {
+	const RAMFSImageObject *object = GetObject(node->inode);
+	if(object == NULL || object->flags != RAMFS_IMAGE_FILE) return NULL;
+
+	FILE *file = VFS::AllocFile();
+	if(file == NULL) return NULL;
+
+	file->node = node;
+	file->buffer = NULL;
+	file->descriptor = descriptor;
+	file->bufferSize = file->bufferPos = 0;
+	return file;
+}
+
+void RAMFSImageDriver::FSCloseFile(FILE *file) {
+	VFS::FreeFile(file);
+}
+
+uint64_t RAMFSImageDriver::FSReadFile(FILE *file, uint64_t offset, size_t size, uint8_t **buffer) {
+	FSIOVec vector;
+	vector.buffer = *buffer + offset;
+	vector.length = size;
+
+	return FSReadFileV(file, offset, &vector, 1);
+}
+
+uint64_t RAMFSImageDriver::FSReadFileV(FILE *file, uint64_t offset, const FSIOVec *vectors, size_t count) {
+	if(file->node == NULL) return 0;
+
+	// Nothing ever changes in the image, no lock needed
+	const RAMFSImageObject *object = GetObject(file->node->inode);
+	if(object == NULL || object->flags != RAMFS_IMAGE_FILE) return 0;
+
+	const uint8_t *data = image + object->offset;
+	uint64_t position = offset;
+
+	for (size_t i = 0; i < count && position < object->size; i++) {
+		size_t size = vectors[i].length;
+		if(size > object->size - position) size = object->size - position;
+
+		memcpy(vectors[i].buffer, data + position, size);
+		position += size;
+	}
+
+	file->bufferPos = position;
+	return position - offset;
+}
+
+const uint8_t *RAMFSImageDriver::FSGetPage(FILE *file, uint64_t index, size_t *length) {
+	if(file->node == NULL) return NULL;
+
+	const RAMFSImageObject *object = GetObject(file->node->inode);
+	if(object == NULL || object->flags != RAMFS_IMAGE_FILE) return NULL;
+
+	if(index > object->size / RAMFS_IMAGE_PAGE_SIZE) return NULL;
+
+	uint64_t offset = index * RAMFS_IMAGE_PAGE_SIZE;
+	if(offset >= object->size) return NULL;
+
+	*length = object->size - offset;
+	if(*length > RAMFS_IMAGE_PAGE_SIZE) *length = RAMFS_IMAGE_PAGE_SIZE;
+
+	// The page of the image itself, zero padded past the end of the file
+	return image + object->offset + offset;
+}
+
+uint64_t RAMFSImageDriver::FSWriteFile(FILE *file, uint64_t offset, size_t size, uint8_t *buffer) {
+	// The image is read-only, files that have to change belong in a RAMFS
+	return 0;
+}
+
+uint64_t RAMFSImageDriver::FSDeleteFile(FSNode *node) {
+	return 1;
+}
+
+FSNode *RAMFSImageDriver::FSMakeFile(FSNode *node, const char *name, uint64_t uid, uint64_t gid, uint64_t mask) {
+	return NULL;
+}
+
+FSNode *RAMFSImageDriver::FSMakeDir(FSNode *node, const char *name, uint64_t uid, uint64_t gid, uint64_t mask) {
+	return NULL;
+}
+
+uint64_t RAMFSImageDriver::FSDeleteDir(FSNode *node) {
+	return 1;
+}
+
+FSNode *RAMFSImageDriver::FSReadDir(FSNode *node, uint64_t index) {
+	const RAMFSImageObject *directory = GetObject(node->inode);
+	if(directory == NULL || directory->flags != RAMFS_IMAGE_DIRECTORY) return NULL;
+
+	const RAMFSImageEntry *entry = GetEntry(directory, index);
+	if(entry == NULL) return NULL;
+
+	// Remember to give this back with VFS::PutNode!
+	return GetNode(node, entry);
+}
+
+FSNode *RAMFSImageDriver::FSFindDir(FSNode *node, const FSNameKey *key) {
+	const RAMFSImageObject *directory = GetObject(node->inode);
+	if(directory == NULL || directory->flags != RAMFS_IMAGE_DIRECTORY) return NULL;
+
+	// The first entry with a hash that isn't below the key's
+	uint64_t low = 0, high = directory->size;
+	while (low < high) {
+		uint64_t middle = low + (high - low) / 2;
+		if(GetEntry(directory, middle)->hash < key->hash) low = middle + 1;
+		else high = middle;
+	}
+
+	for (const RAMFSImageEntry *entry; (entry = GetEntry(directory, low)) != NULL && entry->hash == key->hash; low++) {
+		if(entry->nameLength != key->length) continue;
+
+		const char *name = GetName(entry);
+		if(name != NULL && memcmp(name, key->name, key->length) == 0) return GetNode(node, entry);
+	}
+
+	return NULL;
+}
+
+uint64_t RAMFSImageDriver::FSIterateDir(FSNode *node, uint64_t *cursor, VFSDirEntry *buffer, size_t bufferSize) {
+	const RAMFSImageObject *directory = GetObject(node->inode);
+	if(directory == NULL || directory->flags != RAMFS_IMAGE_DIRECTORY) return 0;
+
+	// The cursor is the index of the next entry, no node is made for them
+	uint64_t used = 0;
+	uint64_t position = *cursor;
+
+	const RAMFSImageEntry *entry;
+	while ((entry = GetEntry(directory, position)) != NULL) {
+		const RAMFSImageObject *object = GetObject(entry->object);
+		const char *name = GetName(entry);
+
+		if(object != NULL && name != NULL) {
+			uint32_t flags = object->flags == RAMFS_IMAGE_FILE ? VFS_NODE_FILE : VFS_NODE_DIRECTORY;
+			if (VFS::PutDirEntry(buffer, bufferSize, &used, entry->object, flags, name, entry->nameLength) == NULL) break;
+		}
+
+		position++;
+	}
+
+	*cursor = entry == NULL ? VFS_DIR_CURSOR_END : position;
+
+	return used;
+}
+
+uint64_t RAMFSImageDriver::FSGetDirElements(FSNode *node) {
+	const RAMFSImageObject *directory = GetObject(node->inode);
+	if(directory == NULL || directory->flags != RAMFS_IMAGE_DIRECTORY) return 0;
+
+	return directory->size;
+}
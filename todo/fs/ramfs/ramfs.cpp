@@ -1,289 +1,1462 @@
 #include <fs/ramfs/ramfs.hpp>
+#include <fs/objcache.hpp>
+#include <fs/lz.hpp>
+#include <autoconf.h>
 #include <mm/memory.hpp>
 #include <mm/string.hpp>
+#include <mm/pmm.hpp>
+#include <stddef.h>
+
+#define RAMFS_PAGE_UNAVAILABLE	((uint8_t*)RAMFS_PAGE_COMPRESSED)	// FindFilePage couldn't decompress the page
+
+static TypedObjectCache<RAMFSObject> objectCache;  // Shared by all the RAMFS instances
+static bool objectCacheReady = false;
+
+// The share table, also shared by all the instances so that pages can be shared across mounts
+static SpinLock shareLock;  // Protects the table, its entries and the stats
+static RAMFSSharedPage *sharedByPage[RAMFS_SHARE_BUCKETS];
+static RAMFSSharedPage *sharedByContent[RAMFS_SHARE_BUCKETS];
+static TypedObjectCache<RAMFSSharedPage> sharedCache;
+static RAMFSStats stats;
+
+// The compressed copies of pages, one cache per size class
+static ObjectCache compressedCaches[RAMFS_LZ_CLASSES];
+static const char *compressedCacheNames[RAMFS_LZ_CLASSES] = {
+	"ramfs_lz_256", "ramfs_lz_512", "ramfs_lz_768", "ramfs_lz_1024", "ramfs_lz_1280", "ramfs_lz_1536",
+	"ramfs_lz_1792", "ramfs_lz_2048", "ramfs_lz_2304", "ramfs_lz_2560", "ramfs_lz_2816", "ramfs_lz_3072"
+};
+static TypedObjectCache<RAMFSRetired> retiredCache;
+
+static SpinLock driversLock;  // Protects the list of instances and the compressor's cursor
+static RAMFSDriver *drivers;
+static uint64_t driverCount;
+static RAMFSDriver *compressDriver;  // The instance the compressor stopped at
+
+static SpinLock compressorLock;  // Held by whoever is compressing, for the buffer
+static uint8_t compressBuffer[RAMFS_LZ_CLASSES * RAMFS_LZ_CLASS_SIZE];
+
+static inline uint64_t PageBucket(const uint8_t *page) {
+	return ((uint64_t)page >> VFS_PAGE_SHIFT) & (RAMFS_SHARE_BUCKETS - 1);
+}
+
+static uint64_t HashPage(const uint8_t *page) {
+	// FNV-1a, a word at a time
+	const uint64_t *words = (const uint64_t*)page;
+	uint64_t hash = 0xCBF29CE484222325;
+
+	for (size_t i = 0; i < VFS_PAGE_SIZE / sizeof(uint64_t); i++) {
+		hash = (hash ^ words[i]) * 0x100000001B3;
+	}
+
+	return hash ^ (hash >> 32);
+}
+
+/* The functions below are called with shareLock taken */
+
+static RAMFSSharedPage *FindShared(const uint8_t *page) {
+	for (RAMFSSharedPage *entry = sharedByPage[PageBucket(page)]; entry != NULL; entry = entry->pageNext) {
+		if(entry->page == page) return entry;
+	}
+
+	return NULL;
+}
+
+static RAMFSSharedPage *ShareSlot(void **slot) {
+	// The slot's page gets an entry, if it doesn't have one already
+	if((uint64_t)*slot & RAMFS_PAGE_SHARED) return FindShared(RAMFS_SLOT_PAGE(*slot));
+
+	RAMFSSharedPage *entry = sharedCache.Alloc();
+	if(entry == NULL) return NULL;
+
+	entry->page = RAMFS_SLOT_PAGE(*slot);
+	entry->refs = 1;
+	entry->pins = 0;
+	entry->indexed = false;
+	entry->writable = false;
+	entry->wasShared = false;
+	entry->contentNext = NULL;
+
+	uint64_t bucket = PageBucket(entry->page);
+	entry->pageNext = sharedByPage[bucket];
+	sharedByPage[bucket] = entry;
+	stats.sharedPages++;
+
+	// Still the same page, lock-free readers just ignore the tag
+	__atomic_store_n(slot, (void*)((uint64_t)entry->page | RAMFS_PAGE_SHARED), __ATOMIC_RELEASE);
+	return entry;
+}
+
+static void Unindex(RAMFSSharedPage *entry) {
+	if(!entry->indexed) return;
+
+	RAMFSSharedPage **link = &sharedByContent[entry->contentHash & (RAMFS_SHARE_BUCKETS - 1)];
+	while (*link != entry) link = &(*link)->contentNext;
+	*link = entry->contentNext;
+
+	entry->indexed = false;
+}
+
+static void ReclaimShared(RCUHead *head) {
+	RAMFSSharedPage *entry = (RAMFSSharedPage*)((uint8_t*)head - offsetof(RAMFSSharedPage, rcu));
+
+	PMM::FreePage(entry->page);
+	__atomic_sub_fetch(&stats.residentPages, 1, __ATOMIC_RELAXED);
+	sharedCache.Free(entry);
+}
+
+static void RemoveShared(RAMFSSharedPage *entry, bool freePage) {
+	Unindex(entry);
+
+	RAMFSSharedPage **link = &sharedByPage[PageBucket(entry->page)];
+	while (*link != entry) link = &(*link)->pageNext;
+	*link = entry->pageNext;
+	stats.sharedPages--;
+
+	if(freePage) RCU::Retire(&entry->rcu, ReclaimShared);
+	else sharedCache.Free(entry);
+}
+
+static void RefShared(RAMFSSharedPage *entry, void **slot) {
+	entry->refs++;
+	entry->wasShared = true;
+	stats.savedPages++;
+
+	__atomic_store_n(slot, (void*)((uint64_t)entry->page | RAMFS_PAGE_SHARED), __ATOMIC_RELEASE);
+}
+
+static void DropShared(RAMFSSharedPage *entry, bool pin) {
+	// A slot or a caller of FSGetPage lets go of the page
+	if(pin) {
+		if(--entry->pins == 0) entry->writable = false;
+	} else {
+		if(--entry->refs > 0) stats.savedPages--;
+
+		// No file has it anymore, nobody can find it by its content either
+		else Unindex(entry);
+	}
+
+	if(entry->refs == 0 && entry->pins == 0) RemoveShared(entry, true);
+}
+
+static uint8_t *PinSlot(void **slot, bool writable) {
+	RAMFSSharedPage *entry = ShareSlot(slot);
+	if(entry == NULL) return NULL;
+
+	entry->pins++;
+	if(writable) entry->writable = true;
+
+	return entry->page;
+}
 
 void RAMFSDriver::FSInit(FSNode *mountpoint) {
-	inodeTable = (RAMFSObject**)Malloc(sizeof(uint64_t) * maxInodes);
+	if(!objectCacheReady) {
+		objectCache.Init("ramfs_object");
+		sharedCache.Init("ramfs_shared");
+		retiredCache.Init("ramfs_retired");
+
+		for (int i = 0; i < RAMFS_LZ_CLASSES; i++) {
+			compressedCaches[i].Init(compressedCacheNames[i], (i + 1) * RAMFS_LZ_CLASS_SIZE);
+		}
+
+		objectCacheReady = true;
+	}
+
+	// Only the directory of the table is allocated now, the slots come as they are needed
+	inodeChunkCount = (maxInodes + RAMFS_INODE_CHUNK_SLOTS - 1) / RAMFS_INODE_CHUNK_SLOTS;
+	inodeTable = (RAMFSObject***)Malloc(sizeof(RAMFSObject**) * inodeChunkCount);
+	inodeLock.locked = 0;
 	currentInode = 0;
+	freeInode = RAMFS_NO_INODE;
 
-	for(int i = 0; i < maxInodes; i++) {
+	for(int i = 0; i < SYNC_MAX_CPUS; i++) {
+		inodeCaches[i].lock.locked = 0;
+		inodeCaches[i].count = 0;
+	}
+
+	for(uint64_t i = 0; i < inodeChunkCount; i++) {
 		inodeTable[i] = NULL;
 	}
 
-	rootFile = (RAMFSObject*)Malloc(sizeof(RAMFSObject));
+	rootFile = objectCache.Alloc();
 	rootFile->magic = 0;
-	if (mountpoint == NULL) strcpy(rootFile->name, "ramfs");
-	else strcpy(rootFile->name, mountpoint->name);
 	rootFile->length = 0;
 	rootFile->isFile = false;
 	rootFile->firstObject = NULL;
-	rootNode = (FSNode*)Malloc(sizeof(FSNode));
+	rootFile->pageTree = NULL;
+	rootFile->pageTreeLevels = 0;
+	rootFile->hashNext = NULL;
+	rootFile->dirIndex = NULL;
+	rootFile->dirElements = 0;
+	rootFile->lock.locked = 0;
+	rootFile->seq.sequence = 0;
+	rootNode = VFS::AllocNode();
 	rootFile->node = rootNode;
-	if (mountpoint == NULL) strcpy(rootFile->node->name, "ramfs");
-	else strcpy(rootFile->node->name, mountpoint->name);
+	if (mountpoint != NULL) rootFile->node->name.Copy(&mountpoint->name);
+	else {
+		FSNameKey key;
+		VFS::MakeNameKey(&key, "ramfs", 5);
+		rootFile->node->name.Set(&key);
+	}
 	rootFile->node->mask = rootFile->node->uid = rootFile->node->gid = rootFile->node->size = rootFile->node->impl = 0;
 	rootFile->node->flags = VFS_NODE_DIRECTORY;
-	rootFile->node->inode = currentInode;
+	rootFile->node->inode = AllocInode(rootFile);
 
+	rootFile->parent = NULL;
+	rootFile->sequence = rootFile->nextSequence = 0;
 	rootFile->nextObject = NULL;
+	rootFile->prevObject = NULL;
+	rootFile->deleted = false;
+	__atomic_add_fetch(&stats.objects, 1, __ATOMIC_RELAXED);
+
+	compressInode = compressIndex = 0;
+	compressorRefs = 0;
+
+	driversLock.Lock();
+	nextDriver = drivers;
+	drivers = this;
+	driverCount++;
+	driversLock.Unlock();
+}
+
+RAMFSObject *RAMFSDriver::GetObject(uint64_t inode) {
+	if(inode >= maxInodes) return NULL;
+
+	// No lock, chunks and slots are only published once they're ready
+	RAMFSObject **chunk = __atomic_load_n(&inodeTable[inode / RAMFS_INODE_CHUNK_SLOTS], __ATOMIC_ACQUIRE);
+	if(chunk == NULL) return NULL;
+
+	RAMFSObject *object = __atomic_load_n(&chunk[inode % RAMFS_INODE_CHUNK_SLOTS], __ATOMIC_ACQUIRE);
+	if((uint64_t)object & RAMFS_INODE_FREE) return NULL;
+
+	return object;
+}
+
+void RAMFSDriver::RefillInodes(RAMFSInodeCache *cache) {
+	// Called with the cache locked. Freed inodes first, then ones never used
+	inodeLock.Lock();
+
+	while(cache->count < RAMFS_INODE_BATCH) {
+		uint64_t inode;
+
+		if(freeInode != RAMFS_NO_INODE) {
+			// The slot of a free inode holds the next one
+			inode = freeInode;
+			freeInode = (uint64_t)inodeTable[inode / RAMFS_INODE_CHUNK_SLOTS][inode % RAMFS_INODE_CHUNK_SLOTS] >> 1;
+
+			// The end of the list lost its top bit to the tag
+			if(freeInode == RAMFS_NO_INODE >> 1) freeInode = RAMFS_NO_INODE;
+		} else {
+			if(currentInode >= maxInodes) break;
+
+			if(inodeTable[currentInode / RAMFS_INODE_CHUNK_SLOTS] == NULL) {
+				RAMFSObject **chunk = (RAMFSObject**)Malloc(sizeof(RAMFSObject*) * RAMFS_INODE_CHUNK_SLOTS);
+				if(chunk == NULL) break;
+
+				for(uint64_t i = 0; i < RAMFS_INODE_CHUNK_SLOTS; i++) {
+					chunk[i] = NULL;
+				}
+
+				__atomic_store_n(&inodeTable[currentInode / RAMFS_INODE_CHUNK_SLOTS], chunk, __ATOMIC_RELEASE);
+			}
+
+			inode = currentInode++;
+		}
+
+		__atomic_store_n(&inodeTable[inode / RAMFS_INODE_CHUNK_SLOTS][inode % RAMFS_INODE_CHUNK_SLOTS],
+				 (RAMFSObject*)RAMFS_INODE_FREE, __ATOMIC_RELEASE);
+		cache->inodes[cache->count++] = inode;
+	}
+
+	inodeLock.Unlock();
+}
+
+void RAMFSDriver::DrainInodes(RAMFSInodeCache *cache, uint64_t count) {
+	// Called with the cache locked, the inodes on top go back to the free list
+	inodeLock.Lock();
+
+	for(uint64_t i = 0; i < count; i++) {
+		uint64_t inode = cache->inodes[--cache->count];
+		__atomic_store_n(&inodeTable[inode / RAMFS_INODE_CHUNK_SLOTS][inode % RAMFS_INODE_CHUNK_SLOTS],
+				 (RAMFSObject*)((freeInode << 1) | RAMFS_INODE_FREE), __ATOMIC_RELEASE);
+		freeInode = inode;
+	}
+
+	inodeLock.Unlock();
+}
+
+uint64_t RAMFSDriver::AllocInode(RAMFSObject *object) {
+	RAMFSInodeCache *cache = &inodeCaches[CurrentCPU() & (SYNC_MAX_CPUS - 1)];
+	cache->lock.Lock();
+
+	if(cache->count == 0) RefillInodes(cache);
+
+	if(cache->count == 0) {
+		// The last free inodes may be sitting in the caches of other CPUs
+		cache->lock.Unlock();
+
+		for(uint64_t i = 0; i < SYNC_MAX_CPUS; i++) {
+			inodeCaches[i].lock.Lock();
+			DrainInodes(&inodeCaches[i], inodeCaches[i].count);
+			inodeCaches[i].lock.Unlock();
+		}
 
-	inodeTable[currentInode++] = rootFile;
+		cache->lock.Lock();
+		if(cache->count == 0) RefillInodes(cache);
+		if(cache->count == 0) {
+			cache->lock.Unlock();
+			return RAMFS_NO_INODE;
+		}
+	}
 
-	inodeTable[currentInode] = NULL;
+	uint64_t inode = cache->inodes[--cache->count];
+	__atomic_store_n(&inodeTable[inode / RAMFS_INODE_CHUNK_SLOTS][inode % RAMFS_INODE_CHUNK_SLOTS], object, __ATOMIC_RELEASE);
 
+	cache->lock.Unlock();
+	return inode;
+}
+
+void RAMFSDriver::FreeInode(uint64_t inode) {
+	RAMFSInodeCache *cache = &inodeCaches[CurrentCPU() & (SYNC_MAX_CPUS - 1)];
+	cache->lock.Lock();
+
+	if(GetObject(inode) != NULL) {
+		__atomic_store_n(&inodeTable[inode / RAMFS_INODE_CHUNK_SLOTS][inode % RAMFS_INODE_CHUNK_SLOTS],
+				 (RAMFSObject*)RAMFS_INODE_FREE, __ATOMIC_RELEASE);
+
+		if(cache->count == RAMFS_INODE_CACHE_SIZE) DrainInodes(cache, RAMFS_INODE_BATCH);
+		cache->inodes[cache->count++] = inode;
+	}
+
+	cache->lock.Unlock();
+}
+
+RAMFSObject *RAMFSDriver::GetNodeObject(FSNode *node) {
+	// Called in an RCU read section. The inode of a deleted object can already belong to another one
+	RAMFSObject *object = GetObject(node->inode);
+	if(object == NULL || object->node != node) return NULL;
+
+	return object;
+}
+
+static bool LockObject(RAMFSObject *object) {
+	// Called in an RCU read section, so the object can't be freed while we wait
+	object->lock.Lock();
+	if(!object->deleted) return true;
+
+	object->lock.Unlock();
+	return false;
+}
+
+RAMFSObject *RAMFSDriver::LockNode(FSNode *node, bool isFile) {
+	// Once we hold the lock of an object that isn't deleted, nobody can delete it
+	uint64_t token = RCU::ReadLock();
+
+	RAMFSObject *object = GetNodeObject(node);
+	if(object != NULL && (object->isFile != isFile || !LockObject(object))) object = NULL;
+
+	RCU::ReadUnlock(token);
+	return object;
+}
+
+static void ReclaimRetired(RCUHead *head) {
+	RAMFSRetired *retired = (RAMFSRetired*)((uint8_t*)head - offsetof(RAMFSRetired, rcu));
+
+	if(retired->sizeClass == RAMFS_LZ_CLASSES) {
+		PMM::FreePage(retired->memory);
+		__atomic_sub_fetch(&stats.residentPages, 1, __ATOMIC_RELAXED);
+	} else {
+		compressedCaches[retired->sizeClass].Free(retired->memory);
+	}
+
+	retiredCache.Free(retired);
+}
+
+static void DropSharedPages(void **table, uint64_t level) {
+	// Called with the object locked, before it's freed: shared pages belong to the share table
+	for (uint64_t i = 0; i < RAMFS_PAGE_TREE_ENTRIES; i++) {
+		uint64_t value = (uint64_t)table[i];
+		if(value == 0) continue;
+
+		if(level > 1) {
+			DropSharedPages((void**)value, level - 1);
+		} else if(value & RAMFS_PAGE_SHARED) {
+			shareLock.Lock();
+			DropShared(FindShared(RAMFS_SLOT_PAGE(value)), false);
+			shareLock.Unlock();
+		}
+	}
+}
+
+static void FreePageTree(void **table, uint64_t level) {
+	// Everything but the shared pages, that were already dropped
+	for (uint64_t i = 0; i < RAMFS_PAGE_TREE_ENTRIES; i++) {
+		uint64_t value = (uint64_t)table[i];
+		if(value == 0) continue;
+
+		if(level > 1) {
+			FreePageTree((void**)value, level - 1);
+		} else if(value & RAMFS_PAGE_COMPRESSED) {
+			RAMFSCompressedPage *compressed = (RAMFSCompressedPage*)RAMFS_SLOT_PAGE(value);
+			__atomic_sub_fetch(&stats.compressedPages, 1, __ATOMIC_RELAXED);
+			__atomic_sub_fetch(&stats.compressedBytes, (compressed->sizeClass + 1) * RAMFS_LZ_CLASS_SIZE, __ATOMIC_RELAXED);
+			compressedCaches[compressed->sizeClass].Free(compressed);
+		} else if(!(value & RAMFS_PAGE_SHARED)) {
+			PMM::FreePage(RAMFS_SLOT_PAGE(value));
+			__atomic_sub_fetch(&stats.residentPages, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	PMM::FreePage(table);
+	__atomic_sub_fetch(&stats.residentPages, 1, __ATOMIC_RELAXED);
+}
+
+static void ReclaimObject(RCUHead *head) {
+	RAMFSObject *object = (RAMFSObject*)((uint8_t*)head - offsetof(RAMFSObject, rcu));
+
+	if(object->pageTree != NULL) FreePageTree(object->pageTree, object->pageTreeLevels);
+	if(object->dirIndex != NULL) Free(object->dirIndex);
+
+	objectCache.Free(object);
+	__atomic_sub_fetch(&stats.objects, 1, __ATOMIC_RELAXED);
+}
+
+void RAMFSDriver::DestroyObject(RAMFSObject *object) {
+	// Called with the object locked and out of reach of new lookups, it's unlocked here
+	object->deleted = true;
+	if(object->pageTree != NULL) DropSharedPages(object->pageTree, object->pageTreeLevels);
+
+	object->lock.Unlock();
+
+	// The driver's reference, the node goes once whoever still holds it is done
+	VFS::ReleaseNode(object->node);
+	RCU::Retire(&object->rcu, ReclaimObject);
 }
 
 void RAMFSDriver::FSDelete() {
+	// The compressor must not come here anymore, and must be done if it's here already
+	driversLock.Lock();
+
+	while (compressorRefs != 0) {
+		driversLock.Unlock();
+		CPURelax();
+		driversLock.Lock();
+	}
+
+	RAMFSDriver **link = &drivers;
+	while (*link != NULL && *link != this) link = &(*link)->nextDriver;
+	if(*link != NULL) {
+		*link = nextDriver;
+		driverCount--;
+	}
+
+	if(compressDriver == this) compressDriver = nextDriver;
+
+	driversLock.Unlock();
+
+	// The VFS doesn't send anything here anymore, every object can just go
+	for (uint64_t inode = 0; inode < currentInode; inode++) {
+		RAMFSObject *object = GetObject(inode);
+		if(object == NULL) continue;
+
+		object->lock.Lock();
+		DestroyObject(object);
+	}
+
+	for (uint64_t i = 0; i < inodeChunkCount; i++) {
+		if(inodeTable[i] != NULL) Free(inodeTable[i]);
+	}
+
+	Free(inodeTable);
+	inodeTable = NULL;
+	inodeChunkCount = currentInode = 0;
+	freeInode = RAMFS_NO_INODE;
+
+	for(int i = 0; i < SYNC_MAX_CPUS; i++) {
+		inodeCaches[i].count = 0;
+	}
+
+	rootFile = NULL;
+	rootNode = NULL;
+}
+
+static uint8_t *UncompressSlot(void **slot) {
+	// Called with the object locked
+	uint64_t value = (uint64_t)__atomic_load_n(slot, __ATOMIC_RELAXED);
+	if(!(value & RAMFS_PAGE_COMPRESSED)) return RAMFS_SLOT_PAGE(value);
+
+	RAMFSCompressedPage *compressed = (RAMFSCompressedPage*)RAMFS_SLOT_PAGE(value);
+	uint64_t start = ReadCycles();
+
+	// Readers could be decompressing it on their own, it's freed after them
+	RAMFSRetired *retired = retiredCache.Alloc();
+	if(retired == NULL) return NULL;
+
+	uint8_t *page = (uint8_t*)PMM::RequestPage();
+	if(page == NULL) {
+		retiredCache.Free(retired);
+		return NULL;
+	}
+
+	// Whole pages were compressed, anything else is corrupted. It stays as it is and the access fails
+	if(LZ::Decompress(compressed->data, compressed->size, page, VFS_PAGE_SIZE) != VFS_PAGE_SIZE) {
+		PMM::FreePage(page);
+		retiredCache.Free(retired);
+		__atomic_add_fetch(&stats.decompressErrors, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	__atomic_add_fetch(&stats.residentPages, 1, __ATOMIC_RELAXED);
+
+	// Just used, the compressor shouldn't take it right back
+	__atomic_store_n(slot, (void*)((uint64_t)page | RAMFS_PAGE_REFERENCED), __ATOMIC_RELEASE);
+
+	retired->memory = compressed;
+	retired->sizeClass = compressed->sizeClass;
+	__atomic_sub_fetch(&stats.compressedPages, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&stats.compressedBytes, (compressed->sizeClass + 1) * RAMFS_LZ_CLASS_SIZE, __ATOMIC_RELAXED);
+	RCU::Retire(&retired->rcu, ReclaimRetired);
+
+	__atomic_add_fetch(&stats.decompressions, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.decompressCycles, ReadCycles() - start, __ATOMIC_RELAXED);
+
+	return page;
+}
+
+static bool CompressSlot(void **slot) {
+	// Called with the object locked and compressorLock taken, for the buffer
+	uint64_t value = (uint64_t)__atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if(value & (RAMFS_PAGE_SHARED | RAMFS_PAGE_COMPRESSED | RAMFS_PAGE_INCOMPRESSIBLE)) return false;
+
+	// Second chance: it was used since the last sweep, maybe the next one
+	if(value & RAMFS_PAGE_REFERENCED) {
+		__atomic_store_n(slot, (void*)(value & ~(uint64_t)RAMFS_PAGE_REFERENCED), __ATOMIC_RELEASE);
+		return false;
+	}
+
+	uint8_t *page = (uint8_t*)value;
+	size_t size = LZ::Compress(page, VFS_PAGE_SIZE, compressBuffer, sizeof(compressBuffer) - sizeof(RAMFSCompressedPage));
+	if(size == 0) {
+		__atomic_store_n(slot, (void*)(value | RAMFS_PAGE_INCOMPRESSIBLE), __ATOMIC_RELEASE);
+		__atomic_add_fetch(&stats.incompressible, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	uint64_t sizeClass = (sizeof(RAMFSCompressedPage) + size - 1) / RAMFS_LZ_CLASS_SIZE;
+	RAMFSRetired *retired = retiredCache.Alloc();
+	if(retired == NULL) return false;
+
+	RAMFSCompressedPage *compressed = (RAMFSCompressedPage*)compressedCaches[sizeClass].Alloc();
+	if(compressed == NULL) {
+		retiredCache.Free(retired);
+		return false;
+	}
+
+	compressed->size = size;
+	compressed->sizeClass = sizeClass;
+	memcpy(compressed->data, compressBuffer, size);
+
+	__atomic_store_n(slot, (void*)((uint64_t)compressed | RAMFS_PAGE_COMPRESSED), __ATOMIC_RELEASE);
+
+	// Lock-free readers could still be copying from the page
+	retired->memory = page;
+	retired->sizeClass = RAMFS_LZ_CLASSES;
+	RCU::Retire(&retired->rcu, ReclaimRetired);
+
+	__atomic_add_fetch(&stats.compressedPages, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.compressedBytes, (sizeClass + 1) * RAMFS_LZ_CLASS_SIZE, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.compressions, 1, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+uint8_t *RAMFSDriver::Uncompress(RAMFSObject *object, uint64_t index) {
+	// Called in an RCU read section. A deleted file is left as it is
+	if(!LockObject(object)) return NULL;
+
+	// Somebody else could have done it in the meantime
+	void **slot = GetFileSlot(object, index, false);
+	uint8_t *page = slot != NULL ? UncompressSlot(slot) : NULL;
+
+	object->lock.Unlock();
+	return page;
+}
+
+bool RAMFSDriver::CompressPages(uint64_t *budget, uint64_t *compressed) {
+	// Called by CompressorTick, that holds a reference to the mount. It goes on from where it stopped,
+	// true means it got to the end of the mount and the next call starts another sweep
+	uint64_t inodes = __atomic_load_n(&currentInode, __ATOMIC_ACQUIRE);
+
+	while (compressInode < inodes && *budget > 0) {
+		uint64_t token = RCU::ReadLock();
+
+		RAMFSObject *object = GetObject(compressInode);
+		if(object != NULL && (!object->isFile || !LockObject(object))) object = NULL;
+
+		RCU::ReadUnlock(token);
+
+		if(object != NULL) {
+
+			uint64_t pages = (object->length + VFS_PAGE_SIZE - 1) >> VFS_PAGE_SHIFT;
+			while (compressIndex < pages && *budget > 0) {
+				void **slot = GetFileSlot(object, compressIndex++, false);
+				if(slot != NULL && *slot != NULL && CompressSlot(slot)) (*compressed)++;
+				(*budget)--;
+			}
+
+			object->lock.Unlock();
+
+			// Out of budget halfway through the file, the next tick starts from here
+			if(compressIndex < pages) return false;
+		}
+
+		compressInode++;
+		compressIndex = 0;
+	}
+
+	if(compressInode < inodes) return false;
+
+	compressInode = compressIndex = 0;
+	return true;
+}
+
+uint8_t *RAMFSDriver::FindFilePage(RAMFSObject *object, uint64_t index) {
+	// Lock-free: the root and the height just have to come from the same version of the tree
+	void **table;
+	uint64_t levels;
+	uint32_t start;
+
+	do {
+		start = object->seq.ReadBegin();
+		table = __atomic_load_n(&object->pageTree, __ATOMIC_RELAXED);
+		levels = __atomic_load_n(&object->pageTreeLevels, __ATOMIC_RELAXED);
+	} while (object->seq.ReadRetry(start));
+
+	if(levels == 0) return NULL;
+	if(levels < RAMFS_PAGE_TREE_MAX_LEVELS && index >> (RAMFS_PAGE_TREE_SHIFT * levels) != 0) return NULL;
+
+	for (uint64_t level = levels - 1; level > 0; level--) {
+		uint64_t slot = (index >> (RAMFS_PAGE_TREE_SHIFT * level)) & (RAMFS_PAGE_TREE_ENTRIES - 1);
+
+		table = (void**)__atomic_load_n(&table[slot], __ATOMIC_ACQUIRE);
+		if(table == NULL) return NULL;
+	}
+
+	void **slot = &table[index & (RAMFS_PAGE_TREE_ENTRIES - 1)];
+	void *value = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if(value == NULL) return NULL;
+
+	if((uint64_t)value & RAMFS_PAGE_COMPRESSED) {
+		uint8_t *page = Uncompress(object, index);
+		return page != NULL ? page : RAMFS_PAGE_UNAVAILABLE;
+	}
+
+	// Tell the compressor it's in use, unless somebody changed the slot in the meantime
+	if(!((uint64_t)value & RAMFS_PAGE_REFERENCED)) {
+		__atomic_compare_exchange_n(slot, &value, (void*)((uint64_t)value | RAMFS_PAGE_REFERENCED), false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+
+	return RAMFS_SLOT_PAGE(value);
+}
+
+static void *NewTablePage() {
+	void *page = PMM::RequestPage();
+	if(page == NULL) return NULL;
+
+	memset(page, 0, VFS_PAGE_SIZE);
+	__atomic_add_fetch(&stats.residentPages, 1, __ATOMIC_RELAXED);
+
+	return page;
+}
+
+void **RAMFSDriver::GetFileSlot(RAMFSObject *object, uint64_t index, bool create) {
+	// The caller holds the object's lock
+	if(!create) {
+		if(object->pageTreeLevels == 0) return NULL;
+		if(object->pageTreeLevels < RAMFS_PAGE_TREE_MAX_LEVELS && index >> (RAMFS_PAGE_TREE_SHIFT * object->pageTreeLevels) != 0) return NULL;
+
+		void **table = object->pageTree;
+		for (uint64_t level = object->pageTreeLevels - 1; level > 0 && table != NULL; level--) {
+			table = (void**)table[(index >> (RAMFS_PAGE_TREE_SHIFT * level)) & (RAMFS_PAGE_TREE_ENTRIES - 1)];
+		}
+
+		return table != NULL ? &table[index & (RAMFS_PAGE_TREE_ENTRIES - 1)] : NULL;
+	}
 
+	// Make the tree taller until it can reach the index
+	while (object->pageTreeLevels == 0 ||
+	       (object->pageTreeLevels < RAMFS_PAGE_TREE_MAX_LEVELS &&
+		index >> (RAMFS_PAGE_TREE_SHIFT * object->pageTreeLevels) != 0)) {
+		void **table = (void**)NewTablePage();
+		if(table == NULL) return NULL;
+
+		// The old tree stays as it is under the new root, readers on it are fine
+		table[0] = object->pageTree;
+
+		object->seq.WriteBegin();
+		__atomic_store_n(&object->pageTree, table, __ATOMIC_RELAXED);
+		__atomic_store_n(&object->pageTreeLevels, object->pageTreeLevels + 1, __ATOMIC_RELAXED);
+		object->seq.WriteEnd();
+	}
+
+	void **table = object->pageTree;
+
+	for (uint64_t level = object->pageTreeLevels - 1; level > 0; level--) {
+		uint64_t slot = (index >> (RAMFS_PAGE_TREE_SHIFT * level)) & (RAMFS_PAGE_TREE_ENTRIES - 1);
+
+		if(table[slot] == NULL) {
+			void *next = NewTablePage();
+			if(next == NULL) return NULL;
+			__atomic_store_n(&table[slot], next, __ATOMIC_RELEASE);
+		}
+
+		table = (void**)table[slot];
+	}
+
+	return &table[index & (RAMFS_PAGE_TREE_ENTRIES - 1)];
+}
+
+uint8_t *RAMFSDriver::GetFilePage(RAMFSObject *object, uint64_t index, bool create) {
+	if(!create) return FindFilePage(object, index);
+
+	// From here on the caller holds the object's lock, and the page is about to be written
+	void **slot = GetFileSlot(object, index, true);
+	if(slot == NULL) return NULL;
+
+	if(*slot == NULL) {
+		void *page = NewTablePage();
+		if(page == NULL) return NULL;
+		__atomic_store_n(slot, page, __ATOMIC_RELEASE);
+	}
+
+	if((uint64_t)*slot & RAMFS_PAGE_COMPRESSED && UncompressSlot(slot) == NULL) return NULL;
+
+	if(!((uint64_t)*slot & RAMFS_PAGE_SHARED)) {
+		// It's about to change, the compressor can try it again
+		uint8_t *page = RAMFS_SLOT_PAGE(*slot);
+		__atomic_store_n(slot, (void*)((uint64_t)page | RAMFS_PAGE_REFERENCED), __ATOMIC_RELEASE);
+
+		return page;
+	}
+
+	shareLock.Lock();
+
+	RAMFSSharedPage *entry = FindShared(RAMFS_SLOT_PAGE(*slot));
+	uint8_t *page = entry->page;
+
+	if(entry->refs == 1 && (entry->pins == 0 || entry->writable || !entry->wasShared)) {
+		// Nobody else can see it, it can be written in place once it's out of the content index
+		Unindex(entry);
+		if(entry->pins == 0) {
+			RemoveShared(entry, false);
+			__atomic_store_n(slot, (void*)page, __ATOMIC_RELEASE);
+		}
+	} else {
+		// Copy on write, the others (files, or callers that got it through them) keep the page as it is
+		uint8_t *copy = (uint8_t*)PMM::RequestPage();
+		if(copy != NULL) {
+			memcpy(copy, page, VFS_PAGE_SIZE);
+			__atomic_store_n(slot, (void*)copy, __ATOMIC_RELEASE);
+			__atomic_add_fetch(&stats.residentPages, 1, __ATOMIC_RELAXED);
+
+			DropShared(entry, false);
+			stats.copies++;
+		}
+
+		page = copy;
+	}
+
+	shareLock.Unlock();
+	return page;
 }
 
 uint64_t RAMFSDriver::FSReadFile(FILE *file, uint64_t offset, size_t size, uint8_t **buffer) {
+	FSIOVec vector;
+	vector.buffer = *buffer + offset;
+	vector.length = size;
+
+	return FSReadFileV(file, offset, &vector, 1);
+}
+
+uint64_t RAMFSDriver::FSReadFileV(FILE *file, uint64_t offset, const FSIOVec *vectors, size_t count) {
 	if(file->node == NULL) return 0;
-	if(file->node->inode > maxInodes) return 0;
-	if(inodeTable[file->node->inode] == NULL) return 0;
-	if(inodeTable[file->node->inode]->isFile == false) return 0;
 
-	if(offset > inodeTable[file->node->inode]->length) return 0;
-	if(offset + size > inodeTable[file->node->inode]->length) size = inodeTable[file->node->inode]->length - offset;
+	// A single pass over the pages: each one is looked up once, even when it's split between vectors.
+	// No lock: the data of a length we can see has been written before it, and a page a writer
+	// stopped sharing (or the whole file, if it's deleted) isn't freed until we are out
+	uint64_t token = RCU::ReadLock();
+
+	RAMFSObject *object = GetNodeObject(file->node);
+	if(object == NULL || object->isFile == false) {
+		RCU::ReadUnlock(token);
+		return 0;
+	}
+
+	uint64_t length = __atomic_load_n(&object->length, __ATOMIC_ACQUIRE);
+	uint64_t position = offset;
+	uint64_t pageIndex = RAMFS_NO_INODE;
+	uint8_t *page = NULL;
+	bool failed = false;
+
+	for (size_t i = 0; i < count && position < length && !failed; i++) {
+		size_t size = vectors[i].length;
+		if(size > length - position) size = length - position;
+
+		size_t done = 0;
+		while (done < size) {
+			uint64_t pageOffset = position & (VFS_PAGE_SIZE - 1);
+			size_t chunk = VFS_PAGE_SIZE - pageOffset;
+			if(chunk > size - done) chunk = size - done;
+
+			if(position >> VFS_PAGE_SHIFT != pageIndex) {
+				pageIndex = position >> VFS_PAGE_SHIFT;
+				page = FindFilePage(object, pageIndex);
 
-	memcpy(*buffer + offset, inodeTable[file->node->inode]->fileData + offset, size);
-	return size;
+				// Compressed, and it couldn't be decompressed (no memory, or corrupted): the read stops here
+				if(page == RAMFS_PAGE_UNAVAILABLE) {
+					failed = true;
+					break;
+				}
+			}
+
+			// Pages that were never written are holes and read as zeroes
+			if(page == NULL) memset(vectors[i].buffer + done, 0, chunk);
+			else memcpy(vectors[i].buffer + done, page + pageOffset, chunk);
+
+			done += chunk;
+			position += chunk;
+		}
+	}
+
+	RCU::ReadUnlock(token);
+	return position - offset;
 }
 
-uint64_t RAMFSDriver::FSWriteFile(FILE *file, uint64_t offset, size_t size, uint8_t *buffer) {
-	if(file->node->inode > maxInodes) return 0;
-	if(inodeTable[file->node->inode] == NULL) return 0;
-	if(inodeTable[file->node->inode]->isFile == false) return 0;
+const uint8_t *RAMFSDriver::FSGetPage(FILE *file, uint64_t index, size_t *length) {
+	if(file->node == NULL) return NULL;
 
-	if(offset + size > inodeTable[file->node->inode]->length) {
-		if (inodeTable[file->node->inode]->length == 0) {
-			inodeTable[file->node->inode]->fileData = new uint8_t[offset + size];
-			memset(inodeTable[file->node->inode]->fileData, 0, inodeTable[file->node->inode]->length);
+	// The data is already in memory (once decompressed), just point to it. It's pinned,
+	// so that it stays around even if the file stops using it before FSPutPage
+	RAMFSObject *object = LockNode(file->node, true);
+	if(object == NULL) return NULL;
 
-		} else {
-			uint8_t *tempBuffer = new uint8_t[inodeTable[file->node->inode]->length];
-			memcpy(tempBuffer, inodeTable[file->node->inode]->fileData, inodeTable[file->node->inode]->length);
+	uint64_t offset = index << VFS_PAGE_SHIFT;
+	if(offset >= object->length) {
+		object->lock.Unlock();
+		return NULL;
+	}
+
+	*length = object->length - offset;
+	if(*length > VFS_PAGE_SIZE) *length = VFS_PAGE_SIZE;
+
+	// A hole gets a page of the file now, a zero page shared with the caller wouldn't
+	// see what is written to the file later on
+	void **slot = GetFileSlot(object, index, false);
+	if((slot == NULL || *slot == NULL) && GetFilePage(object, index, true) != NULL) slot = GetFileSlot(object, index, false);
+
+	uint8_t *page = NULL;
+	if(slot != NULL && *slot != NULL && UncompressSlot(slot) != NULL) {
+		shareLock.Lock();
+		page = PinSlot(slot, false);
+		shareLock.Unlock();
+	}
+
+	object->lock.Unlock();
+	return page;
+}
+
+uint8_t *RAMFSDriver::FSGetWritablePage(FILE *file, uint64_t index) {
+	if(file->node == NULL) return NULL;
+	RAMFSObject *object = LockNode(file->node, true);
+	if(object == NULL) return NULL;
+
+	// Only pages already part of the file, writing through them can't make it longer.
+	// The page is the file's own from now on: nobody else can share it while it's pinned
+	uint8_t *page = NULL;
+	if((index << VFS_PAGE_SHIFT) < object->length && GetFilePage(object, index, true) != NULL) {
+		shareLock.Lock();
+		page = PinSlot(GetFileSlot(object, index, false), true);
+		shareLock.Unlock();
+	}
+
+	object->lock.Unlock();
+	return page;
+}
+
+void RAMFSDriver::FSPutPage(FILE *file, uint64_t index, const uint8_t *data) {
+	if(data == NULL) return;
+
+	shareLock.Lock();
+
+	RAMFSSharedPage *entry = FindShared(data);
+	if(entry != NULL) DropShared(entry, true);
+
+	shareLock.Unlock();
+}
+
+FSNode *RAMFSDriver::FSCloneFile(FSNode *node, FSNode *directory, const char *name) {
+	if((node->flags & VFS_NODE_TYPE) != VFS_NODE_FILE) return NULL;
+
+	// Made before locking the source, the directory's lock comes before a file's
+	FSNode *cloneNode = CreateObject(directory, name, true, node->uid, node->gid, node->mask);
+	if(cloneNode == NULL) return NULL;
+
+	// Tagging the source's slots is a change too, nobody may write it meanwhile
+	RAMFSObject *source = LockNode(node, true);
+	if(source == NULL) {
+		// Deleted in the meantime, so is the clone
+		FSDeleteFile(cloneNode);
+		VFS::PutNode(cloneNode);
+		return NULL;
+	}
+
+	RAMFSObject *clone = LockNode(cloneNode, true);
+	if(clone == NULL) {
+		source->lock.Unlock();
+		VFS::PutNode(cloneNode);
+		return NULL;
+	}
+
+	uint64_t pages = (source->length + VFS_PAGE_SIZE - 1) >> VFS_PAGE_SHIFT;
+	uint64_t index;
+
+	for (index = 0; index < pages; index++) {
+		void **from = GetFileSlot(source, index, false);
+		if(from == NULL || *from == NULL) continue;
+		if(UncompressSlot(from) == NULL) break;
+
+		void **to = GetFileSlot(clone, index, true);
+		if(to == NULL) break;
+
+		shareLock.Lock();
+
+		RAMFSSharedPage *entry = ShareSlot(from);
+		if(entry != NULL && !entry->writable) RefShared(entry, to);
+		else if(entry != NULL) {
+			// Somebody is writing it through a mapping, the clone gets the data as it is now
+			uint8_t *copy = (uint8_t*)PMM::RequestPage();
+			if(copy != NULL) {
+				memcpy(copy, entry->page, VFS_PAGE_SIZE);
+				__atomic_store_n(to, (void*)copy, __ATOMIC_RELEASE);
+				__atomic_add_fetch(&stats.residentPages, 1, __ATOMIC_RELAXED);
+				stats.copies++;
+			} else entry = NULL;
+		}
+
+		shareLock.Unlock();
+
+		if(entry == NULL) break;
+	}
+
+	if(index < pages) {
+		// Out of memory, a clone missing pages isn't a clone. Deleting it gives back the ones it got
+		clone->lock.Unlock();
+		source->lock.Unlock();
+
+		FSDeleteFile(cloneNode);
+		VFS::PutNode(cloneNode);
+		return NULL;
+	}
+
+	__atomic_store_n(&clone->length, source->length, __ATOMIC_RELEASE);
+	clone->node->size = source->length;
 
-			delete[] inodeTable[file->node->inode]->fileData;
-			inodeTable[file->node->inode]->fileData = new uint8_t[offset+size];
-			memset(inodeTable[file->node->inode]->fileData, 0, offset+size);
+	clone->lock.Unlock();
+	source->lock.Unlock();
 
-			memcpy(inodeTable[file->node->inode]->fileData, tempBuffer, inodeTable[file->node->inode]->length);
-			//inodeTable[file->node->inode]->length = offset + size;
+	shareLock.Lock();
+	stats.clones++;
+	shareLock.Unlock();
 
-			delete[] tempBuffer;
+	// Remember to give this back with VFS::PutNode!
+	return cloneNode;
+}
+
+uint64_t RAMFSDriver::FSDedupFile(FSNode *node) {
+	RAMFSObject *object = LockNode(node, true);
+	if(object == NULL) return 0;
+
+	uint64_t pages = (object->length + VFS_PAGE_SIZE - 1) >> VFS_PAGE_SHIFT;
+	uint64_t given = 0;
+
+	for (uint64_t index = 0; index < pages; index++) {
+		void **slot = GetFileSlot(object, index, false);
+		if(slot == NULL || *slot == NULL) continue;
+
+		// Cold pages are better off compressed
+		if((uint64_t)*slot & RAMFS_PAGE_COMPRESSED) continue;
+
+		// Hashed before taking the table, we hold the only lock that lets anyone change it
+		uint8_t *page = RAMFS_SLOT_PAGE(*slot);
+		uint64_t hash = HashPage(page);
+
+		shareLock.Lock();
+
+		RAMFSSharedPage *entry = ShareSlot(slot);
+		if(entry != NULL && !entry->indexed && !entry->writable) {
+			RAMFSSharedPage *match = sharedByContent[hash & (RAMFS_SHARE_BUCKETS - 1)];
+			while (match != NULL && (match->contentHash != hash || memcmp(match->page, page, VFS_PAGE_SIZE) != 0)) {
+				match = match->contentNext;
+			}
+
+			if(match != NULL) {
+				// Readers either see the old page or the new one, they're the same
+				RefShared(match, slot);
+				DropShared(entry, false);
+
+				stats.deduped++;
+				given++;
+			} else {
+				entry->contentHash = hash;
+				entry->indexed = true;
+				entry->contentNext = sharedByContent[hash & (RAMFS_SHARE_BUCKETS - 1)];
+				sharedByContent[hash & (RAMFS_SHARE_BUCKETS - 1)] = entry;
+			}
 		}
+
+		shareLock.Unlock();
 	}
 
-	uint64_t length = (offset - inodeTable[file->node->inode]->length) > 0 ?
-		(offset - inodeTable[file->node->inode]->length) :
-		0;
-	length += size;
-	file->node->size = inodeTable[file->node->inode]->length = length;
-	memcpy(inodeTable[file->node->inode]->fileData + offset, buffer, size);
+	object->lock.Unlock();
 
-	file->bufferPos = offset + size;
+	return given;
+}
+
+uint64_t RAMFSDriver::FSWriteFile(FILE *file, uint64_t offset, size_t size, uint8_t *buffer) {
+	FSIOVec vector;
+	vector.buffer = buffer;
+	vector.length = size;
+
+	uint64_t done = FSWriteFileV(file, offset, &vector, 1);
+
+	file->bufferPos = offset + done;
 
 	return file->bufferPos;
 }
 
+uint64_t RAMFSDriver::FSWriteFileV(FILE *file, uint64_t offset, const FSIOVec *vectors, size_t count) {
+	if(file->node == NULL) return 0;
+	RAMFSObject *object = LockNode(file->node, true);
+	if(object == NULL) return 0;
+
+	// Only the pages that are written get allocated, whatever lies before stays a hole
+	uint64_t position = offset;
+	uint64_t pageIndex = RAMFS_NO_INODE;
+	uint8_t *page = NULL;
+
+	for (size_t i = 0; i < count; i++) {
+		size_t done = 0;
+		while (done < vectors[i].length) {
+			uint64_t pageOffset = position & (VFS_PAGE_SIZE - 1);
+			size_t chunk = VFS_PAGE_SIZE - pageOffset;
+			if(chunk > vectors[i].length - done) chunk = vectors[i].length - done;
+
+			if(position >> VFS_PAGE_SHIFT != pageIndex) {
+				pageIndex = position >> VFS_PAGE_SHIFT;
+				page = GetFilePage(object, pageIndex, true);
+			}
+
+			if(page == NULL) break;
+
+			memcpy(page + pageOffset, vectors[i].buffer + done, chunk);
+			done += chunk;
+			position += chunk;
+		}
+
+		// Out of memory, the write stops here
+		if(done < vectors[i].length) break;
+	}
+
+	// Readers that see the new length have to see the data too
+	if(position > object->length) __atomic_store_n(&object->length, position, __ATOMIC_RELEASE);
+	file->node->size = object->node->size = object->length;
+
+	object->lock.Unlock();
+
+	return position - offset;
+}
+
 FILE *RAMFSDriver::FSOpenFile(FSNode *node, uint64_t descriptor) {
-	FILE *file = new FILE;
+	FILE *file = VFS::AllocFile();
+	if(file == NULL) return NULL;
+
 	file->node = node;
+	file->buffer = NULL;
 	file->descriptor = descriptor;
+	file->bufferSize = file->bufferPos = 0;
 	return file;
 }
 
 void RAMFSDriver::FSCloseFile(FILE *file) {
-	delete file;
+	VFS::FreeFile(file);
 }
 
-uint64_t RAMFSDriver::FSDeleteFile(FSNode *node) {
+uint64_t RAMFSDriver::DeleteObject(FSNode *node, bool isFile) {
+	uint64_t token = RCU::ReadLock();
+
+	// Its directory can't go while it has the object in it, and neither of them is freed while we're here
+	RAMFSObject *object = GetNodeObject(node);
+	if(object == NULL || object->isFile != isFile || object->parent == NULL) {
+		RCU::ReadUnlock(token);
+		return 1;
+	}
+
+	RAMFSObject *directory = object->parent;
+	if(!LockObject(directory)) {
+		RCU::ReadUnlock(token);
+		return 1;
+	}
+
+	if(!LockObject(object)) {
+		directory->lock.Unlock();
+		RCU::ReadUnlock(token);
+		return 1;
+	}
+
+	RCU::ReadUnlock(token);
+
+	// Only empty directories, nothing could reach their entries anymore
+	if(!isFile && object->dirElements != 0) {
+		object->lock.Unlock();
+		directory->lock.Unlock();
+		return 1;
+	}
 
+	// Readers standing on the object still find their way along both chains.
+	// Lookups on the directory have to start over, their walk is bounded by the number of entries
+	directory->seq.WriteBegin();
+
+	if(object->prevObject != NULL) __atomic_store_n(&object->prevObject->nextObject, object->nextObject, __ATOMIC_RELEASE);
+	else __atomic_store_n(&directory->firstObject, object->nextObject, __ATOMIC_RELEASE);
+	if(object->nextObject != NULL) object->nextObject->prevObject = object->prevObject;
+
+	RAMFSDirIndex *index = directory->dirIndex;
+	RAMFSObject **link = &index->buckets[object->node->name.hash & (index->size - 1)];
+	while (*link != object) link = &(*link)->hashNext;
+	__atomic_store_n(link, object->hashNext, __ATOMIC_RELEASE);
+
+	__atomic_store_n(&directory->dirElements, directory->dirElements - 1, __ATOMIC_RELAXED);
+
+	directory->seq.WriteEnd();
+
+	directory->lock.Unlock();
+
+	// From now on GetObject doesn't find it, and the inode can be reused
+	FreeInode(node->inode);
+	DestroyObject(object);
+
+	return 0;
+}
+
+uint64_t RAMFSDriver::FSDeleteFile(FSNode *node) {
+	return DeleteObject(node, true);
 }
 
 FSNode *RAMFSDriver::FSReadDir(FSNode *node, uint64_t index) {
-	if(node->inode > maxInodes) return 0;
-	if(inodeTable[node->inode] == NULL) return 0;
-	if(inodeTable[node->inode]->firstObject == NULL) return 0;
-	if(inodeTable[node->inode]->isFile == true) return 0;
+	uint64_t token = RCU::ReadLock();
+
+	RAMFSObject *directory = GetNodeObject(node);
+	if(directory == NULL || directory->isFile == true) {
+		RCU::ReadUnlock(token);
+		return 0;
+	}
 
-	RAMFSObject *directoryEntry = inodeTable[node->inode]->firstObject;
+	// New entries are published at the head with a release store, so the chain can be walked as is
+	RAMFSObject *directoryEntry = __atomic_load_n(&directory->firstObject, __ATOMIC_ACQUIRE);
 
-	for (int i = 0; i < index; i++) {
-		if (directoryEntry->nextObject == NULL) return 0;
-		directoryEntry = directoryEntry->nextObject;
+	for (uint64_t i = 0; i < index && directoryEntry != NULL; i++) {
+		directoryEntry = __atomic_load_n(&directoryEntry->nextObject, __ATOMIC_ACQUIRE);
 	}
 
-	FSNode *entry = (FSNode*)Malloc(sizeof(FSNode)); // Remember to deallocate this!
+	// Remember to give this back with VFS::PutNode!
+	FSNode *result = directoryEntry != NULL ? VFS::TryRefNode(directoryEntry->node) : NULL;
 
-	strcpy(entry->name, directoryEntry->name);
-	entry->mask = directoryEntry->node->mask;
-	entry->uid = directoryEntry->node->uid;
-	entry->gid = directoryEntry->node->gid;
-	entry->flags = directoryEntry->node->flags;
-	entry->inode = directoryEntry->node->inode;
-	entry->size = directoryEntry->node->size;
-	entry->impl = directoryEntry->node->impl;
+	RCU::ReadUnlock(token);
+	return result;
+}
 
-	return entry;
+RAMFSObject *RAMFSDriver::IndexFind(RAMFSObject *directory, const FSNameKey *key) {
+	// Called in an RCU read section or with the directory locked
+	while (true) {
+		uint32_t start = directory->seq.ReadBegin();
+		RAMFSObject *found = NULL;
+
+		RAMFSDirIndex *index = __atomic_load_n(&directory->dirIndex, __ATOMIC_ACQUIRE);
+		if(index != NULL) {
+			RAMFSObject *directoryEntry = __atomic_load_n(&index->buckets[key->hash & (index->size - 1)], __ATOMIC_ACQUIRE);
+
+			// A rehash can send us around in circles, the walk is bounded and the seqcount tells us to retry
+			uint64_t steps = __atomic_load_n(&directory->dirElements, __ATOMIC_RELAXED) + 1;
+			while (directoryEntry != NULL && steps-- > 0) {
+				if (directoryEntry->node->name.Equals(key)) {
+					found = directoryEntry;
+					break;
+				}
+
+				directoryEntry = __atomic_load_n(&directoryEntry->hashNext, __ATOMIC_ACQUIRE);
+			}
+		}
+
+		if(!directory->seq.ReadRetry(start)) return found;
+	}
 }
 
-FSNode *RAMFSDriver::FSMakeDir(FSNode *node, const char *name, uint64_t uid, uint64_t gid, uint64_t mask) {
-	if(node->inode > maxInodes) return 0;
-	if(inodeTable[node->inode] == NULL) return 0;
-	if(inodeTable[node->inode]->isFile == true) return 0;
-
-	RAMFSObject *prevDirectoryEntry = inodeTable[node->inode]->firstObject;
-
-	if(prevDirectoryEntry == NULL) {
-		inodeTable[node->inode]->firstObject = (RAMFSObject*)Malloc(sizeof(RAMFSObject));
-		inodeTable[node->inode]->firstObject->magic = 0;
-		strcpy(inodeTable[node->inode]->firstObject->name, name);
-		inodeTable[node->inode]->firstObject->length = 0;
-		inodeTable[node->inode]->firstObject->isFile = false;
-		inodeTable[node->inode]->firstObject->firstObject = NULL;
-		inodeTable[node->inode]->firstObject->node = (FSNode*)Malloc(sizeof(FSNode));
-		strcpy(inodeTable[node->inode]->firstObject->node->name, name);
-		inodeTable[node->inode]->firstObject->node->mask = mask;
-		inodeTable[node->inode]->firstObject->node->uid = uid;
-		inodeTable[node->inode]->firstObject->node->gid = gid;
-		inodeTable[node->inode]->firstObject->node->size = inodeTable[node->inode]->firstObject->node->impl = 0;
-		inodeTable[node->inode]->firstObject->node->flags = VFS_NODE_DIRECTORY;
-		inodeTable[node->inode]->firstObject->node->inode = currentInode;
-		inodeTable[node->inode]->firstObject->nextObject = NULL;
-		inodeTable[currentInode++] = inodeTable[node->inode]->firstObject;
-
-		return inodeTable[currentInode-1]->node;
-	} else {
-		RAMFSObject *newDirectoryEntry;
+static void ReclaimIndex(RCUHead *head) {
+	Free((RAMFSDirIndex*)((uint8_t*)head - offsetof(RAMFSDirIndex, rcu)));
+}
 
-		newDirectoryEntry = (RAMFSObject*)Malloc(sizeof(RAMFSObject));
-		newDirectoryEntry->magic = 0;
-		strcpy(newDirectoryEntry->name, name);
-		newDirectoryEntry->length = 0;
-		newDirectoryEntry->isFile = false;
-		newDirectoryEntry->firstObject = NULL;
-		newDirectoryEntry->node = (FSNode*)Malloc(sizeof(FSNode));
-		strcpy(newDirectoryEntry->node->name, name);
-		newDirectoryEntry->node->mask = mask;
-		newDirectoryEntry->node->uid = uid;
-		newDirectoryEntry->node->gid = gid;
-		newDirectoryEntry->node->size = newDirectoryEntry->node->impl = 0;
-		newDirectoryEntry->node->flags = VFS_NODE_DIRECTORY;
-		newDirectoryEntry->node->inode = currentInode;
-		newDirectoryEntry->nextObject = prevDirectoryEntry;
+void RAMFSDriver::IndexInsert(RAMFSObject *directory, RAMFSObject *object) {
+	// Called with the directory locked
+	RAMFSDirIndex *index = directory->dirIndex;
+
+	// Keep at most one entry per bucket on average, doubling the index when it's full
+	if(index == NULL || directory->dirElements + 1 > index->size) {
+		uint64_t newSize = index == NULL ? RAMFS_DIR_INDEX_MIN : index->size * 2;
+		RAMFSDirIndex *newIndex = (RAMFSDirIndex*)Malloc(sizeof(RAMFSDirIndex) + sizeof(RAMFSObject*) * newSize);
+
+		newIndex->size = newSize;
+		for (uint64_t i = 0; i < newSize; i++) {
+			newIndex->buckets[i] = NULL;
+		}
 
-		inodeTable[currentInode++] = newDirectoryEntry;
-		inodeTable[node->inode]->firstObject = newDirectoryEntry;
+		// The entries are moved between chains, lookups on the old index have to start over
+		directory->seq.WriteBegin();
 
-		return inodeTable[currentInode-1]->node;
+		for (RAMFSObject *entry = directory->firstObject; entry != NULL; entry = entry->nextObject) {
+			uint64_t bucket = entry->node->name.hash & (newSize - 1);
+			__atomic_store_n(&entry->hashNext, newIndex->buckets[bucket], __ATOMIC_RELAXED);
+			newIndex->buckets[bucket] = entry;
+		}
+
+		__atomic_store_n(&directory->dirIndex, newIndex, __ATOMIC_RELEASE);
+
+		directory->seq.WriteEnd();
+
+		if(index != NULL) RCU::Retire(&index->rcu, ReclaimIndex);
+		index = newIndex;
 	}
+
+	uint64_t bucket = object->node->name.hash & (index->size - 1);
+	object->hashNext = index->buckets[bucket];
+	__atomic_store_n(&index->buckets[bucket], object, __ATOMIC_RELEASE);
+	__atomic_store_n(&directory->dirElements, directory->dirElements + 1, __ATOMIC_RELAXED);
+}
+
+FSNode *RAMFSDriver::CreateObject(FSNode *directoryNode, const char *name, bool isFile, uint64_t uid, uint64_t gid, uint64_t mask) {
+	FSNameKey key;
+	VFS::MakeNameKey(&key, name, strlen(name));
+
+	// Only this directory is locked, creations in other directories go on in parallel
+	RAMFSObject *directory = LockNode(directoryNode, false);
+	if(directory == NULL) return NULL;
+
+	// Names are unique inside a directory
+	if(IndexFind(directory, &key) != NULL) {
+		directory->lock.Unlock();
+		return NULL;
+	}
+
+	RAMFSObject *object = objectCache.Alloc();
+	if(object == NULL) {
+		directory->lock.Unlock();
+		return NULL;
+	}
+
+	object->node = VFS::AllocNode();
+	if(object->node == NULL || !object->node->name.Set(&key)) {
+		VFS::FreeNode(object->node);
+		objectCache.Free(object);
+		directory->lock.Unlock();
+		return NULL;
+	}
+
+	uint64_t inode = AllocInode(object);
+	if(inode == RAMFS_NO_INODE) {
+		VFS::FreeNode(object->node);
+		objectCache.Free(object);
+		directory->lock.Unlock();
+		return NULL;
+	}
+
+	object->magic = 0;
+	object->length = 0;
+	object->isFile = isFile;
+	object->firstObject = NULL;
+	object->pageTree = NULL;
+	object->pageTreeLevels = 0;
+	object->dirIndex = NULL;
+	object->dirElements = 0;
+	object->lock.locked = 0;
+	object->seq.sequence = 0;
+	object->deleted = false;
+	object->nextSequence = 0;
+
+	object->node->driver = this;
+	object->node->mask = mask;
+	object->node->uid = uid;
+	object->node->gid = gid;
+	object->node->size = object->node->impl = 0;
+	object->node->flags = isFile ? VFS_NODE_FILE : VFS_NODE_DIRECTORY;
+	object->node->inode = inode;
+	VFS::SetParent(object->node, directory->node);
+
+	// Indexed first: growing the index rehashes what's on the chain, the new object would go in twice
+	object->parent = directory;
+	IndexInsert(directory, object);
+
+	// The newest object goes at the head of the chain, ready before anyone can see it
+	object->sequence = __atomic_add_fetch(&directory->nextSequence, 1, __ATOMIC_RELEASE);
+	object->nextObject = directory->firstObject;
+	object->prevObject = NULL;
+	if(directory->firstObject != NULL) directory->firstObject->prevObject = object;
+	__atomic_store_n(&directory->firstObject, object, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&stats.objects, 1, __ATOMIC_RELAXED);
+
+	// Taken before the directory is unlocked, right after that the object could be deleted
+	FSNode *result = VFS::RefNode(object->node);
+
+	directory->lock.Unlock();
+
+	// Remember to give this back with VFS::PutNode!
+	return result;
+}
+
+FSNode *RAMFSDriver::FSMakeDir(FSNode *node, const char *name, uint64_t uid, uint64_t gid, uint64_t mask) {
+	return CreateObject(node, name, false, uid, gid, mask);
 }
 
 FSNode *RAMFSDriver::FSMakeFile(FSNode *node, const char *name, uint64_t uid, uint64_t gid, uint64_t mask) {
-	if(node->inode > maxInodes) return 0;
-	if(inodeTable[node->inode] == NULL) return 0;
-	if(inodeTable[node->inode]->isFile == true) return 0;
-
-	RAMFSObject *prevDirectoryEntry = inodeTable[node->inode]->firstObject;
-
-	if(prevDirectoryEntry == NULL) {
-		inodeTable[node->inode]->firstObject = (RAMFSObject*)Malloc(sizeof(RAMFSObject));
-		inodeTable[node->inode]->firstObject->magic = 0;
-		strcpy(inodeTable[node->inode]->firstObject->name, name);
-		inodeTable[node->inode]->firstObject->length = 0;
-		inodeTable[node->inode]->firstObject->isFile = true;
-		inodeTable[node->inode]->firstObject->fileData = NULL;
-		inodeTable[node->inode]->firstObject->node = (FSNode*)Malloc(sizeof(FSNode));
-		strcpy(inodeTable[node->inode]->firstObject->node->name, name);
-		inodeTable[node->inode]->firstObject->node->driver = this;
-		inodeTable[node->inode]->firstObject->node->mask = mask;
-		inodeTable[node->inode]->firstObject->node->uid = uid;
-		inodeTable[node->inode]->firstObject->node->gid = gid;
-		inodeTable[node->inode]->firstObject->node->size = inodeTable[node->inode]->firstObject->node->impl = 0;
-		inodeTable[node->inode]->firstObject->node->flags = VFS_NODE_FILE;
-		inodeTable[node->inode]->firstObject->node->inode = currentInode;
-		inodeTable[node->inode]->firstObject->nextObject = NULL;
-		inodeTable[currentInode++] = inodeTable[node->inode]->firstObject;
-
-		return inodeTable[currentInode-1]->node;
-	} else {
-		RAMFSObject *newDirectoryEntry;
-
-		newDirectoryEntry = (RAMFSObject*)Malloc(sizeof(RAMFSObject));
-		newDirectoryEntry->magic = 0;
-		strcpy(newDirectoryEntry->name, name);
-		newDirectoryEntry->length = 0;
-		newDirectoryEntry->isFile = true;
-		inodeTable[node->inode]->firstObject->fileData = NULL;
-		newDirectoryEntry->node = (FSNode*)Malloc(sizeof(FSNode));
-		strcpy(newDirectoryEntry->node->name, name);
-		newDirectoryEntry->node->mask = mask;
-		newDirectoryEntry->node->driver = this;
-		newDirectoryEntry->node->uid = uid;
-		newDirectoryEntry->node->gid = gid;
-		newDirectoryEntry->node->size = newDirectoryEntry->node->impl = 0;
-		newDirectoryEntry->node->flags = VFS_NODE_FILE;
-		newDirectoryEntry->node->inode = currentInode;
-		newDirectoryEntry->nextObject = prevDirectoryEntry;
-
-		inodeTable[currentInode++] = newDirectoryEntry;
-		inodeTable[node->inode]->firstObject = newDirectoryEntry;
-
-		return inodeTable[currentInode-1]->node;
-	}
-}
-
-FSNode *RAMFSDriver::FSFindDir(FSNode *node, const char *name) {
-	// This function is really sketchy. I will have to rewrite it.
-	if(node->inode > maxInodes) return 0;
-	if(inodeTable[node->inode] == NULL) return 0;
-	if(inodeTable[node->inode]->firstObject == NULL) return 0;
-	if(inodeTable[node->inode]->isFile == true) return 0;
-
-	RAMFSObject *directoryEntry = inodeTable[node->inode]->firstObject;
-	FSNode *entry = new FSNode; // Remember to deallocate this!
+	return CreateObject(node, name, true, uid, gid, mask);
+}
 
-	while (directoryEntry != NULL) {
-		if (strcmp(directoryEntry->name, name) == 0) {
-			strcpy(entry->name, directoryEntry->name);
-			entry->mask = directoryEntry->node->mask;
-			entry->uid = directoryEntry->node->uid;
-			entry->gid = directoryEntry->node->gid;
-			entry->flags = directoryEntry->node->flags;
-			entry->inode = directoryEntry->node->inode;
-			entry->size = directoryEntry->node->size;
-			entry->impl = directoryEntry->node->impl;
-
-			return entry;
-		}
-		directoryEntry = directoryEntry->nextObject;
+FSNode *RAMFSDriver::FSFindDir(FSNode *node, const FSNameKey *key) {
+	uint64_t token = RCU::ReadLock();
+
+	RAMFSObject *directory = GetNodeObject(node);
+	if(directory == NULL || directory->isFile == true) {
+		RCU::ReadUnlock(token);
+		return 0;
 	}
 
-	delete entry;
+	// Remember to give this back with VFS::PutNode!
+	RAMFSObject *directoryEntry = IndexFind(directory, key);
+	FSNode *result = directoryEntry != NULL ? VFS::TryRefNode(directoryEntry->node) : NULL;
 
-	return 0;
+	RCU::ReadUnlock(token);
+	return result;
 }
 
-uint64_t RAMFSDriver::FSGetDirElements(FSNode *node) {
-	if(node->inode > maxInodes) return 0;
-	if(inodeTable[node->inode] == NULL) return 0;
-	if(inodeTable[node->inode]->firstObject == NULL) return 0;
-	if(inodeTable[node->inode]->isFile == true) return 0;
+uint64_t RAMFSDriver::FSIterateDir(FSNode *node, uint64_t *cursor, VFSDirEntry *buffer, size_t bufferSize) {
+	uint64_t token = RCU::ReadLock();
 
-	RAMFSObject *directoryEntry = inodeTable[node->inode]->firstObject;
+	RAMFSObject *directory = GetNodeObject(node);
+	if(directory == NULL || directory->isFile == true) {
+		RCU::ReadUnlock(token);
+		return 0;
+	}
 
-	uint64_t elements = 0;
+	RAMFSObject *directoryEntry;
+
+	// The cursor has the inode of the next entry, so we can jump right back to it
+	if (*cursor == VFS_DIR_CURSOR_START) {
+		directoryEntry = __atomic_load_n(&directory->firstObject, __ATOMIC_ACQUIRE);
+	} else {
+		uint32_t sequence = *cursor >> 32;
+		directoryEntry = GetObject((*cursor & 0xFFFFFFFF) - 1);
+
+		// Deleted meanwhile, and maybe its inode went to something else. The chain is newest first,
+		// the first entry added before it is where to go on from. Its sequence number is the last
+		// one the directory gave out with the same low half
+		if(directoryEntry == NULL || directoryEntry->parent != directory ||
+		   __atomic_load_n(&directoryEntry->deleted, __ATOMIC_ACQUIRE) || (uint32_t)directoryEntry->sequence != sequence) {
+			uint64_t last = __atomic_load_n(&directory->nextSequence, __ATOMIC_ACQUIRE);
+			uint64_t stoppedAt = last - (uint32_t)(last - sequence);
+
+			directoryEntry = __atomic_load_n(&directory->firstObject, __ATOMIC_ACQUIRE);
+			while (directoryEntry != NULL && directoryEntry->sequence > stoppedAt) {
+				directoryEntry = __atomic_load_n(&directoryEntry->nextObject, __ATOMIC_ACQUIRE);
+			}
+		}
+	}
+
+	uint64_t used = 0;
 
 	while (directoryEntry != NULL) {
-		elements++;
-		directoryEntry = directoryEntry->nextObject;
+		if (VFS::PutDirEntry(buffer, bufferSize, &used,
+				     directoryEntry->node->inode, directoryEntry->node->flags,
+				     directoryEntry->node->name.Get(), directoryEntry->node->name.length) == NULL) break;
+
+		directoryEntry = __atomic_load_n(&directoryEntry->nextObject, __ATOMIC_ACQUIRE);
 	}
 
+	*cursor = directoryEntry == NULL ? VFS_DIR_CURSOR_END : RAMFS_DIR_CURSOR(directoryEntry->sequence, directoryEntry->node->inode);
+
+	RCU::ReadUnlock(token);
+	return used;
+}
+
+uint64_t RAMFSDriver::FSGetDirElements(FSNode *node) {
+	uint64_t token = RCU::ReadLock();
+
+	RAMFSObject *directory = GetNodeObject(node);
+	uint64_t elements = directory != NULL && directory->isFile == false ? __atomic_load_n(&directory->dirElements, __ATOMIC_RELAXED) : 0;
+
+	RCU::ReadUnlock(token);
 	return elements;
 }
 
 uint64_t RAMFSDriver::FSDeleteDir(FSNode *node) {
+	return DeleteObject(node, false);
+}
+
+namespace RAMFS {
+void GetStats(RAMFSStats *result) {
+	shareLock.Lock();
+	memcpy(result, &stats, sizeof(RAMFSStats));
+	shareLock.Unlock();
+}
+
+uint64_t CompressorTick(uint64_t budget) {
+#ifdef CONFIG_FS_RAMFS_COMPRESSION
+	// Somebody else is compressing already
+	if(!compressorLock.TryLock()) return 0;
+
+	uint64_t compressed = 0;
 
+	driversLock.Lock();
+	uint64_t mounts = driverCount;
+	driversLock.Unlock();
+
+	// Round robin from where the last tick stopped, each mount at most once
+	for (uint64_t visited = 0; visited < mounts && budget > 0; visited++) {
+		driversLock.Lock();
+
+		if(compressDriver == NULL) compressDriver = drivers;
+		RAMFSDriver *driver = compressDriver;
+		if(driver == NULL) {
+			driversLock.Unlock();
+			break;
+		}
+
+		// The reference keeps FSDelete waiting, no lock is held while compressing
+		driver->compressorRefs++;
+		driversLock.Unlock();
+
+		bool swept = driver->CompressPages(&budget, &compressed);
+
+		driversLock.Lock();
+
+		// The next mount gets its turn once this one is swept, until then the next tick goes on here
+		if(swept && compressDriver == driver) compressDriver = driver->nextDriver;
+		driver->compressorRefs--;
+
+		driversLock.Unlock();
+	}
+
+	compressorLock.Unlock();
+
+	return compressed;
+#else
+	return 0;
+#endif
+}
 }
@@ -0,0 +1,163 @@
+#include <fs/sync.hpp>
+
+/* RCUReaders
+ *  The readers of a CPU in the even and odd epochs, on a line of their own
+ */
+struct RCUReaders {
+	uint64_t count[2];
+} __attribute__((aligned(64)));
+
+static uint64_t epoch;               // The current epoch
+static RCUReaders readers[SYNC_MAX_CPUS];
+static SpinLock retireLock;          // Protects the list below and moving the epoch
+static RCUHead *retiredHead;         // Retired objects, oldest first
+static RCUHead *retiredTail;
+static uint64_t reclaimPhase;        // Which of the counters below batches taken now go on
+static uint64_t reclaimers[2];       // Batches taken off the list and still being reclaimed
+
+namespace RCU {
+uint64_t ReadLock() {
+	// The token says which counter we're on: we could be moved to another CPU before ReadUnlock
+	uint64_t cpu = CurrentCPU() & (SYNC_MAX_CPUS - 1);
+
+	while (true) {
+		uint64_t current = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&readers[cpu].count[current & 1], 1, __ATOMIC_SEQ_CST);
+
+		// If the epoch moved on meanwhile we may be counted where nobody looks anymore
+		if (__atomic_load_n(&epoch, __ATOMIC_SEQ_CST) == current) return (cpu << 1) | (current & 1);
+
+		__atomic_sub_fetch(&readers[cpu].count[current & 1], 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+void ReadUnlock(uint64_t token) {
+	__atomic_sub_fetch(&readers[token >> 1].count[token & 1], 1, __ATOMIC_RELEASE);
+}
+
+static bool HasReaders(uint64_t parity) {
+	for (uint64_t cpu = 0; cpu < SYNC_MAX_CPUS; cpu++) {
+		if (__atomic_load_n(&readers[cpu].count[parity], __ATOMIC_SEQ_CST) != 0) return true;
+	}
+
+	return false;
+}
+
+static RCUHead *Collect(uint64_t *phase) {
+	// Called with the lock taken. The readers of the epoch before this one share
+	// its counter with the next one, so once it drops to zero we can move on
+	uint64_t current = epoch;
+	if (!HasReaders((current + 1) & 1)) {
+		__atomic_store_n(&epoch, current + 1, __ATOMIC_SEQ_CST);
+		current++;
+	}
+
+	RCUHead *ready = retiredHead;
+	RCUHead *last = NULL;
+
+	for (RCUHead *head = retiredHead; head != NULL && head->epoch + 2 <= current; head = head->next) last = head;
+	if (last == NULL) return NULL;
+
+	retiredHead = last->next;
+	if (retiredHead == NULL) retiredTail = NULL;
+	last->next = NULL;
+
+	// Counted until it's reclaimed, for Barrier
+	*phase = reclaimPhase;
+	__atomic_add_fetch(&reclaimers[*phase], 1, __ATOMIC_RELAXED);
+
+	return ready;
+}
+
+static void Reclaim(RCUHead *ready, uint64_t phase) {
+	// Outside the lock, reclaiming an object can retire others
+	if (ready == NULL) return;
+
+	while (ready != NULL) {
+		RCUHead *next = ready->next;
+		ready->reclaim(ready);
+		ready = next;
+	}
+
+	__atomic_sub_fetch(&reclaimers[phase], 1, __ATOMIC_RELEASE);
+}
+
+void Retire(RCUHead *head, void (*reclaim)(RCUHead *head)) {
+	head->next = NULL;
+	head->reclaim = reclaim;
+
+	retireLock.Lock();
+
+	head->epoch = epoch;
+	if (retiredTail != NULL) retiredTail->next = head;
+	else retiredHead = head;
+	retiredTail = head;
+
+	uint64_t phase;
+	RCUHead *ready = Collect(&phase);
+
+	retireLock.Unlock();
+
+	Reclaim(ready, phase);
+}
+
+void Poll() {
+	uint64_t phase;
+
+	retireLock.Lock();
+	RCUHead *ready = Collect(&phase);
+	retireLock.Unlock();
+
+	Reclaim(ready, phase);
+}
+
+struct RCUWaiter {
+	RCUHead head;
+	bool done;
+};
+
+static void Wake(RCUHead *head) {
+	RCUWaiter *waiter = (RCUWaiter*)((uint8_t*)head - offsetof(RCUWaiter, head));
+	__atomic_store_n(&waiter->done, true, __ATOMIC_RELEASE);
+}
+
+static void WaitRetired() {
+	// Whatever is retired now is reclaimed once the readers that could see it are gone,
+	// and after everything retired before it
+	RCUWaiter waiter;
+	waiter.done = false;
+	Retire(&waiter.head, Wake);
+
+	while (!__atomic_load_n(&waiter.done, __ATOMIC_ACQUIRE)) {
+		Poll();
+		CPURelax();
+	}
+}
+
+void Synchronize() {
+	WaitRetired();
+}
+
+void Barrier() {
+	// What was retired before this was taken off the list with the sentinel or before it,
+	// not only what comes after: others could be retiring all along
+	WaitRetired();
+
+	// Other CPUs may still be reclaiming the batches taken before the sentinel's. New batches
+	// go on the other counter from now on, so only those are waited for
+	retireLock.Lock();
+
+	while (__atomic_load_n(&reclaimers[reclaimPhase ^ 1], __ATOMIC_ACQUIRE) != 0) {
+		retireLock.Unlock();
+		CPURelax();
+		retireLock.Lock();
+	}
+
+	uint64_t phase = reclaimPhase;
+	reclaimPhase ^= 1;
+
+	retireLock.Unlock();
+
+	while (__atomic_load_n(&reclaimers[phase], __ATOMIC_ACQUIRE) != 0) CPURelax();
+}
+}
@@ -0,0 +1,389 @@
+#include <fs/sysfs/sysfs.hpp>
+#include <fs/procfs/procfs.hpp>
+#include <dev/pci/pci.hpp>
+#include <mm/string.hpp>
+#include <mm/pmm.hpp>
+
+static const char *attributeNames[SYSFS_ATTR_COUNT] = {
+	"info", "vendor", "device", "class", "subclass", "progif", "revision",
+	"irq_line", "irq_pin", "bar0", "bar1", "bar2", "bar3", "bar4", "bar5"
+};
+
+static PCI::PCIFunction *FindFunction(uint64_t bus, uint64_t slot) {
+	PCI::PCIBus *pciBus = PCI::GetBus(bus);
+	if(pciBus == NULL) return NULL;
+
+	PCI::PCIDevice *device = pciBus->GetDevice(slot >> 3);
+	if(device == NULL) return NULL;
+
+	return device->GetFunction(slot & 0x7);
+}
+
+static bool HasAttribute(PCI::PCIFunction *function, uint64_t attribute) {
+	if(attribute >= SYSFS_ATTR_COUNT) return false;
+	if(attribute < SYSFS_ATTR_BAR0) return true;
+
+	// Only type 0 headers have all six BARs where PCIHeader0 says
+	return (function->GetHeader()->HeaderType & 0x7F) == 0;
+}
+
+static void PutSlot(ProcFSWriter *writer, uint64_t bus, uint64_t slot) {
+	char name[] = "00:00.0";
+	const char *hex = "0123456789abcdef";
+
+	name[0] = hex[bus >> 4];
+	name[1] = hex[bus & 0xF];
+	name[3] = hex[(slot >> 3) >> 4];
+	name[4] = hex[(slot >> 3) & 0xF];
+	name[6] = '0' + (slot & 0x7);
+
+	writer->Put(name);
+}
+
+static void PutAttribute(ProcFSWriter *writer, PCI::PCIFunction *function, uint64_t attribute) {
+	PCI::PCIDeviceHeader *header = function->GetHeader();
+	PCI::PCIHeader0 *header0 = (PCI::PCIHeader0*)header;
+
+	switch (attribute) {
+		case SYSFS_ATTR_VENDOR:
+			writer->PutHex(header->VendorID);
+			break;
+		case SYSFS_ATTR_DEVICE:
+			writer->PutHex(header->DeviceID);
+			break;
+		case SYSFS_ATTR_CLASS:
+			writer->PutHex(header->Class);
+			break;
+		case SYSFS_ATTR_SUBCLASS:
+			writer->PutHex(header->Subclass);
+			break;
+		case SYSFS_ATTR_PROGIF:
+			writer->PutHex(header->ProgIF);
+			break;
+		case SYSFS_ATTR_REVISION:
+			writer->PutHex(header->RevisionID);
+			break;
+		case SYSFS_ATTR_IRQ_LINE:
+			writer->PutNumber(header0->InterruptLine);
+			break;
+		case SYSFS_ATTR_IRQ_PIN:
+			writer->PutNumber(header0->InterruptPin);
+			break;
+		default: {
+			// The BARs are laid out one after the other
+			uint32_t *bars = &header0->BAR0;
+			writer->PutHex(bars[attribute - SYSFS_ATTR_BAR0]);
+			break;
+		}
+	}
+}
+
+void SysFSDriver::FSInit(FSNode *mountpoint) {
+	// Attributes are read when they're opened, each open file has its own size
+	driverFlags = FS_DRIVER_SNAPSHOT;
+	nodeLock.locked = 0;
+	for (int i = 0; i < SYSFS_NODE_BUCKETS; i++) {
+		nodes[i] = NULL;
+	}
+
+	rootNode = VFS::AllocNode();
+	if (mountpoint != NULL) rootNode->name.Copy(&mountpoint->name);
+	else {
+		FSNameKey key;
+		VFS::MakeNameKey(&key, "sysfs", 5);
+		rootNode->name.Set(&key);
+	}
+	rootNode->mask = rootNode->uid = rootNode->gid = rootNode->size = rootNode->impl = 0;
+	rootNode->flags = VFS_NODE_DIRECTORY;
+	rootNode->inode = SYSFS_INODE(SYSFS_NODE_ROOT, 0, 0, 0);
+}
+
+void SysFSDriver::FSDelete() {
+	for (int i = 0; i < SYSFS_NODE_BUCKETS; i++) {
+		FSNode *node = nodes[i];
+		while (node != NULL) {
+			FSNode *next = (FSNode*)node->impl;
+			VFS::ReleaseNode(node);
+			node = next;
+		}
+
+		nodes[i] = NULL;
+	}
+
+	if(rootNode != NULL) VFS::ReleaseNode(rootNode);
+	rootNode = NULL;
+}
+
+uint64_t SysFSDriver::GetName(uint64_t inode, char *name) {
+	switch (SYSFS_INODE_TYPE(inode)) {
+		case SYSFS_NODE_PCI:
+			strcpy(name, "pci");
+			break;
+		case SYSFS_NODE_FUNCTION: {
+			ProcFSWriter writer;
+			writer.buffer = name;
+			writer.size = 8;
+			writer.length = 0;
+			PutSlot(&writer, SYSFS_INODE_BUS(inode), SYSFS_INODE_SLOT(inode));
+			name[writer.length] = '\0';
+			break;
+		}
+		case SYSFS_NODE_ATTRIBUTE:
+			strcpy(name, attributeNames[SYSFS_INODE_ATTRIBUTE(inode)]);
+			break;
+		default:
+			name[0] = '\0';
+			break;
+	}
+
+	return strlen(name);
+}
+
+FSNode *SysFSDriver::GetNode(FSNode *parent, uint64_t inode) {
+	FSNode **bucket = &nodes[(inode ^ (inode >> 56)) & (SYSFS_NODE_BUCKETS - 1)];
+
+	nodeLock.Lock();
+
+	for (FSNode *node = *bucket; node != NULL; node = (FSNode*)node->impl) {
+		if(node->inode == inode) {
+			FSNode *result = VFS::RefNode(node);
+			nodeLock.Unlock();
+			return result;
+		}
+	}
+
+	char name[16];
+	FSNameKey key;
+	VFS::MakeNameKey(&key, name, GetName(inode, name));
+
+	FSNode *node = VFS::AllocNode();
+	if(node == NULL || !node->name.Set(&key)) {
+		if(node != NULL) VFS::ReleaseNode(node);
+		nodeLock.Unlock();
+		return NULL;
+	}
+
+	node->driver = this;
+	VFS::SetParent(node, parent);
+	node->uid = node->gid = node->size = 0;
+	node->inode = inode;
+
+	if(SYSFS_INODE_TYPE(inode) == SYSFS_NODE_ATTRIBUTE) {
+		node->flags = VFS_NODE_FILE;
+		node->mask = 0444;
+	} else {
+		node->flags = VFS_NODE_DIRECTORY;
+		node->mask = 0555;
+	}
+
+	// The table keeps the first reference
+	node->impl = (uint64_t)*bucket;
+	*bucket = node;
+
+	FSNode *result = VFS::RefNode(node);
+	nodeLock.Unlock();
+	return result;
+}
+
+bool SysFSDriver::NextChild(FSNode *node, uint64_t *cursor, uint64_t *inode) {
+	uint64_t position = *cursor;
+
+	switch (SYSFS_INODE_TYPE(node->inode)) {
+		case SYSFS_NODE_ROOT:
+			if(position > 0) return false;
+
+			*inode = SYSFS_INODE(SYSFS_NODE_PCI, 0, 0, 0);
+			*cursor = 1;
+			return true;
+		case SYSFS_NODE_PCI:
+			// The position is bus << 8 | slot, skipping what doesn't exist a bus or a device at a time
+			while (position < PCI_MAX_BUSES << 8) {
+				uint64_t bus = position >> 8;
+				uint64_t slot = position & 0xFF;
+
+				PCI::PCIBus *pciBus = PCI::GetBus(bus);
+				if(pciBus == NULL) {
+					position = (bus + 1) << 8;
+					continue;
+				}
+
+				if(pciBus->GetDevice(slot >> 3) == NULL) {
+					position = (position | 0x7) + 1;
+					continue;
+				}
+
+				if(FindFunction(bus, slot) != NULL) {
+					*inode = SYSFS_INODE(SYSFS_NODE_FUNCTION, bus, slot, 0);
+					*cursor = position + 1;
+					return true;
+				}
+
+				position++;
+			}
+
+			return false;
+		case SYSFS_NODE_FUNCTION: {
+			PCI::PCIFunction *function = FindFunction(SYSFS_INODE_BUS(node->inode), SYSFS_INODE_SLOT(node->inode));
+			if(function == NULL) return false;
+
+			for (; position < SYSFS_ATTR_COUNT; position++) {
+				if(!HasAttribute(function, position)) continue;
+
+				*inode = SYSFS_INODE(SYSFS_NODE_ATTRIBUTE, SYSFS_INODE_BUS(node->inode), SYSFS_INODE_SLOT(node->inode), position);
+				*cursor = position + 1;
+				return true;
+			}
+
+			return false;
+		}
+		default:
+			return false;
+	}
+}
+
+FILE *SysFSDriver::FSOpenFile(FSNode *node, uint64_t descriptor) {
+	if(SYSFS_INODE_TYPE(node->inode) != SYSFS_NODE_ATTRIBUTE) return NULL;
+
+	uint64_t bus = SYSFS_INODE_BUS(node->inode);
+	uint64_t slot = SYSFS_INODE_SLOT(node->inode);
+	uint64_t attribute = SYSFS_INODE_ATTRIBUTE(node->inode);
+
+	PCI::PCIFunction *function = FindFunction(bus, slot);
+	if(function == NULL) return NULL;
+
+	// Even info fits in a page with room to spare
+	ProcFSWriter writer;
+	writer.buffer = (char*)PMM::RequestPage();
+	if(writer.buffer == NULL) return NULL;
+	writer.size = VFS_PAGE_SIZE;
+	writer.length = 0;
+
+	if(attribute == SYSFS_ATTR_INFO) {
+		writer.Put("slot: ");
+		PutSlot(&writer, bus, slot);
+		writer.Put("\n");
+
+		for (uint64_t i = SYSFS_ATTR_INFO + 1; i < SYSFS_ATTR_COUNT; i++) {
+			if(!HasAttribute(function, i)) continue;
+
+			writer.Put(attributeNames[i]);
+			writer.Put(": ");
+			PutAttribute(&writer, function, i);
+			writer.Put("\n");
+		}
+	} else {
+		PutAttribute(&writer, function, attribute);
+		writer.Put("\n");
+	}
+
+	FILE *file = VFS::AllocFile();
+	if(file == NULL) {
+		PMM::FreePage(writer.buffer);
+		return NULL;
+	}
+
+	file->node = node;
+	file->buffer = (uint64_t*)writer.buffer;
+	file->descriptor = descriptor;
+	file->bufferSize = writer.length;
+	file->bufferPos = 0;
+
+	return file;
+}
+
+void SysFSDriver::FSCloseFile(FILE *file) {
+	if(file->buffer != NULL) PMM::FreePage(file->buffer);
+	VFS::FreeFile(file);
+}
+
+uint64_t SysFSDriver::FSReadFile(FILE *file, uint64_t offset, size_t size, uint8_t **buffer) {
+	if(file->buffer == NULL) return 0;
+	if(offset >= file->bufferSize) return 0;
+
+	if(size > file->bufferSize - offset) size = file->bufferSize - offset;
+	memcpy(*buffer + offset, (uint8_t*)file->buffer + offset, size);
+
+	file->bufferPos = offset + size;
+	return size;
+}
+
+uint64_t SysFSDriver::FSWriteFile(FILE *file, uint64_t offset, size_t size, uint8_t *buffer) {
+	// Read-only, for now
+	return 0;
+}
+
+uint64_t SysFSDriver::FSDeleteFile(FSNode *node) {
+	return 1;
+}
+
+FSNode *SysFSDriver::FSMakeFile(FSNode *node, const char *name, uint64_t uid, uint64_t gid, uint64_t mask) {
+	return NULL;
+}
+
+FSNode *SysFSDriver::FSMakeDir(FSNode *node, const char *name, uint64_t uid, uint64_t gid, uint64_t mask) {
+	return NULL;
+}
+
+uint64_t SysFSDriver::FSDeleteDir(FSNode *node) {
+	return 1;
+}
+
+FSNode *SysFSDriver::FSReadDir(FSNode *node, uint64_t index) {
+	uint64_t cursor = VFS_DIR_CURSOR_START;
+	uint64_t inode;
+
+	for (uint64_t i = 0; i <= index; i++) {
+		if(!NextChild(node, &cursor, &inode)) return NULL;
+	}
+
+	// Remember to give this back with VFS::PutNode!
+	return GetNode(node, inode);
+}
+
+FSNode *SysFSDriver::FSFindDir(FSNode *node, const FSNameKey *key) {
+	uint64_t cursor = VFS_DIR_CURSOR_START;
+	uint64_t inode;
+	char name[16];
+
+	while (NextChild(node, &cursor, &inode)) {
+		uint64_t length = GetName(inode, name);
+		if(length == key->length && memcmp(name, key->name, length) == 0) return GetNode(node, inode);
+	}
+
+	return NULL;
+}
+
+uint64_t SysFSDriver::FSIterateDir(FSNode *node, uint64_t *cursor, VFSDirEntry *buffer, size_t bufferSize) {
+	uint64_t used = 0;
+	uint64_t position = *cursor;
+	uint64_t inode;
+	char name[16];
+
+	// Entries come straight from the device tree, no node is made for them
+	while (true) {
+		uint64_t next = position;
+		if(!NextChild(node, &next, &inode)) {
+			position = VFS_DIR_CURSOR_END;
+			break;
+		}
+
+		uint32_t flags = SYSFS_INODE_TYPE(inode) == SYSFS_NODE_ATTRIBUTE ? VFS_NODE_FILE : VFS_NODE_DIRECTORY;
+		if (VFS::PutDirEntry(buffer, bufferSize, &used, inode, flags, name, GetName(inode, name)) == NULL) break;
+
+		position = next;
+	}
+
+	*cursor = position;
+
+	return used;
+}
+
+uint64_t SysFSDriver::FSGetDirElements(FSNode *node) {
+	uint64_t cursor = VFS_DIR_CURSOR_START;
+	uint64_t inode;
+	uint64_t count = 0;
+
+	while (NextChild(node, &cursor, &inode)) count++;
+
+	return count;
+}
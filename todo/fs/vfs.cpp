@@ -1,46 +1,417 @@
 #include <fs/vfs.hpp>
+#include <autoconf.h>
 #include <sys/printk.hpp>
 #include <mm/memory.hpp>
 #include <fs/ramfs/ramfs.hpp>
+#include <fs/ramfs/imagefs.hpp>
+#include <fs/procfs/procfs.hpp>
+#include <fs/sysfs/sysfs.hpp>
+#include <fs/dcache.hpp>
+#include <fs/pagecache.hpp>
+#include <fs/objcache.hpp>
+#include <fs/sync.hpp>
+#include <fs/vfsbench.hpp>
+#include <fs/pagecachetest.hpp>
 #include <mm/string.hpp>
+#include <mm/pmm.hpp>
 
 VFilesystem *rootfs;
 VFilesystem *sysfs;
 VFilesystem *procfs;
 VFilesystem *initrdfs;
 
+static VFilesystem *mountTable[VFS_MOUNT_BUCKETS];
+static VFilesystem *mounts;         // Every mounted filesystem
+static SpinLock mountLock;          // Taken by whoever changes the mounts
+
+static TypedObjectCache<FSNode> nodeCache;
+static TypedObjectCache<FILE> fileCache;
+
+static ProcFSDriver *procDriver;
+
+static SpinLock tickLock;           // Held by whoever is running the periodic work
+static uint64_t nextTick;           // When it's due again
+
+uint64_t FSDriver::FSReadFileV(FILE *file, uint64_t offset, const FSIOVec *vectors, size_t count) {
+	uint64_t done = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		// FSReadFile writes at buffer + offset
+		uint8_t *buffer = vectors[i].buffer - (offset + done);
+		uint64_t read = FSReadFile(file, offset + done, vectors[i].length, &buffer);
+
+		done += read;
+		if (read < vectors[i].length) break;
+	}
+
+	return done;
+}
+
+uint64_t FSDriver::FSWriteFileV(FILE *file, uint64_t offset, const FSIOVec *vectors, size_t count) {
+	uint64_t done = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		// FSWriteFile returns where it stopped writing
+		uint64_t end = FSWriteFile(file, offset + done, vectors[i].length, vectors[i].buffer);
+		uint64_t written = end > offset + done ? end - (offset + done) : 0;
+
+		done += written;
+		if (written < vectors[i].length) break;
+	}
+
+	return done;
+}
+
+uint64_t FSDriver::FSSubmitBatch(VFSBatchOp *ops, size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		if (ops[i].opcode == VFS_OP_READ) ops[i].result = FSReadFileV(ops[i].file, ops[i].offset, ops[i].vectors, ops[i].count);
+		else if (ops[i].opcode == VFS_OP_WRITE) ops[i].result = FSWriteFileV(ops[i].file, ops[i].offset, ops[i].vectors, ops[i].count);
+		else ops[i].result = 0;
+	}
+
+	return count;
+}
+
+static void PutPath(ProcFSWriter *writer, FSNode *node) {
+	// Collect the names up to the real root, crossing the mounts on the way
+	FSNode *path[32];
+	int depth = 0;
+
+	while (node != NULL && depth < 32) {
+		if (node->parent == NULL) {
+			if (node->driver == NULL || node->driver->mount == NULL) break;
+			node = node->driver->mount->mountdir;
+			continue;
+		}
+
+		path[depth++] = node;
+		node = node->parent;
+	}
+
+	if (depth == 0) writer->Put("/");
+
+	while (depth > 0) {
+		writer->Put("/");
+		writer->Put(path[--depth]->name.Get());
+	}
+}
+
+static void ProcMounts(ProcFSWriter *writer, void *context) {
+	mountLock.Lock();
+
+	for (VFilesystem *fs = mounts; fs != NULL; fs = fs->next) {
+		PutPath(writer, fs->mountdir);
+		writer->Put(" ");
+		writer->PutNumber(fs->flags);
+		writer->Put("\n");
+	}
+
+	mountLock.Unlock();
+}
+
+static void ProcDCache(ProcFSWriter *writer, void *context) {
+	DCacheStats stats;
+	DCache::GetStats(&stats);
+
+	writer->PutField("hits", stats.hits);
+	writer->PutField("negativeHits", stats.negativeHits);
+	writer->PutField("misses", stats.misses);
+	writer->PutField("evictions", stats.evictions);
+	writer->PutField("entries", stats.entries);
+}
+
+static void ProcPageCache(ProcFSWriter *writer, void *context) {
+	PageCacheStats stats;
+	PageCache::GetStats(&stats);
+
+	writer->PutField("hits", stats.hits);
+	writer->PutField("misses", stats.misses);
+	writer->PutField("readErrors", stats.readErrors);
+	writer->PutField("evictions", stats.evictions);
+	writer->PutField("writebacks", stats.writebacks);
+	writer->PutField("writeErrors", stats.writeErrors);
+	writer->PutField("flushes", stats.flushes);
+	writer->PutField("pages", stats.pages);
+	writer->PutField("dirtyPages", stats.dirtyPages);
+	writer->PutField("dirtyInodes", stats.dirtyInodes);
+	writer->PutField("expired", stats.expired);
+	writer->PutField("throttled", stats.throttled);
+	writer->PutField("prefetched", stats.prefetched);
+	writer->PutField("prefetchHits", stats.prefetchHits);
+}
+
+static void ProcObjectCaches(ProcFSWriter *writer, void *context) {
+	// One line per cache: name, object size, slabs, objects, in use, free in magazines, free in the depot, slabs reclaimed
+	for (ObjectCache *cache = ObjectCache::First(); cache != NULL; cache = cache->Next()) {
+		ObjectCacheStats stats;
+		cache->GetStats(&stats);
+
+		writer->Put(stats.name);
+		uint64_t values[] = { stats.objectSize, stats.slabs, stats.objects, stats.inUse, stats.inMagazines, stats.inDepot, stats.reclaimed };
+		for (uint64_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+			writer->Put(" ");
+			writer->PutNumber(values[i]);
+		}
+		writer->Put("\n");
+	}
+}
+
+static void ProcRAMFS(ProcFSWriter *writer, void *context) {
+	RAMFSStats stats;
+	RAMFS::GetStats(&stats);
+
+	writer->PutField("objects", stats.objects);
+	writer->PutField("residentPages", stats.residentPages);
+	writer->PutField("sharedPages", stats.sharedPages);
+	writer->PutField("savedPages", stats.savedPages);
+	writer->PutField("clones", stats.clones);
+	writer->PutField("copies", stats.copies);
+	writer->PutField("deduped", stats.deduped);
+
+	// The ratio is what the compressed pages take, in percent of what they'd take uncompressed
+	writer->PutField("compressedPages", stats.compressedPages);
+	writer->PutField("compressedBytes", stats.compressedBytes);
+	writer->PutField("compressionRatio", stats.compressedPages == 0 ? 0 : stats.compressedBytes * 100 / (stats.compressedPages * VFS_PAGE_SIZE));
+	writer->PutField("compressions", stats.compressions);
+	writer->PutField("decompressions", stats.decompressions);
+	writer->PutField("decompressCycles", stats.decompressions == 0 ? 0 : stats.decompressCycles / stats.decompressions);
+	writer->PutField("decompressErrors", stats.decompressErrors);
+	writer->PutField("incompressible", stats.incompressible);
+}
+
+namespace ProcFS {
+bool Register(const char *name, ProcFSGenerator generator, void *context) {
+	if (procDriver == NULL) return false;
+
+	return procDriver->Register(name, generator, context);
+}
+}
+
 namespace VFS {
-void ListDir(FSNode *dir) {
-	if (dir == NULL) return;
-	uint64_t dirElements = dir->driver->FSGetDirElements(dir);
-	if (dirElements == 0) return;
+uint64_t ListDir(FSNode *dir, void (*callback)(const VFSDirEntry *entry, void *context), void *context) {
+	if (dir == NULL || callback == NULL) return 0;
+	if (dir->driver == NULL) return 0;
+
+	VFSDirEntry *buffer = (VFSDirEntry*)Malloc(VFS_LIST_BUFFER);
+	if (buffer == NULL) return 0;
+
+	uint64_t cursor = VFS_DIR_CURSOR_START;
+	uint64_t count = 0;
 
-	PRINTK::PrintK("Listing %s...\r\n", dir->name);
-	for (int i = 0; i < dirElements; i++) {
-		FSNode *element = dir->driver->FSReadDir(dir, i);
-		PRINTK::PrintK(" - %s\r\n", element->name);
+	while (cursor != VFS_DIR_CURSOR_END) {
+		uint64_t used = dir->driver->FSIterateDir(dir, &cursor, buffer, VFS_LIST_BUFFER);
+		if (used == 0) break;
+
+		for (uint64_t offset = 0; offset < used; count++) {
+			VFSDirEntry *entry = (VFSDirEntry*)((uint8_t*)buffer + offset);
+			callback(entry, context);
+			offset += entry->recordLength;
+		}
+	}
+
+	Free(buffer);
+	return count;
+}
+
+uint64_t HashName(const char *name, size_t length) {
+	// FNV-1a, it's quick and spreads short names well enough
+	uint64_t hash = 0xCBF29CE484222325;
+
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (uint8_t)name[i];
+		hash *= 0x100000001B3;
 	}
+
+	return hash;
+}
+
+void MakeNameKey(FSNameKey *key, const char *name, size_t length) {
+	key->name = name;
+	key->length = length;
+	key->hash = HashName(name, length);
+}
+
+FSNode *AllocNode() {
+	// The caller gets the first reference, the driver's own: it gives it back with ReleaseNode
+	FSNode *node = nodeCache.Alloc();
+	if (node == NULL) return NULL;
+
+	node->refCount = 1;
+	node->driver = NULL;
+	node->parent = NULL;
+	node->name.Clear();
+
+	return node;
+}
+
+static void ReclaimNode(RCUHead *head) {
+	FSNode *node = (FSNode*)((uint8_t*)head - offsetof(FSNode, rcu));
+
+	node->name.Release();
+	nodeCache.Free(node);
+}
+
+void FreeNode(FSNode *node) {
+	if (node == NULL) return;
+
+	// A lookup could have found it just before the last reference went away
+	RCU::Retire(&node->rcu, ReclaimNode);
 }
 
+static inline void CountHold(FSNode *node, bool taken) {
+	// Each CPU counts on its own line, lookups on different CPUs don't fight over the driver
+	if (node->driver == NULL) return;
+
+	FSNodeHolds *holds = &node->driver->holds[CurrentCPU() & (SYNC_MAX_CPUS - 1)];
+	if (taken) __atomic_add_fetch(&holds->taken, 1, __ATOMIC_RELAXED);
+	else __atomic_add_fetch(&holds->given, 1, __ATOMIC_RELEASE);
+}
+
+static uint64_t HeldNodes(FSDriver *driver) {
+	// Given back first, then taken: a reference given back that we count was taken before,
+	// so it's counted too, and a node held the whole time can't look free
+	uint64_t given = 0;
+	uint64_t taken = 0;
+
+	for (int i = 0; i < SYNC_MAX_CPUS; i++) given += __atomic_load_n(&driver->holds[i].given, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < SYNC_MAX_CPUS; i++) taken += __atomic_load_n(&driver->holds[i].taken, __ATOMIC_ACQUIRE);
+
+	return taken - given;
+}
+
+FSNode *RefNode(FSNode *node) {
+	if (node == NULL) return NULL;
+
+	__atomic_add_fetch(&node->refCount, 1, __ATOMIC_RELAXED);
+	CountHold(node, true);
+
+	return node;
+}
+
+FSNode *TryRefNode(FSNode *node) {
+	// For lock-free lookups, inside an RCU read section: a node that is being freed stays dead
+	if (node == NULL) return NULL;
+
+	uint64_t count = __atomic_load_n(&node->refCount, __ATOMIC_RELAXED);
+	do {
+		if (count == 0) return NULL;
+	} while (!__atomic_compare_exchange_n(&node->refCount, &count, count + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+	CountHold(node, true);
+	return node;
+}
+
+void ReleaseNode(FSNode *node) {
+	// A node holds a reference to its parent, the last one to go gives it back too
+	while (node != NULL && __atomic_sub_fetch(&node->refCount, 1, __ATOMIC_ACQ_REL) == 0) {
+		FSNode *parent = node->parent;
+		FreeNode(node);
+		node = parent;
+	}
+}
+
+void PutNode(FSNode *node) {
+	if (node == NULL) return;
+
+	CountHold(node, false);
+	ReleaseNode(node);
+}
+
+void SetParent(FSNode *node, FSNode *parent) {
+	if (parent != NULL) __atomic_add_fetch(&parent->refCount, 1, __ATOMIC_RELAXED);
+	node->parent = parent;
+}
+
+FILE *AllocFile() {
+	return fileCache.Alloc();
+}
+
+static void ReclaimFile(RCUHead *head) {
+	fileCache.Free((FILE*)((uint8_t*)head - offsetof(FILE, rcu)));
+}
+
+void FreeFile(FILE *file) {
+	if (file == NULL) return;
+
+	// A descriptor lookup could have loaded it just before it was closed
+	RCU::Retire(&file->rcu, ReclaimFile);
+}
+
+FILE *RefFile(FILE *file) {
+	if (file == NULL) return NULL;
+
+	__atomic_add_fetch(&file->refCount, 1, __ATOMIC_RELAXED);
+	return file;
+}
+
+FILE *TryRefFile(FILE *file) {
+	// For lock-free lookups, inside an RCU read section: a file that is being closed stays closed
+	if (file == NULL) return NULL;
+
+	uint64_t count = __atomic_load_n(&file->refCount, __ATOMIC_RELAXED);
+	do {
+		if (count == 0) return NULL;
+	} while (!__atomic_compare_exchange_n(&file->refCount, &count, count + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+	return file;
+}
 
 void Init(KInfo *info) {
 	rootfs = sysfs = procfs = initrdfs = NULL;
+	procDriver = NULL;
+	mounts = NULL;
+	mountLock.locked = 0;
+	tickLock.locked = 0;
+	nextTick = 0;
+	for (int i = 0; i < VFS_MOUNT_BUCKETS; i++) {
+		mountTable[i] = NULL;
+	}
 	PRINTK::PrintK("Starting the VFS.\r\n");
 
+	// Drivers allocate their nodes and files from here, so this comes first
+	nodeCache.Init("vfs_node");
+	fileCache.Init("vfs_file");
+
+	DCache::Init();
+	PageCache::Init();
+
 	FSDriver *rootfsDriver = new RAMFSDriver(NULL, 10000);
 	rootfs = MountFS(NULL, rootfsDriver, 0);
 
+	// Lists the device tree as it is, nothing is written out at boot
 	FSNode *sysDir = MakeDir(rootfs->node, "sys", 0, 0, 0);
-	FSDriver *sysfsDriver = new RAMFSDriver(sysDir, 10000);
+	FSDriver *sysfsDriver = new SysFSDriver(sysDir);
 	sysfs = MountFS(sysDir, sysfsDriver, 0);
+	PutNode(sysDir);
 
+	// Its files are only generated when they're read, registering them is free
 	FSNode *procDir = MakeDir(rootfs->node, "proc", 0, 0, 0);
-	FSDriver *procDriver = new RAMFSDriver(procDir, 10000);
+	procDriver = new ProcFSDriver(procDir);
 	procfs = MountFS(procDir, procDriver, 0);
+	PutNode(procDir);
+
+	ProcFS::Register("mounts", ProcMounts, NULL);
+	ProcFS::Register("dcache", ProcDCache, NULL);
+	ProcFS::Register("pagecache", ProcPageCache, NULL);
+	ProcFS::Register("objcache", ProcObjectCaches, NULL);
+	ProcFS::Register("ramfs", ProcRAMFS, NULL);
 
 	FSNode *initrdDir = MakeDir(rootfs->node, "initrd", 0, 0, 0);
 	FSDriver *initrdDriver = new RAMFSDriver(initrdDir, 10000);
 	initrdfs = MountFS(initrdDir, initrdDriver, 0);
+	PutNode(initrdDir);
+
+#ifdef CONFIG_FS_PAGECACHE_TEST
+	// No driver of a real device uses the page cache yet, this one stands in for them
+	PageCacheTest::Run();
+#endif
+
+#ifdef CONFIG_FS_VFSBENCH
+#ifndef CONFIG_MP_SMP
+	// The boot CPU is the only one there will be. With SMP every CPU runs VFSBench::StartCPU itself
+	VFSBench::StartCPU(0, 1);
+#endif
+#endif
 
 	PRINTK::PrintK("The VFS has been initialized.\r\n");
 }
@@ -53,22 +424,155 @@ VFilesystem *GetInitrdFS() {
 	return initrdfs;
 }
 
-FSNode *GetNode(VFilesystem *fs, char *path) {
-	FSNode *node = fs->node;
+VFilesystem *MountInitrdImage(const void *image, size_t size) {
+	if (!RAMFSImageDriver::Check(image, size)) return NULL;
+	if (initrdfs == NULL || initrdfs->mountdir == NULL) return NULL;
 
-	char *ptr = strtok(path, "/");
+	// Only the empty RAMFS made at boot steps aside, not something that's been written to
+	if (GetDirElements(initrdfs->node) != 0) return NULL;
 
-	if (ptr == NULL) return node;
+	// The mountpoint can't take the image while the old one is on it. If the old one
+	// is still in use it stays, and if the image can't be mounted an empty RAMFS takes its place again
+	FSNode *initrdDir = RefNode(initrdfs->mountdir);
+	if (UmountFS(initrdfs) != 0) {
+		PutNode(initrdDir);
+		return NULL;
+	}
 
-	do {
-		node = FindDir(node, ptr);
+	FSDriver *imageDriver = new RAMFSImageDriver(initrdDir, image);
+	VFilesystem *imagefs = MountFS(initrdDir, imageDriver, 0);
+
+	if (imagefs == NULL) {
+		imageDriver->FSDelete();
+		delete imageDriver;
+
+		initrdfs = MountFS(initrdDir, new RAMFSDriver(initrdDir, 10000), 0);
+		PutNode(initrdDir);
+		return NULL;
+	}
+
+	initrdfs = imagefs;
+	PutNode(initrdDir);
+
+	PRINTK::PrintK("The initrd image has been mounted.\r\n");
+	return initrdfs;
+}
+
+static FSNode *Lookup(FSNode *node, const FSNameKey *key) {
+	FSNode *result;
+	if (DCache::Lookup(node, key, &result)) return result;
+
+	uint64_t generation = DCache::GetGeneration(node, key);
+	result = node->driver->FSFindDir(node, key);
+	DCache::Insert(node, key, result, generation);
+
+	return result;
+}
+
+static inline uint64_t MountBucket(FSDriver *driver, uint64_t inode) {
+	uint64_t key = (inode * 0x9E3779B97F4A7C15) ^ ((uint64_t)driver >> 4);
+	return (key ^ (key >> 32)) & (VFS_MOUNT_BUCKETS - 1);
+}
+
+VFilesystem *FindMount(FSNode *mountdir) {
+	if (mountdir == NULL) return NULL;
+
+	// Cheap check first, almost no directory is a mountpoint
+	if (!(__atomic_load_n(&mountdir->flags, __ATOMIC_ACQUIRE) & VFS_NODE_MOUNTED)) return NULL;
+
+	VFilesystem *fs = __atomic_load_n(&mountTable[MountBucket(mountdir->driver, mountdir->inode)], __ATOMIC_ACQUIRE);
+	while (fs != NULL) {
+		if (fs->mountdir->inode == mountdir->inode && fs->mountdir->driver == mountdir->driver) return fs;
+		fs = __atomic_load_n(&fs->hashNext, __ATOMIC_ACQUIRE);
+	}
+
+	return NULL;
+}
 
-		if (node == NULL) break;
-	} while (ptr = strtok(NULL, " "));
+static FSNode *Walk(FSNode *node, const char *path) {
+	// Takes a reference to node, gives back one to the result.
+	// The path is never written to, so many walks can share it
+	while (node != NULL) {
+		while (*path == '/') path++;
+		if (*path == '\0') break;
+
+		const char *component = path;
+		while (*path != '/' && *path != '\0') path++;
+		size_t length = path - component;
+
+		if (length == 1 && component[0] == '.') continue;
+
+		FSNode *next;
+		if (length == 2 && component[0] == '.' && component[1] == '.') {
+			// Going above the root of a mounted filesystem leads to the directory it's mounted on
+			FSNode *current = node;
+			while (current->parent == NULL && current->driver != NULL &&
+			       current->driver->mount != NULL && current->driver->mount->mountdir != NULL) {
+				current = current->driver->mount->mountdir;
+			}
+
+			next = RefNode(current->parent != NULL ? current->parent : current);
+		} else {
+			if ((node->flags & VFS_NODE_TYPE) != VFS_NODE_DIRECTORY || node->driver == NULL) {
+				PutNode(node);
+				return NULL;
+			}
+
+			FSNameKey key;
+			MakeNameKey(&key, component, length);
+			next = Lookup(node, &key);
+
+			// Mounts can be stacked, so keep going down until there are no more.
+			// The mount can't be freed under us while we're in the read section
+			uint64_t token = RCU::ReadLock();
+
+			VFilesystem *fs;
+			while (next != NULL && (fs = FindMount(next)) != NULL) {
+				PutNode(next);
+				next = TryRefNode(fs->node);
+			}
+
+			RCU::ReadUnlock(token);
+		}
+
+		// Each step holds only the node it's looking into
+		PutNode(node);
+		node = next;
+	}
 
 	return node;
 }
 
+FSNode *GetNode(VFilesystem *fs, const char *path) {
+	if (fs == NULL || path == NULL) return NULL;
+
+	return Walk(RefNode(fs->node), path);
+}
+
+FSNode *GetNodeAt(FSNode *dir, const char *path) {
+	if (path == NULL) return NULL;
+
+	// Absolute paths ignore dir, relative ones start from it (like openat)
+	if (*path == '/') dir = rootfs != NULL ? rootfs->node : NULL;
+	if (dir == NULL) return NULL;
+
+	return Walk(RefNode(dir), path);
+}
+
+static void HashMount(VFilesystem *fs) {
+	// Called with mountLock taken
+	uint64_t bucket = MountBucket(fs->mountdir->driver, fs->mountdir->inode);
+	fs->hashNext = mountTable[bucket];
+	__atomic_store_n(&mountTable[bucket], fs, __ATOMIC_RELEASE);
+}
+
+static void UnhashMount(VFilesystem *fs) {
+	// Called with mountLock taken. fs->hashNext is left alone, so a lookup standing on fs can still move past it
+	VFilesystem **link = &mountTable[MountBucket(fs->mountdir->driver, fs->mountdir->inode)];
+	while (*link != NULL && *link != fs) link = &(*link)->hashNext;
+	if (*link != NULL) __atomic_store_n(link, fs->hashNext, __ATOMIC_RELEASE);
+}
+
 VFilesystem *MountFS(FSNode *mountroot, FSDriver *fsdriver, uint64_t flags) {
 	// Remember, mountroot can be null
 	if (mountroot == NULL) {
@@ -77,14 +581,41 @@ VFilesystem *MountFS(FSNode *mountroot, FSDriver *fsdriver, uint64_t flags) {
 	}
 
 	if (fsdriver == NULL) return NULL;
+	if (fsdriver->mount != NULL) return NULL;
+
+	if (mountroot != NULL) {
+		if ((mountroot->flags & VFS_NODE_TYPE) != VFS_NODE_DIRECTORY) return NULL;
+		if (mountroot->driver == NULL) return NULL;
+	}
 
-	// TODO: Check if already mounted
+	mountLock.Lock();
+
+	// Only one filesystem per directory
+	if (mountroot != NULL && (mountroot->flags & VFS_NODE_MOUNTED)) {
+		mountLock.Unlock();
+		return NULL;
+	}
 
 	VFilesystem *fs = new VFilesystem;
 	fs->node = fsdriver->rootNode;
 	fs->node->driver = fsdriver;
-	fs->mountdir = mountroot;
+	fs->driver = fsdriver;
+	fs->mountdir = RefNode(mountroot);
 	fs->flags = flags;
+	fs->unmounting = false;
+	fsdriver->mount = fs;
+
+	fs->next = mounts;
+	mounts = fs;
+
+	fs->hashNext = NULL;
+	if (mountroot != NULL) {
+		// The entry has to be visible before the flag sends lookups to the table
+		HashMount(fs);
+		__atomic_or_fetch(&mountroot->flags, VFS_NODE_MOUNTED, __ATOMIC_RELEASE);
+	}
+
+	mountLock.Unlock();
 
 	return fs;
 }
@@ -100,32 +631,106 @@ uint64_t RemountFS(VFilesystem *fs, uint64_t flags) {
 	return 0;
 }
 
+static void ReclaimMount(RCUHead *head) {
+	VFilesystem *fs = (VFilesystem*)((uint8_t*)head - offsetof(VFilesystem, rcu));
+
+	delete fs->driver;
+	PutNode(fs->mountdir);
+	delete fs;
+}
+
 uint64_t UmountFS(VFilesystem *fs) {
 	if (fs == NULL) return 1;
 
-	// TODO: Check for open files and such
-	fs->node->driver->FSDelete();
+	mountLock.Lock();
 
-	// The driver automatically destroys the node
-	delete fs->node->driver;
-	delete fs;
+	VFilesystem *mounted = mounts;
+	while (mounted != NULL && mounted != fs) mounted = mounted->next;
+
+	if (mounted == NULL || fs->unmounting) {
+		mountLock.Unlock();
+		return 1;
+	}
+
+	// New lookups don't get in anymore, the ones already inside are waited for below.
+	// The mountpoint stays flagged, nothing else can be mounted on it meanwhile
+	fs->unmounting = true;
+	if (fs->mountdir != NULL) UnhashMount(fs);
+
+	mountLock.Unlock();
+	RCU::Synchronize();
+
+	// The caches hold references too, and the dirty data must not be lost
+	FSDriver *driver = fs->driver;
+	DCache::InvalidateDriver(driver);
+	bool busy = PageCache::FlushDriver(driver) != 0;
+	if (!busy) PageCache::InvalidateDriver(driver);
+
+	// The dentries let go of their nodes once they're reclaimed
+	RCU::Barrier();
+
+	// Nobody can take a new reference now but those that already hold one
+	if (!busy) busy = HeldNodes(driver) != 0;
+
+	mountLock.Lock();
+
+	if (busy) {
+		if (fs->mountdir != NULL) HashMount(fs);
+		fs->unmounting = false;
+
+		mountLock.Unlock();
+		return 1;
+	}
+
+	VFilesystem **link = &mounts;
+	while (*link != fs) link = &(*link)->next;
+	*link = fs->next;
+
+	if (fs == rootfs) rootfs = NULL;
+	if (fs->mountdir != NULL) __atomic_and_fetch(&fs->mountdir->flags, ~VFS_NODE_MOUNTED, __ATOMIC_RELEASE);
+
+	mountLock.Unlock();
+
+	// The driver automatically destroys the node, it can't be used past this
+	driver->FSDelete();
+	driver->mount = NULL;
+
+	// Freed through RCU like the nodes, for whoever might still be reading it without a lock
+	RCU::Retire(&fs->rcu, ReclaimMount);
+	return 0;
 }
 
 FSNode *MakeFile(FSNode *node, const char *name, uint64_t uid, uint64_t gid, uint64_t mask) {
 	if (node == NULL) return NULL;
 	if (node->driver == NULL) return NULL;
 
-	return node->driver->FSMakeFile(node, name, uid, gid, mask);
+	FSNode *file = node->driver->FSMakeFile(node, name, uid, gid, mask);
+
+	// Drop a possible negative entry for this name
+	FSNameKey key;
+	MakeNameKey(&key, name, strlen(name));
+	DCache::Invalidate(node, &key);
+
+	return file;
 }
 
 FILE *OpenFile(FSNode *node) {
+	// Files opened without a descriptor table, see VFS::OpenDescriptor
+	return OpenFile(node, 0);
+}
+
+FILE *OpenFile(FSNode *node, uint64_t descriptor) {
 	if (node == NULL) return NULL;
 	if (node->driver == NULL) return NULL;
 
-	uint64_t descriptor = 0; // TODO: Get file descriptors
 	FILE *file = node->driver->FSOpenFile(node, descriptor);
 
-	// TODO: Do some stuff with the file
+	// The node stays around as long as the file is open
+	if (file != NULL) {
+		RefNode(node);
+		file->refCount = 1;
+		memset(&file->readahead, 0, sizeof(FileReadahead));
+	}
 
 	return file;
 }
@@ -133,17 +738,57 @@ FILE *OpenFile(FSNode *node) {
 uint64_t GetFileSize(FILE *file) {
 	if (file == NULL) return NULL;
 	if (file->node == NULL) return NULL;
+
+	// Generated files are as long as the copy this file got, others may have a different one
+	if (file->node->driver != NULL && file->node->driver->driverFlags & FS_DRIVER_SNAPSHOT) return file->bufferSize;
 	return file->node->size;
 }
 
+static void Readahead(FILE *file, uint64_t offset, size_t size) {
+	FileReadahead *readahead = &file->readahead;
+	if (size == 0 || offset >= file->node->size) return;
+
+	bool sequential = offset == readahead->nextOffset;
+	readahead->nextOffset = offset + size;
+
+	if (!sequential) {
+		// Random access, stop prefetching until the reads line up again
+		readahead->window = 0;
+		readahead->end = 0;
+		return;
+	}
+
+	// Go back to the driver only once the reader is halfway through the window
+	uint64_t last = (offset + size - 1) >> VFS_PAGE_SHIFT;
+	if (readahead->end > last + readahead->window / 2) return;
+
+	if (readahead->window == 0) readahead->window = VFS_READAHEAD_MIN;
+	else if (readahead->window * 2 <= VFS_READAHEAD_MAX) readahead->window *= 2;
+	else readahead->window = VFS_READAHEAD_MAX;
+
+	uint64_t start = readahead->end > last + 1 ? readahead->end : last + 1;
+	uint64_t target = last + 1 + readahead->window;
+	if (target > start) readahead->prefetched += PageCache::Prefetch(file->node, start, target - start);
+
+	readahead->end = target;
+}
+
 uint64_t ReadFile(FILE *file, uint64_t offset, size_t size, uint8_t **buffer) {
 	if (file == NULL) return NULL;
 	if (file->node == NULL) return NULL;
 	if (file->node->driver == NULL) return NULL;
 
-	// TODO: Do some caching or leave it to the FS?
+	// Drivers backed by slow devices get their data cached here, the others already keep it in memory
+	uint64_t read;
+	if (file->node->driver->driverFlags & FS_DRIVER_PAGECACHE) {
+		read = PageCache::Read(file, offset, size, *buffer + offset);
+		Readahead(file, offset, read);
+	} else {
+		read = file->node->driver->FSReadFile(file, offset, size, buffer);
+	}
 
-	return file->node->driver->FSReadFile(file, offset, size, buffer);
+	Tick();
+	return read;
 }
 
 uint64_t WriteFile(FILE *file, uint64_t offset, size_t size, uint8_t *buffer) {
@@ -151,33 +796,371 @@ uint64_t WriteFile(FILE *file, uint64_t offset, size_t size, uint8_t *buffer) {
 	if (file->node == NULL) return NULL;
 	if (file->node->driver == NULL) return NULL;
 
-	// TODO: Do some caching or leave it to the FS?
+	uint64_t end;
+	if (file->node->driver->driverFlags & FS_DRIVER_PAGECACHE) {
+		end = PageCache::Write(file, offset, size, buffer);
+	} else {
+		end = file->node->driver->FSWriteFile(file, offset, size, buffer);
+	}
+
+	Tick();
+	return end;
+}
+
+uint64_t ReadFileV(FILE *file, uint64_t offset, const FSIOVec *vectors, size_t count) {
+	if (file == NULL) return 0;
+	if (file->node == NULL) return 0;
+	if (file->node->driver == NULL) return 0;
+	if (vectors == NULL) return 0;
+
+	uint64_t done = 0;
+	if (file->node->driver->driverFlags & FS_DRIVER_PAGECACHE) {
+		for (size_t i = 0; i < count; i++) {
+			uint64_t read = PageCache::Read(file, offset + done, vectors[i].length, vectors[i].buffer);
+			done += read;
+			if (read < vectors[i].length) break;
+		}
+
+		Readahead(file, offset, done);
+	} else {
+		done = file->node->driver->FSReadFileV(file, offset, vectors, count);
+	}
+
+	Tick();
+	return done;
+}
+
+uint64_t WriteFileV(FILE *file, uint64_t offset, const FSIOVec *vectors, size_t count) {
+	if (file == NULL) return 0;
+	if (file->node == NULL) return 0;
+	if (file->node->driver == NULL) return 0;
+	if (vectors == NULL) return 0;
+
+	uint64_t done = 0;
+	if (file->node->driver->driverFlags & FS_DRIVER_PAGECACHE) {
+		for (size_t i = 0; i < count; i++) {
+			uint64_t end = PageCache::Write(file, offset + done, vectors[i].length, vectors[i].buffer);
+			uint64_t written = end > offset + done ? end - (offset + done) : 0;
+			done += written;
+			if (written < vectors[i].length) break;
+		}
+	} else {
+		done = file->node->driver->FSWriteFileV(file, offset, vectors, count);
+	}
+
+	Tick();
+	return done;
+}
+
+uint64_t SubmitBatch(VFSBatchOp *ops, size_t count) {
+	if (ops == NULL) return 0;
+
+	uint64_t completed = 0;
+	size_t i = 0;
+
+	while (i < count) {
+		if (ops[i].file == NULL || ops[i].file->node == NULL || ops[i].file->node->driver == NULL) {
+			ops[i].result = 0;
+			completed++;
+			i++;
+			continue;
+		}
+
+		FSDriver *driver = ops[i].file->node->driver;
+
+		if (driver->driverFlags & FS_DRIVER_PAGECACHE) {
+			// Cached files are served by the page cache, one operation at a time
+			if (ops[i].opcode == VFS_OP_READ) ops[i].result = ReadFileV(ops[i].file, ops[i].offset, ops[i].vectors, ops[i].count);
+			else if (ops[i].opcode == VFS_OP_WRITE) ops[i].result = WriteFileV(ops[i].file, ops[i].offset, ops[i].vectors, ops[i].count);
+			else ops[i].result = 0;
+
+			completed++;
+			i++;
+			continue;
+		}
 
-	return file->node->driver->FSWriteFile(file, offset, size, buffer);
+		// Hand every run of operations on the same driver over in one call, so it can merge them
+		size_t run = 1;
+		while (i + run < count &&
+		       ops[i + run].file != NULL && ops[i + run].file->node != NULL &&
+		       ops[i + run].file->node->driver == driver) run++;
+
+		uint64_t done = driver->FSSubmitBatch(&ops[i], run);
+		completed += done;
+		if (done < run) break;
+
+		i += run;
+	}
+
+	return completed;
+}
+
+bool GetFilePage(FILE *file, uint64_t offset, FilePage *page) {
+	if (file == NULL) return false;
+	if (file->node == NULL) return false;
+	if (file->node->driver == NULL) return false;
+
+	uint64_t size = GetFileSize(file);
+	if (offset >= size) return false;
+
+	FSNode *node = file->node;
+	uint64_t index = offset >> VFS_PAGE_SHIFT;
+
+	page->file = file;
+	page->index = index;
+	page->privateData = NULL;
+	page->handle = NULL;
+
+	page->length = size - (index << VFS_PAGE_SHIFT);
+	if (page->length > VFS_PAGE_SIZE) page->length = VFS_PAGE_SIZE;
+
+	if (node->driver->driverFlags & FS_DRIVER_PAGECACHE) {
+		CachedPage *cached = PageCache::Pin(node, index);
+		if (cached == NULL) return false;
+
+		page->data = cached->data;
+		page->handle = cached;
+		return true;
+	}
+
+	size_t length;
+	page->data = node->driver->FSGetPage(file, index, &length);
+	if (page->data != NULL) {
+		page->length = length;
+		page->handle = node->driver;
+		return true;
+	}
+
+	// The driver can't share its pages, so the caller gets a private copy
+	page->privateData = (uint8_t*)PMM::RequestPage();
+	if (page->privateData == NULL) return false;
+
+	uint64_t position = index << VFS_PAGE_SHIFT;
+	uint8_t *buffer = page->privateData - position;
+	page->length = node->driver->FSReadFile(file, position, page->length, &buffer);
+
+	// Nothing came back (es: the driver couldn't get the data), it's an error and not a page of zeroes
+	if (page->length == 0) {
+		PMM::FreePage(page->privateData);
+		page->privateData = NULL;
+		return false;
+	}
+
+	memset(page->privateData + page->length, 0, VFS_PAGE_SIZE - page->length);
+
+	page->data = page->privateData;
+	return true;
+}
+
+uint8_t *MakeFilePagePrivate(FilePage *page) {
+	if (page == NULL) return NULL;
+	if (page->privateData != NULL) return page->privateData;
+
+	// Copy on write: only now the caller pays for the copy
+	uint8_t *copy = (uint8_t*)PMM::RequestPage();
+	if (copy == NULL) return NULL;
+
+	memcpy(copy, page->data, page->length);
+	memset(copy + page->length, 0, VFS_PAGE_SIZE - page->length);
+
+	// The driver's page isn't needed anymore, cached pages stay pinned until PutFilePage
+	FSNode *node = page->file->node;
+	if (page->handle != NULL && !(node->driver->driverFlags & FS_DRIVER_PAGECACHE)) {
+		node->driver->FSPutPage(page->file, page->index, page->data);
+		page->handle = NULL;
+	}
+
+	page->privateData = copy;
+	page->data = copy;
+	return copy;
+}
+
+uint8_t *MakeFilePageWritable(FilePage *page) {
+	if (page == NULL) return NULL;
+
+	// The driver couldn't share the page, whoever writes the copy has to write it back
+	if (page->privateData != NULL) return page->privateData;
+
+	FSNode *node = page->file->node;
+	if (node->driver->driverFlags & FS_DRIVER_PAGECACHE) {
+		CachedPage *cached = (CachedPage*)page->handle;
+		PageCache::SetDirty(cached);
+		return cached->data;
+	}
+
+	// The page we have could be shared with other files, ask for one of its own
+	uint8_t *data = node->driver->FSGetWritablePage(page->file, page->index);
+	if (data == NULL) return NULL;
+
+	// The writable page takes the place of the one we had
+	if (page->handle != NULL) node->driver->FSPutPage(page->file, page->index, page->data);
+
+	page->data = data;
+	page->handle = node->driver;
+	return data;
+}
+
+void PutFilePage(FilePage *page) {
+	if (page == NULL) return;
+
+	if (page->handle != NULL) {
+		if (page->file->node->driver->driverFlags & FS_DRIVER_PAGECACHE) PageCache::Unpin((CachedPage*)page->handle);
+		else page->file->node->driver->FSPutPage(page->file, page->index, page->data);
+	}
+
+	if (page->privateData != NULL) PMM::FreePage(page->privateData);
+
+	page->data = page->privateData = NULL;
+	page->handle = NULL;
 }
 
 void CloseFile(FILE *file) {
-	if (file == NULL) return NULL;
-	if (file->node == NULL) return NULL;
-	if (file->node->driver == NULL) return NULL;
+	// Someone else could be using the file, the last one to give it back closes it
+	PutFile(file);
+}
+
+void PutFile(FILE *file) {
+	if (file == NULL) return;
+	if (file->node == NULL) return;
+	if (file->node->driver == NULL) return;
+	if (__atomic_sub_fetch(&file->refCount, 1, __ATOMIC_ACQ_REL) != 0) return;
 
 	// TODO: Dismantle eventual remainders in the VFS
+	// Dirty data is left to the flusher, only SyncFile makes it durable
+	FSNode *node = file->node;
 
-	return file->node->driver->FSCloseFile(file);
+	node->driver->FSCloseFile(file);
+	PutNode(node);
+
+	Tick();
+}
+
+uint64_t SyncFile(FILE *file) {
+	if (file == NULL) return 1;
+	if (file->node == NULL) return 1;
+	if (file->node->driver == NULL) return 1;
+
+	if (file->node->driver->driverFlags & FS_DRIVER_PAGECACHE) return PageCache::FlushNode(file->node);
+
+	return 0;
+}
+
+void Sync() {
+	PageCache::FlushAll();
+}
+
+void Tick() {
+	uint64_t now = ReadCycles();
+	if (now < __atomic_load_n(&nextTick, __ATOMIC_RELAXED)) return;
+
+	// Somebody else is already on it
+	if (!tickLock.TryLock()) return;
+
+	if (now >= nextTick) {
+		__atomic_store_n(&nextTick, now + VFS_TICK_INTERVAL, __ATOMIC_RELAXED);
+		PageCache::FlusherTick(now, VFS_TICK_PAGES);
+		RAMFS::CompressorTick(VFS_TICK_PAGES);
+	}
+
+	tickLock.Unlock();
 }
 
 uint64_t DeleteFile(FSNode *node) {
 	if (node == NULL) return NULL;
 	if (node->driver == NULL) return NULL;
 
-	return node->driver->FSDeleteFile(node);
+	DCache::InvalidateNode(node);
+	PageCache::InvalidateNode(node);
+
+	uint64_t result = node->driver->FSDeleteFile(node);
+
+	// A lookup or a read could have cached it again while the driver was unlinking it
+	DCache::InvalidateNode(node);
+	PageCache::InvalidateNode(node);
+
+	return result;
+}
+
+FSNode *CloneFile(FSNode *node, FSNode *directory, const char *name) {
+	if (node == NULL || directory == NULL) return NULL;
+	if (node->driver == NULL || directory->driver == NULL) return NULL;
+	if ((node->flags & VFS_NODE_TYPE) != VFS_NODE_FILE) return NULL;
+
+	// On the same driver the data may be shared instead of copied
+	FSNode *clone = NULL;
+	if (node->driver == directory->driver) {
+		clone = node->driver->FSCloneFile(node, directory, name);
+
+		if (clone != NULL) {
+			FSNameKey key;
+			MakeNameKey(&key, name, strlen(name));
+			DCache::Invalidate(directory, &key);
+
+			return clone;
+		}
+	}
+
+	// Otherwise a page at a time
+	uint8_t *buffer = (uint8_t*)PMM::RequestPage();
+	if (buffer == NULL) return NULL;
+
+	clone = MakeFile(directory, name, node->uid, node->gid, node->mask);
+	FILE *source = clone != NULL ? OpenFile(node) : NULL;
+	FILE *destination = source != NULL ? OpenFile(clone) : NULL;
+	bool copied = false;
+
+	if (destination != NULL) {
+		FSIOVec vector;
+		vector.buffer = buffer;
+
+		uint64_t size = GetFileSize(source);
+		uint64_t offset;
+		for (offset = 0; offset < size; offset += vector.length) {
+			vector.length = VFS_PAGE_SIZE;
+			vector.length = ReadFileV(source, offset, &vector, 1);
+			if (vector.length == 0 || WriteFileV(destination, offset, &vector, 1) != vector.length) break;
+		}
+
+		copied = offset >= size;
+		CloseFile(destination);
+	}
+
+	if (source != NULL) CloseFile(source);
+	PMM::FreePage(buffer);
+
+	// A partial copy isn't a clone, it goes away
+	if (clone != NULL && !copied) {
+		DeleteFile(clone);
+		PutNode(clone);
+		return NULL;
+	}
+
+	// The copy can still share what it has in common with the rest of its filesystem
+	if (clone != NULL) DedupFile(clone);
+
+	return clone;
+}
+
+uint64_t DedupFile(FSNode *node) {
+	if (node == NULL) return 0;
+	if (node->driver == NULL) return 0;
+	if ((node->flags & VFS_NODE_TYPE) != VFS_NODE_FILE) return 0;
+
+	return node->driver->FSDedupFile(node);
 }
 
 FSNode *MakeDir(FSNode *node, const char *name, uint64_t uid, uint64_t gid, uint64_t mask) {
 	if (node == NULL) return NULL;
 	if (node->driver == NULL) return NULL;
 
-	return node->driver->FSMakeDir(node, name, uid, gid, mask);
+	FSNode *dir = node->driver->FSMakeDir(node, name, uid, gid, mask);
+
+	// Drop a possible negative entry for this name
+	FSNameKey key;
+	MakeNameKey(&key, name, strlen(name));
+	DCache::Invalidate(node, &key);
+
+	return dir;
 }
 
 FSNode *ReadDir(FSNode *node, uint64_t index) {
@@ -187,11 +1170,40 @@ FSNode *ReadDir(FSNode *node, uint64_t index) {
 	return node->driver->FSReadDir(node, index);
 }
 
+uint64_t IterateDir(FSNode *node, uint64_t *cursor, VFSDirEntry *buffer, size_t bufferSize) {
+	if (node == NULL) return 0;
+	if (node->driver == NULL) return 0;
+	if (cursor == NULL || buffer == NULL) return 0;
+	if (*cursor == VFS_DIR_CURSOR_END) return 0;
+
+	return node->driver->FSIterateDir(node, cursor, buffer, bufferSize);
+}
+
+VFSDirEntry *PutDirEntry(VFSDirEntry *buffer, size_t bufferSize, uint64_t *used, uint64_t inode, uint32_t flags, const char *name, size_t length) {
+	// Helper for drivers: appends an entry, returns NULL if it doesn't fit
+	uint64_t recordLength = (sizeof(VFSDirEntry) + length + 1 + 7) & ~7;
+	if (*used + recordLength > bufferSize) return NULL;
+
+	VFSDirEntry *entry = (VFSDirEntry*)((uint8_t*)buffer + *used);
+	entry->inode = inode;
+	entry->flags = flags;
+	entry->recordLength = recordLength;
+	entry->nameLength = length;
+	memcpy(entry->name, name, length);
+	entry->name[length] = '\0';
+
+	*used += recordLength;
+	return entry;
+}
+
 FSNode *FindDir(FSNode *node, const char *name) {
 	if (node == NULL) return NULL;
 	if (node->driver == NULL) return NULL;
 
-	return node->driver->FSFindDir(node, name);
+	FSNameKey key;
+	MakeNameKey(&key, name, strlen(name));
+
+	return Lookup(node, &key);
 }
 
 uint64_t GetDirElements(FSNode *node) {
@@ -205,6 +1217,16 @@ uint64_t DeleteDir(FSNode *node) {
 	if (node == NULL) return NULL;
 	if (node->driver == NULL) return NULL;
 
-	return node->driver->FSDeleteDir(node);
+	// Something is mounted on it, it has to be unmounted first
+	if (__atomic_load_n(&node->flags, __ATOMIC_ACQUIRE) & VFS_NODE_MOUNTED) return 1;
+
+	DCache::InvalidateNode(node);
+
+	uint64_t result = node->driver->FSDeleteDir(node);
+
+	// A lookup could have cached it, or something in it, again while the driver was unlinking it
+	DCache::InvalidateNode(node);
+
+	return result;
 }
 }
@@ -0,0 +1,306 @@
+#include <fs/vfsbench.hpp>
+#include <fs/procfs/procfs.hpp>
+#include <fs/ramfs/ramfs.hpp>
+#include <mm/pmm.hpp>
+#include <mm/string.hpp>
+
+#define VFSBENCH_IDLE		0	// Nobody called StartCPU yet
+#define VFSBENCH_STARTING	1	// The first CPU is running Init
+#define VFSBENCH_READY		2	// The Workers can go
+#define VFSBENCH_FAILED		3	// Init didn't work out, there's nothing to run
+
+static uint64_t startState;
+static uint64_t cpuCount;
+static FSNode *sharedFiles[VFSBENCH_FILES];
+static FSNode *cpuDirs[VFSBENCH_MAX_CPUS];
+
+static VFSBenchResult results[VFSBENCH_MAX_CPUS][VFSBENCH_PHASES];	// By number of CPUs minus one
+static uint64_t cpuCycles[VFSBENCH_MAX_CPUS];				// Of the phase that just ran
+static VFSBenchMemory memory[VFSBENCH_MAX_CPUS];			// After every run
+static uint8_t churnData[VFS_PAGE_SIZE];
+static uint64_t runsDone;
+
+// A sense-reversing barrier, reusable as soon as everyone is out of it
+static volatile uint64_t barrierCount;
+static volatile uint64_t barrierSense;
+
+static void Barrier(uint64_t *sense) {
+	*sense ^= 1;
+
+	if (__atomic_add_fetch(&barrierCount, 1, __ATOMIC_ACQ_REL) == cpuCount) {
+		__atomic_store_n(&barrierCount, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&barrierSense, *sense, __ATOMIC_RELEASE);
+	} else {
+		while (__atomic_load_n(&barrierSense, __ATOMIC_ACQUIRE) != *sense) CPURelax();
+	}
+}
+
+static size_t PutNumber(char *buffer, uint64_t value) {
+	char digits[20];
+	size_t count = 0;
+
+	do {
+		digits[count++] = '0' + value % 10;
+		value /= 10;
+	} while (value != 0);
+
+	for (size_t i = 0; i < count; i++) {
+		buffer[i] = digits[count - i - 1];
+	}
+
+	return count;
+}
+
+static uint64_t RunOpen(uint64_t cpu) {
+	char path[32] = "/vfsbench/f";
+	uint64_t done = 0;
+
+	for (uint64_t i = 0; i < VFSBENCH_OPENS; i++) {
+		// Every CPU starts from a different file, so they don't walk in lockstep
+		path[11 + PutNumber(path + 11, (i + cpu) % VFSBENCH_FILES)] = '\0';
+
+		FSNode *node = VFS::GetNode(VFS::GetRootFS(), path);
+		if (node == NULL) continue;
+
+		FILE *file = VFS::OpenFile(node);
+		if (file != NULL) {
+			VFS::CloseFile(file);
+			done++;
+		}
+
+		VFS::PutNode(node);
+	}
+
+	return done;
+}
+
+static uint64_t RunRead(uint64_t cpu) {
+	FILE *file = VFS::OpenFile(sharedFiles[cpu % VFSBENCH_FILES]);
+	if (file == NULL) return 0;
+
+	uint8_t data[VFSBENCH_READ_SIZE];
+	FSIOVec vector;
+	vector.buffer = data;
+	vector.length = VFSBENCH_READ_SIZE;
+
+	uint64_t done = 0;
+	for (uint64_t i = 0; i < VFSBENCH_READS; i++) {
+		uint64_t offset = (i * VFSBENCH_READ_SIZE) % VFS_PAGE_SIZE;
+		if (VFS::ReadFileV(file, offset, &vector, 1) == VFSBENCH_READ_SIZE) done++;
+	}
+
+	VFS::CloseFile(file);
+	return done;
+}
+
+static uint64_t RunCreate(uint64_t cpu, uint64_t run) {
+	// Names are never reused, so every run really creates files
+	char name[48] = "r";
+	size_t prefix = 1 + PutNumber(name + 1, run);
+	name[prefix++] = 'f';
+
+	uint64_t done = 0;
+	for (uint64_t i = 0; i < VFSBENCH_CREATES; i++) {
+		name[prefix + PutNumber(name + prefix, i)] = '\0';
+
+		FSNode *node = VFS::MakeFile(cpuDirs[cpu], name, 0, 0, 0);
+		if (node == NULL) continue;
+
+		VFS::PutNode(node);
+		done++;
+	}
+
+	return done;
+}
+
+static uint64_t RunDelete(uint64_t cpu, uint64_t run) {
+	// The same names as the create phase of this run
+	char name[48] = "r";
+	size_t prefix = 1 + PutNumber(name + 1, run);
+	name[prefix++] = 'f';
+
+	uint64_t done = 0;
+	for (uint64_t i = 0; i < VFSBENCH_CREATES; i++) {
+		name[prefix + PutNumber(name + prefix, i)] = '\0';
+
+		FSNode *node = VFS::FindDir(cpuDirs[cpu], name);
+		if (node == NULL) continue;
+
+		if (VFS::DeleteFile(node) == 0) done++;
+		VFS::PutNode(node);
+	}
+
+	return done;
+}
+
+static uint64_t RunChurn(uint64_t cpu) {
+	uint64_t done = 0;
+
+	for (uint64_t i = 0; i < VFSBENCH_CHURNS; i++) {
+		FSNode *node = VFS::MakeFile(cpuDirs[cpu], "churn", 0, 0, 0);
+		if (node == NULL) continue;
+
+		FILE *file = VFS::OpenFile(node);
+		if (file != NULL) {
+			VFS::WriteFile(file, 0, VFS_PAGE_SIZE, churnData);
+			VFS::CloseFile(file);
+		}
+
+		// The name is free again right away, the next round takes it
+		if (VFS::DeleteFile(node) == 0) done++;
+		VFS::PutNode(node);
+	}
+
+	return done;
+}
+
+static void ProcVFSBench(ProcFSWriter *writer, void *context) {
+	// "cpus open read create delete churn", in operations per million cycles, then "objects pages"
+	for (uint64_t run = 0; run < __atomic_load_n(&runsDone, __ATOMIC_ACQUIRE); run++) {
+		writer->PutNumber(run + 1);
+
+		for (uint64_t phase = 0; phase < VFSBENCH_PHASES; phase++) {
+			VFSBenchResult *result = &results[run][phase];
+
+			writer->Put(" ");
+			writer->PutNumber(result->cycles == 0 ? 0 : result->operations * 1000000 / result->cycles);
+		}
+
+		writer->Put(" ");
+		writer->PutNumber(memory[run].objects);
+		writer->Put(" ");
+		writer->PutNumber(memory[run].pages);
+		writer->Put("\n");
+	}
+}
+
+namespace VFSBench {
+bool Init(uint64_t cpus) {
+	if (cpus == 0) return false;
+	if (cpus > VFSBENCH_MAX_CPUS) cpus = VFSBENCH_MAX_CPUS;
+
+	cpuCount = cpus;
+	runsDone = 0;
+	barrierCount = barrierSense = 0;
+	memset(results, 0, sizeof(results));
+	memset(memory, 0, sizeof(memory));
+
+	VFilesystem *rootfs = VFS::GetRootFS();
+	if (rootfs == NULL) return false;
+
+	FSNode *base = VFS::MakeDir(rootfs->node, "vfsbench", 0, 0, 0);
+	if (base == NULL) return false;
+
+	// A page of data for every file, so that every read finds something
+	uint8_t *page = (uint8_t*)PMM::RequestPage();
+	bool ready = page != NULL;
+
+	char name[24] = "f";
+	for (uint64_t i = 0; i < VFSBENCH_FILES && ready; i++) {
+		name[1 + PutNumber(name + 1, i)] = '\0';
+
+		sharedFiles[i] = VFS::MakeFile(base, name, 0, 0, 0);
+		FILE *file = VFS::OpenFile(sharedFiles[i]);
+		if (file == NULL) {
+			ready = false;
+			break;
+		}
+
+		memset(page, i, VFS_PAGE_SIZE);
+		VFS::WriteFile(file, 0, VFS_PAGE_SIZE, page);
+		VFS::CloseFile(file);
+	}
+
+	if (page != NULL) PMM::FreePage(page);
+
+	name[0] = 'c';
+	for (uint64_t i = 0; i < cpus && ready; i++) {
+		name[1 + PutNumber(name + 1, i)] = '\0';
+
+		cpuDirs[i] = VFS::MakeDir(base, name, 0, 0, 0);
+		if (cpuDirs[i] == NULL) ready = false;
+	}
+
+	VFS::PutNode(base);
+	if (!ready) return false;
+
+	return ProcFS::Register("vfsbench", ProcVFSBench, NULL);
+}
+
+void Worker(uint64_t cpu) {
+	// The barrier only counts the CPUs we have room for
+	if (cpu >= cpuCount) return;
+
+	uint64_t sense = 0;
+
+	for (uint64_t run = 0; run < cpuCount; run++) {
+		for (uint64_t phase = 0; phase < VFSBENCH_PHASES; phase++) {
+			Barrier(&sense);
+
+			uint64_t done = 0;
+			uint64_t start = ReadCycles();
+
+			if (cpu <= run) {
+				switch (phase) {
+					case VFSBENCH_PHASE_OPEN:
+						done = RunOpen(cpu);
+						break;
+					case VFSBENCH_PHASE_READ:
+						done = RunRead(cpu);
+						break;
+					case VFSBENCH_PHASE_CREATE:
+						done = RunCreate(cpu, run);
+						break;
+					case VFSBENCH_PHASE_DELETE:
+						done = RunDelete(cpu, run);
+						break;
+					case VFSBENCH_PHASE_CHURN:
+						done = RunChurn(cpu);
+						break;
+				}
+
+				cpuCycles[cpu] = ReadCycles() - start;
+				__atomic_add_fetch(&results[run][phase].operations, done, __ATOMIC_RELAXED);
+			}
+
+			Barrier(&sense);
+
+			if (cpu == 0) {
+				for (uint64_t i = 0; i <= run; i++) {
+					if (cpuCycles[i] > results[run][phase].cycles) results[run][phase].cycles = cpuCycles[i];
+				}
+			}
+		}
+
+		if (cpu == 0) {
+			// What the run deleted may still be waiting for RCU, the counts are taken once it's gone.
+			// The other CPUs are at the barrier, out of any read section
+			RCU::Barrier();
+
+			RAMFSStats stats;
+			RAMFS::GetStats(&stats);
+			memory[run].objects = stats.objects;
+			memory[run].pages = stats.residentPages;
+
+			__atomic_store_n(&runsDone, run + 1, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+void StartCPU(uint64_t cpu, uint64_t cpus) {
+	// The first CPU to get here sets things up, whoever comes later waits until it's done
+	uint64_t state = VFSBENCH_IDLE;
+
+	if (__atomic_compare_exchange_n(&startState, &state, VFSBENCH_STARTING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		state = Init(cpus) ? VFSBENCH_READY : VFSBENCH_FAILED;
+		__atomic_store_n(&startState, state, __ATOMIC_RELEASE);
+	}
+
+	while (state == VFSBENCH_STARTING) {
+		CPURelax();
+		state = __atomic_load_n(&startState, __ATOMIC_ACQUIRE);
+	}
+
+	if (state == VFSBENCH_READY) Worker(cpu);
+}
+}
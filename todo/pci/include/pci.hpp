@@ -3,6 +3,10 @@
 #include <dev/acpi/acpi.hpp>
 #include <dev/dev.hpp>
 
+#define PCI_MAX_BUSES		256
+#define PCI_MAX_DEVICES		32	// Devices on a bus
+#define PCI_MAX_FUNCTIONS	8	// Functions of a device
+
 namespace PCI {
         struct PCIDeviceHeader {
                 uint16_t VendorID;
@@ -46,6 +50,9 @@ namespace PCI {
 		PCIFunction(uint64_t deviceAddress, uint64_t function);
 
 		bool Exists() { return exists; }
+
+		/* The function's configuration space, read live */
+		PCIDeviceHeader *GetHeader() { return (PCIDeviceHeader*)functionAddress; }
 	private:
 		bool exists = true;
 
@@ -59,10 +66,10 @@ namespace PCI {
 	public:
 		PCIDevice(uint64_t busAddress, uint64_t device);
 
-		PCIFunction *GetFunction(uint64_t id) { if(id > 8) return 0; return functions[id]; }
+		PCIFunction *GetFunction(uint64_t id) { if(id >= PCI_MAX_FUNCTIONS) return 0; return functions[id]; }
 		bool Exists() { return exists; }
 	private:
-		PCIFunction *functions[8];
+		PCIFunction *functions[PCI_MAX_FUNCTIONS];
 		bool exists = true;
 
 		uint64_t busAddress;
@@ -75,13 +82,14 @@ namespace PCI {
 	public:
 		PCIBus(uint64_t baseAddress, uint64_t bus);
 
-		PCIDevice *GetDevice(uint64_t id) { if(id > 32) return 0; return devices[id]; }
+		PCIDevice *GetDevice(uint64_t id) { if(id >= PCI_MAX_DEVICES) return 0; return devices[id]; }
 
 		bool Exists() { return exists; }
+		uint64_t GetBusNumber() { return bus; }
 	private:
 		void EnumerateDevice(uint64_t busAddress, uint64_t device);
 
-		PCIDevice *devices[32];
+		PCIDevice *devices[PCI_MAX_DEVICES];
 		bool exists = true;
 
 		uint64_t baseAddress;
@@ -92,4 +100,7 @@ namespace PCI {
 
 	void EnumeratePCI(ACPI::MCFGHeader *mcfg, uint64_t highMap);
 	PCIDeviceHeader *GetHeader();
+
+	/* The buses found by EnumeratePCI, NULL if there is none with that number */
+	PCIBus *GetBus(uint64_t bus);
 }
@@ -13,10 +13,19 @@ static uint64_t hhdm;
 namespace PCI {
 PCIDeviceHeader *ahciHeader;
 
+/* The buses that exist, kept so that the device tree can be looked at later */
+static PCIBus *buses[PCI_MAX_BUSES];
+
 PCIDeviceHeader *GetHeader() {
 	return ahciHeader;
 }
 
+PCIBus *GetBus(uint64_t bus) {
+	if(bus >= PCI_MAX_BUSES) return NULL;
+
+	return buses[bus];
+}
+
 /* Function that passes through every PCI bus and initializes its driver */
 void EnumeratePCI(ACPI::MCFGHeader *mcfg, uint64_t highMap) {
 	hhdm = highMap;
@@ -33,7 +42,7 @@ void EnumeratePCI(ACPI::MCFGHeader *mcfg, uint64_t highMap) {
 		     bus < newDeviceConfig->EndBus /* TODO: Do more than one bus */ && bus < 1;
 		     bus++) {
 			/* Initialize the PCI bus driver */
-			PCIBus *newBus = new PCIBus(newDeviceConfig->BaseAddress, 0);
+			PCIBus *newBus = new PCIBus(newDeviceConfig->BaseAddress, bus);
 
 			/* If it doesn't exist we delete it */
 			if(!newBus->Exists()) {
@@ -44,6 +53,8 @@ void EnumeratePCI(ACPI::MCFGHeader *mcfg, uint64_t highMap) {
 				newBus->SetMajor(1);
 				newBus->SetMinor(0);
 
+				buses[bus] = newBus;
+
 			}
 		}
 	}
@@ -70,7 +81,7 @@ PCIBus::PCIBus(uint64_t baseAddress, uint64_t bus) {
 		return;
 	}
 
-	for (uint64_t device = 0; device < 32; device++) {
+	for (uint64_t device = 0; device < PCI_MAX_DEVICES; device++) {
 		devices[device] = new PCIDevice(busAddress, device);
 
 		if (!devices[device]->Exists()) {
@@ -104,7 +115,7 @@ PCIDevice::PCIDevice(uint64_t busAddress, uint64_t device) {
 		return;
 	}
 
-	for (uint64_t function = 0; function < 8; function++) {
+	for (uint64_t function = 0; function < PCI_MAX_FUNCTIONS; function++) {
 		functions[function] = new PCIFunction(deviceAddress, function);
 
 		if (!functions[function]->Exists()) {
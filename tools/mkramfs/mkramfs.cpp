@@ -0,0 +1,241 @@
+/* mkramfs
+ *  Turns a directory into a RAMFS image (see todo/fs/include/ramfs/image.hpp)
+ *  that the kernel mounts on /initrd without unpacking it.
+ *
+ *  Usage: mkramfs <directory> <image>
+ *
+ *  Only regular files and directories go in the image, anything else is skipped with a warning.
+ *  Permissions are kept, but everything belongs to root: the build machine's users mean nothing at boot.
+ */
+
+#include <ramfs/image.hpp>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+struct Object {
+	std::string path;	// Where it is on the build machine
+	bool isDirectory;
+	uint32_t mask;
+	uint64_t parent;
+	uint64_t size;		// Bytes for a file, entries for a directory
+	uint64_t offset;	// Where its data starts, or its first entry
+};
+
+struct Child {
+	std::string name;
+	uint64_t hash;
+	std::string path;
+	struct stat info;
+};
+
+static uint64_t HashName(const char *name, size_t length) {
+	// FNV-1a, it has to be the same as VFS::HashName
+	uint64_t hash = 0xCBF29CE484222325;
+
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (uint8_t)name[i];
+		hash *= 0x100000001B3;
+	}
+
+	return hash;
+}
+
+static uint64_t PageAlign(uint64_t value) {
+	return (value + RAMFS_IMAGE_PAGE_SIZE - 1) & ~((uint64_t)RAMFS_IMAGE_PAGE_SIZE - 1);
+}
+
+static bool ReadDirectory(const std::string &path, std::vector<Child> *children) {
+	DIR *dir = opendir(path.c_str());
+	if (dir == NULL) {
+		fprintf(stderr, "mkramfs: can't open %s: %s\n", path.c_str(), strerror(errno));
+		return false;
+	}
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+		Child child;
+		child.name = entry->d_name;
+		child.hash = HashName(child.name.c_str(), child.name.size());
+		child.path = path + "/" + child.name;
+
+		if (lstat(child.path.c_str(), &child.info) != 0) {
+			fprintf(stderr, "mkramfs: can't stat %s: %s\n", child.path.c_str(), strerror(errno));
+			closedir(dir);
+			return false;
+		}
+
+		if (!S_ISREG(child.info.st_mode) && !S_ISDIR(child.info.st_mode)) {
+			fprintf(stderr, "mkramfs: skipping %s, it's neither a file nor a directory\n", child.path.c_str());
+			continue;
+		}
+
+		children->push_back(child);
+	}
+
+	closedir(dir);
+
+	// The kernel finds names with a binary search on the hash
+	std::sort(children->begin(), children->end(), [](const Child &a, const Child &b) {
+		if (a.hash != b.hash) return a.hash < b.hash;
+		return a.name < b.name;
+	});
+
+	return true;
+}
+
+static bool WritePadding(FILE *image, uint64_t size) {
+	static const uint8_t zeroes[RAMFS_IMAGE_PAGE_SIZE] = { 0 };
+
+	while (size > 0) {
+		uint64_t chunk = size > sizeof(zeroes) ? sizeof(zeroes) : size;
+		if (fwrite(zeroes, 1, chunk, image) != chunk) return false;
+		size -= chunk;
+	}
+
+	return true;
+}
+
+static bool WriteFile(FILE *image, const Object *object) {
+	FILE *file = fopen(object->path.c_str(), "rb");
+	if (file == NULL) {
+		fprintf(stderr, "mkramfs: can't open %s: %s\n", object->path.c_str(), strerror(errno));
+		return false;
+	}
+
+	uint8_t buffer[RAMFS_IMAGE_PAGE_SIZE * 16];
+	uint64_t done = 0;
+	size_t length;
+
+	while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+		// The layout is already decided, a file that grew in the meantime doesn't fit anymore
+		if (done + length > object->size || fwrite(buffer, 1, length, image) != length) break;
+		done += length;
+	}
+
+	fclose(file);
+
+	if (done != object->size) {
+		fprintf(stderr, "mkramfs: %s changed while it was being read\n", object->path.c_str());
+		return false;
+	}
+
+	return WritePadding(image, PageAlign(object->size) - object->size);
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <directory> <image>\n", argv[0]);
+		return 1;
+	}
+
+	struct stat rootInfo;
+	if (stat(argv[1], &rootInfo) != 0 || !S_ISDIR(rootInfo.st_mode)) {
+		fprintf(stderr, "mkramfs: %s isn't a directory\n", argv[1]);
+		return 1;
+	}
+
+	std::vector<Object> objects;
+	std::vector<RAMFSImageEntry> entries;
+	std::string names;
+
+	objects.push_back({ argv[1], true, (uint32_t)(rootInfo.st_mode & 07777), 0, 0, 0 });
+
+	// Breadth first, so the entries of every directory end up next to each other
+	for (uint64_t current = 0; current < objects.size(); current++) {
+		if (!objects[current].isDirectory) continue;
+
+		std::vector<Child> children;
+		if (!ReadDirectory(objects[current].path, &children)) return 1;
+
+		objects[current].offset = entries.size();
+		objects[current].size = children.size();
+
+		for (const Child &child : children) {
+			RAMFSImageEntry entry = { };
+			entry.hash = child.hash;
+			entry.object = objects.size();
+			entry.nameOffset = names.size();
+			entry.nameLength = child.name.size();
+			entries.push_back(entry);
+
+			names += child.name;
+			names += '\0';
+
+			bool isDirectory = S_ISDIR(child.info.st_mode);
+			objects.push_back({ child.path, isDirectory, (uint32_t)(child.info.st_mode & 07777), current,
+			                    isDirectory ? 0 : (uint64_t)child.info.st_size, 0 });
+		}
+	}
+
+	RAMFSImageHeader header = { };
+	header.magic = RAMFS_IMAGE_MAGIC;
+	header.version = RAMFS_IMAGE_VERSION;
+	header.headerSize = sizeof(RAMFSImageHeader);
+	header.objectCount = objects.size();
+	header.objectsOffset = sizeof(RAMFSImageHeader);
+	header.entryCount = entries.size();
+	header.entriesOffset = header.objectsOffset + objects.size() * sizeof(RAMFSImageObject);
+	header.namesSize = names.size();
+	header.namesOffset = header.entriesOffset + entries.size() * sizeof(RAMFSImageEntry);
+	header.dataOffset = PageAlign(header.namesOffset + names.size());
+
+	uint64_t position = header.dataOffset;
+	for (Object &object : objects) {
+		if (object.isDirectory) continue;
+
+		object.offset = position;
+		position += PageAlign(object.size);
+	}
+
+	header.imageSize = position;
+
+	std::vector<RAMFSImageObject> table;
+	for (const Object &object : objects) {
+		RAMFSImageObject imageObject = { };
+		imageObject.flags = object.isDirectory ? RAMFS_IMAGE_DIRECTORY : RAMFS_IMAGE_FILE;
+		imageObject.mask = object.mask;
+		imageObject.uid = imageObject.gid = 0;
+		imageObject.parent = object.parent;
+		imageObject.size = object.size;
+		imageObject.offset = object.offset;
+		table.push_back(imageObject);
+	}
+
+	FILE *image = fopen(argv[2], "wb");
+	if (image == NULL) {
+		fprintf(stderr, "mkramfs: can't create %s: %s\n", argv[2], strerror(errno));
+		return 1;
+	}
+
+	bool written = fwrite(&header, sizeof(header), 1, image) == 1 &&
+	               fwrite(table.data(), sizeof(RAMFSImageObject), table.size(), image) == table.size() &&
+	               fwrite(entries.data(), sizeof(RAMFSImageEntry), entries.size(), image) == entries.size() &&
+	               fwrite(names.data(), 1, names.size(), image) == names.size() &&
+	               WritePadding(image, header.dataOffset - header.namesOffset - names.size());
+
+	for (size_t i = 0; i < objects.size() && written; i++) {
+		if (!objects[i].isDirectory) written = WriteFile(image, &objects[i]);
+	}
+
+	if (fclose(image) != 0) written = false;
+
+	if (!written) {
+		fprintf(stderr, "mkramfs: couldn't write %s\n", argv[2]);
+		remove(argv[2]);
+		return 1;
+	}
+
+	printf("mkramfs: %s: %zu objects, %llu bytes\n", argv[2], objects.size(), (unsigned long long)header.imageSize);
+	return 0;
+}